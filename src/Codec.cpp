@@ -0,0 +1,662 @@
+#include "Codec.hpp"
+
+#include <string.h>
+
+using namespace spob;
+using namespace spob::wire;
+
+namespace {
+  // Each archive walks a message's fields in the same order, so one Body
+  // per message describes its encoding for sizing, writing and reading
+
+  size_t
+  VarintBytes(uint64_t v)
+  {
+    size_t n = 1;
+    while (v >= 0x80) {
+      v >>= 7;
+      n++;
+    }
+    return n;
+  }
+
+  class Sizer {
+  public:
+    static const bool kReading = false;
+    Sizer() : size_(kHeaderBytes) {}
+    void Primary(uint32_t& primary) {}
+    void Flag(bool& b) {}
+    void Varint(uint64_t v) { size_ += VarintBytes(v); }
+    void Rank(uint32_t& rank) { Varint(rank); }
+    void Count(uint64_t& count) { Varint(count); }
+    void Mid(uint64_t& mid)
+    {
+      Varint(mid >> 32);
+      Varint(mid & 0xffffffff);
+    }
+    void Bytes(Payload& p)
+    {
+      Varint(p.size());
+      size_ += p.size();
+    }
+    size_t size() const { return size_; }
+  private:
+    size_t size_;
+  };
+
+  class Writer {
+  public:
+    static const bool kReading = false;
+    explicit Writer(char* buf)
+      : start_(buf), p_(buf + kHeaderBytes), flags_(0), bit_(0), primary_(0)
+    {
+    }
+    void Primary(uint32_t& primary) { primary_ = primary; }
+    void Flag(bool& b)
+    {
+      if (b) {
+        flags_ |= 1 << bit_;
+      }
+      bit_++;
+    }
+    void Varint(uint64_t v)
+    {
+      while (v >= 0x80) {
+        *p_++ = static_cast<char>(v | 0x80);
+        v >>= 7;
+      }
+      *p_++ = static_cast<char>(v);
+    }
+    void Rank(uint32_t& rank) { Varint(rank); }
+    void Count(uint64_t& count) { Varint(count); }
+    void Mid(uint64_t& mid)
+    {
+      Varint(mid >> 32);
+      Varint(mid & 0xffffffff);
+    }
+    void Bytes(Payload& p)
+    {
+      Varint(p.size());
+      memcpy(p_, p.data(), p.size());
+      p_ += p.size();
+    }
+    // Fills in the header once the body is written
+    void Finish(Type type)
+    {
+      uint32_t length = p_ - start_;
+      Put(start_, length, 4);
+      Put(start_ + 4, type, 2);
+      Put(start_ + 6, flags_, 2);
+      Put(start_ + 8, primary_, 4);
+    }
+  private:
+    static void Put(char* p, uint32_t v, size_t n)
+    {
+      for (size_t i = 0; i < n; ++i) {
+        p[i] = static_cast<char>(v >> (8 * i));
+      }
+    }
+    char* start_;
+    char* p_;
+    uint16_t flags_;
+    uint32_t bit_;
+    uint32_t primary_;
+  };
+
+  class Reader {
+  public:
+    static const bool kReading = true;
+    Reader(const char* data, const Header& header)
+      : p_(data + kHeaderBytes), end_(data + header.length_),
+        header_(header), bit_(0), ok_(true)
+    {
+    }
+    void Primary(uint32_t& primary) { primary = header_.primary_; }
+    void Flag(bool& b)
+    {
+      b = header_.flags_ & (1 << bit_);
+      bit_++;
+    }
+    uint64_t Varint()
+    {
+      uint64_t v = 0;
+      for (uint32_t shift = 0; ok_ && shift < 64; shift += 7) {
+        if (p_ == end_) {
+          break;
+        }
+        uint8_t byte = *p_++;
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+          return v;
+        }
+      }
+      ok_ = false;
+      return 0;
+    }
+    void Rank(uint32_t& rank)
+    {
+      uint64_t v = Varint();
+      ok_ = ok_ && v <= 0xffffffff;
+      rank = v;
+    }
+    void Count(uint64_t& count) { count = Varint(); }
+    void Mid(uint64_t& mid)
+    {
+      uint64_t epoch = Varint();
+      uint64_t seq = Varint();
+      ok_ = ok_ && epoch <= 0xffffffff && seq <= 0xffffffff;
+      mid = epoch << 32 | seq;
+    }
+    void Bytes(Payload& p)
+    {
+      uint64_t size = Varint();
+      if (!ok_ || size > static_cast<uint64_t>(end_ - p_)) {
+        ok_ = false;
+        return;
+      }
+      p = Payload(std::string(p_, size));
+      p_ += size;
+    }
+    // How many more items of at least min bytes could be left
+    bool Fits(uint64_t count, size_t min) const
+    {
+      return count <= static_cast<uint64_t>(end_ - p_) / min;
+    }
+    void Fail() { ok_ = false; }
+    bool ok() const { return ok_; }
+    // Everything in the message, and nothing more, was read
+    bool Done() const { return ok_ && p_ == end_; }
+  private:
+    const char* p_;
+    const char* end_;
+    Header header_;
+    uint32_t bit_;
+    bool ok_;
+  };
+
+  // Lists are written as a count and their elements. Consecutive mids
+  // differ by one, so all but the first go as the difference
+  template <typename Archive>
+  void
+  Transactions(Archive& a, std::vector<Transaction>& ts)
+  {
+    uint64_t count = ts.size();
+    a.Count(count);
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count; ++i) {
+      uint64_t mid = ts[i].first;
+      if (i == 0) {
+        a.Mid(mid);
+      } else {
+        a.Varint(mid - prev);
+      }
+      prev = mid;
+      a.Bytes(ts[i].second);
+    }
+  }
+
+  void
+  Transactions(Reader& r, std::vector<Transaction>& ts)
+  {
+    uint64_t count = r.Varint();
+    // Each takes at least a byte for its mid and one for its length
+    if (!r.Fits(count, 2)) {
+      r.Fail();
+      return;
+    }
+    ts.resize(count);
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count && r.ok(); ++i) {
+      if (i == 0) {
+        r.Mid(ts[i].first);
+      } else {
+        ts[i].first = prev + r.Varint();
+      }
+      prev = ts[i].first;
+      r.Bytes(ts[i].second);
+    }
+  }
+
+  template <typename Archive>
+  void
+  Ranks(Archive& a, Ancestors& ranks)
+  {
+    uint64_t count = ranks.size();
+    a.Count(count);
+    for (size_t i = 0; i < count; ++i) {
+      a.Rank(ranks[i]);
+    }
+  }
+
+  void
+  Ranks(Reader& r, Ancestors& ranks)
+  {
+    uint64_t count = r.Varint();
+    if (!r.Fits(count, 1)) {
+      r.Fail();
+      return;
+    }
+    ranks.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      r.Rank(ranks[i]);
+    }
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, ConstructTree& ct)
+  {
+    a.Rank(ct.max_rank_);
+    a.Count(ct.count_);
+    Ranks(a, ct.ancestors_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, AckTree& at)
+  {
+    a.Primary(at.primary_);
+    a.Count(at.count_);
+    a.Mid(at.last_mid_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, NakTree& nt)
+  {
+    a.Primary(nt.primary_);
+    a.Count(nt.count_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, RecoverPropose& rp)
+  {
+    a.Primary(rp.primary_);
+    bool trunc = rp.type_ == RecoverPropose::kTrunc;
+    a.Flag(trunc);
+    a.Flag(rp.more_);
+    if (Archive::kReading) {
+      rp.type_ = trunc ? RecoverPropose::kTrunc : RecoverPropose::kDiff;
+      rp.last_mid_ = 0;
+    }
+    if (trunc) {
+      a.Mid(rp.last_mid_);
+    } else {
+      Transactions(a, rp.proposals_);
+    }
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, AckRecover& ar)
+  {
+    a.Primary(ar.primary_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, AckRecoverChunk& arc)
+  {
+    a.Primary(arc.primary_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, RecoverCommit& rc)
+  {
+    a.Primary(rc.primary_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, RecoverReconnect& rr)
+  {
+    a.Primary(rr.primary_);
+    a.Flag(rr.got_propose_);
+    a.Flag(rr.acked_);
+    a.Count(rr.count_);
+    a.Rank(rr.max_rank_);
+    a.Mid(rr.last_proposed_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, Propose& p)
+  {
+    a.Primary(p.primary_);
+    a.Mid(p.last_committed_);
+    a.Mid(p.proposal_.first);
+    a.Bytes(p.proposal_.second);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, ProposeBatch& pb)
+  {
+    a.Primary(pb.primary_);
+    a.Mid(pb.last_committed_);
+    Transactions(a, pb.proposals_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, Ack& ack)
+  {
+    a.Primary(ack.primary_);
+    a.Mid(ack.mid_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, Commit& c)
+  {
+    a.Primary(c.primary_);
+    a.Mid(c.mid_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, Reconnect& r)
+  {
+    a.Primary(r.primary_);
+    a.Rank(r.max_rank_);
+    a.Mid(r.last_proposed_);
+    a.Mid(r.last_acked_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, ReconnectResponse& rr)
+  {
+    a.Primary(rr.primary_);
+    a.Mid(rr.last_committed_);
+    a.Flag(rr.more_);
+    Transactions(a, rr.proposals_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, Snapshot& s)
+  {
+    a.Primary(s.primary_);
+    a.Mid(s.mid_);
+    a.Bytes(s.state_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, Observe& o)
+  {
+    a.Mid(o.last_committed_);
+  }
+
+  template <typename Archive>
+  void
+  Body(Archive& a, ObserveCommit& oc)
+  {
+    a.Mid(oc.after_);
+    Transactions(a, oc.proposals_);
+  }
+
+  template <typename T>
+  size_t
+  EncodeAs(Type type, const T& m, char* buf, size_t size)
+  {
+    // The archives take fields by reference so that reading can fill
+    // them in, but only Reader ever writes through them
+    T& fields = const_cast<T&>(m);
+    Sizer sizer;
+    Body(sizer, fields);
+    if (sizer.size() <= size) {
+      Writer writer(buf);
+      Body(writer, fields);
+      writer.Finish(type);
+    }
+    return sizer.size();
+  }
+
+  template <typename T>
+  bool
+  DecodeAs(Type type, const char* data, size_t size, T* m)
+  {
+    Header header;
+    if (!DecodeHeader(data, size, &header) || header.type_ != type ||
+        header.length_ > size) {
+      return false;
+    }
+    Reader reader(data, header);
+    Body(reader, *m);
+    return reader.Done();
+  }
+
+  uint32_t
+  Get(const char* p, size_t n)
+  {
+    uint32_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+      v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    return v;
+  }
+}
+
+bool
+spob::wire::DecodeHeader(const char* data, size_t size, Header* header)
+{
+  if (size < kHeaderBytes) {
+    return false;
+  }
+  header->length_ = Get(data, 4);
+  header->type_ = Get(data + 4, 2);
+  header->flags_ = Get(data + 6, 2);
+  header->primary_ = Get(data + 8, 4);
+  return header->length_ >= kHeaderBytes && header->type_ >= kConstructTree &&
+    header->type_ <= kObserveCommit;
+}
+
+size_t
+spob::wire::Encode(const ConstructTree& ct, char* buf, size_t size)
+{
+  return EncodeAs(kConstructTree, ct, buf, size);
+}
+
+size_t
+spob::wire::Encode(const AckTree& at, char* buf, size_t size)
+{
+  return EncodeAs(kAckTree, at, buf, size);
+}
+
+size_t
+spob::wire::Encode(const NakTree& nt, char* buf, size_t size)
+{
+  return EncodeAs(kNakTree, nt, buf, size);
+}
+
+size_t
+spob::wire::Encode(const RecoverPropose& rp, char* buf, size_t size)
+{
+  return EncodeAs(kRecoverPropose, rp, buf, size);
+}
+
+size_t
+spob::wire::Encode(const AckRecover& ar, char* buf, size_t size)
+{
+  return EncodeAs(kAckRecover, ar, buf, size);
+}
+
+size_t
+spob::wire::Encode(const AckRecoverChunk& arc, char* buf, size_t size)
+{
+  return EncodeAs(kAckRecoverChunk, arc, buf, size);
+}
+
+size_t
+spob::wire::Encode(const RecoverCommit& rc, char* buf, size_t size)
+{
+  return EncodeAs(kRecoverCommit, rc, buf, size);
+}
+
+size_t
+spob::wire::Encode(const RecoverReconnect& rr, char* buf, size_t size)
+{
+  return EncodeAs(kRecoverReconnect, rr, buf, size);
+}
+
+size_t
+spob::wire::Encode(const Propose& p, char* buf, size_t size)
+{
+  return EncodeAs(kPropose, p, buf, size);
+}
+
+size_t
+spob::wire::Encode(const ProposeBatch& pb, char* buf, size_t size)
+{
+  return EncodeAs(kProposeBatch, pb, buf, size);
+}
+
+size_t
+spob::wire::Encode(const Ack& a, char* buf, size_t size)
+{
+  return EncodeAs(kAck, a, buf, size);
+}
+
+size_t
+spob::wire::Encode(const Commit& c, char* buf, size_t size)
+{
+  return EncodeAs(kCommit, c, buf, size);
+}
+
+size_t
+spob::wire::Encode(const Reconnect& r, char* buf, size_t size)
+{
+  return EncodeAs(kReconnect, r, buf, size);
+}
+
+size_t
+spob::wire::Encode(const ReconnectResponse& recon_resp, char* buf,
+                   size_t size)
+{
+  return EncodeAs(kReconnectResponse, recon_resp, buf, size);
+}
+
+size_t
+spob::wire::Encode(const Snapshot& s, char* buf, size_t size)
+{
+  return EncodeAs(kSnapshot, s, buf, size);
+}
+
+size_t
+spob::wire::Encode(const Observe& o, char* buf, size_t size)
+{
+  return EncodeAs(kObserve, o, buf, size);
+}
+
+size_t
+spob::wire::Encode(const ObserveCommit& oc, char* buf, size_t size)
+{
+  return EncodeAs(kObserveCommit, oc, buf, size);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, ConstructTree* ct)
+{
+  return DecodeAs(kConstructTree, data, size, ct);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, AckTree* at)
+{
+  return DecodeAs(kAckTree, data, size, at);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, NakTree* nt)
+{
+  return DecodeAs(kNakTree, data, size, nt);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, RecoverPropose* rp)
+{
+  return DecodeAs(kRecoverPropose, data, size, rp);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, AckRecover* ar)
+{
+  return DecodeAs(kAckRecover, data, size, ar);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, AckRecoverChunk* arc)
+{
+  return DecodeAs(kAckRecoverChunk, data, size, arc);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, RecoverCommit* rc)
+{
+  return DecodeAs(kRecoverCommit, data, size, rc);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, RecoverReconnect* rr)
+{
+  return DecodeAs(kRecoverReconnect, data, size, rr);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, Propose* p)
+{
+  return DecodeAs(kPropose, data, size, p);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, ProposeBatch* pb)
+{
+  return DecodeAs(kProposeBatch, data, size, pb);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, Ack* a)
+{
+  return DecodeAs(kAck, data, size, a);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, Commit* c)
+{
+  return DecodeAs(kCommit, data, size, c);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, Reconnect* r)
+{
+  return DecodeAs(kReconnect, data, size, r);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size,
+                   ReconnectResponse* recon_resp)
+{
+  return DecodeAs(kReconnectResponse, data, size, recon_resp);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, Snapshot* s)
+{
+  return DecodeAs(kSnapshot, data, size, s);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, Observe* o)
+{
+  return DecodeAs(kObserve, data, size, o);
+}
+
+bool
+spob::wire::Decode(const char* data, size_t size, ObserveCommit* oc)
+{
+  return DecodeAs(kObserveCommit, data, size, oc);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Messages.hpp"
+
+namespace spob {
+  // A compact binary encoding of every message. Each starts with a fixed
+  // little-endian header: the length of the whole encoding (header
+  // included), the type, flags for the message's booleans and the
+  // primary. The body is LEB128 varints: a mid as its epoch and sequence
+  // number, later mids in a list as the difference from the one before,
+  // and payloads as a length followed by their raw bytes
+  namespace wire {
+    enum Type {
+      kConstructTree = 1,
+      kAckTree,
+      kNakTree,
+      kRecoverPropose,
+      kAckRecover,
+      kAckRecoverChunk,
+      kRecoverCommit,
+      kRecoverReconnect,
+      kPropose,
+      kProposeBatch,
+      kAck,
+      kCommit,
+      kReconnect,
+      kReconnectResponse,
+      kSnapshot,
+      kObserve,
+      kObserveCommit
+    };
+
+    const size_t kHeaderBytes = 4 + 2 + 2 + 4;
+    struct Header {
+      uint32_t length_;
+      uint16_t type_;
+      uint16_t flags_;
+      uint32_t primary_;
+    };
+
+    // Returns false unless data holds a whole header of a known type.
+    // A stream transport reads length_ from it to find the next message
+    bool DecodeHeader(const char* data, size_t size, Header* header);
+
+    // Encode returns the length of the encoding, and writes it to buf
+    // only if it fits in size
+    size_t Encode(const ConstructTree& ct, char* buf, size_t size);
+    size_t Encode(const AckTree& at, char* buf, size_t size);
+    size_t Encode(const NakTree& nt, char* buf, size_t size);
+    size_t Encode(const RecoverPropose& rp, char* buf, size_t size);
+    size_t Encode(const AckRecover& ar, char* buf, size_t size);
+    size_t Encode(const AckRecoverChunk& arc, char* buf, size_t size);
+    size_t Encode(const RecoverCommit& rc, char* buf, size_t size);
+    size_t Encode(const RecoverReconnect& rr, char* buf, size_t size);
+    size_t Encode(const Propose& p, char* buf, size_t size);
+    size_t Encode(const ProposeBatch& pb, char* buf, size_t size);
+    size_t Encode(const Ack& a, char* buf, size_t size);
+    size_t Encode(const Commit& c, char* buf, size_t size);
+    size_t Encode(const Reconnect& r, char* buf, size_t size);
+    size_t Encode(const ReconnectResponse& recon_resp, char* buf, size_t size);
+    size_t Encode(const Snapshot& s, char* buf, size_t size);
+    size_t Encode(const Observe& o, char* buf, size_t size);
+    size_t Encode(const ObserveCommit& oc, char* buf, size_t size);
+    // Decode fails unless data starts with a whole, well formed message of
+    // the right type
+    bool Decode(const char* data, size_t size, ConstructTree* ct);
+    bool Decode(const char* data, size_t size, AckTree* at);
+    bool Decode(const char* data, size_t size, NakTree* nt);
+    bool Decode(const char* data, size_t size, RecoverPropose* rp);
+    bool Decode(const char* data, size_t size, AckRecover* ar);
+    bool Decode(const char* data, size_t size, AckRecoverChunk* arc);
+    bool Decode(const char* data, size_t size, RecoverCommit* rc);
+    bool Decode(const char* data, size_t size, RecoverReconnect* rr);
+    bool Decode(const char* data, size_t size, Propose* p);
+    bool Decode(const char* data, size_t size, ProposeBatch* pb);
+    bool Decode(const char* data, size_t size, Ack* a);
+    bool Decode(const char* data, size_t size, Commit* c);
+    bool Decode(const char* data, size_t size, Reconnect* r);
+    bool Decode(const char* data, size_t size, ReconnectResponse* recon_resp);
+    bool Decode(const char* data, size_t size, Snapshot* s);
+    bool Decode(const char* data, size_t size, Observe* o);
+    bool Decode(const char* data, size_t size, ObserveCommit* oc);
+
+    template <typename T, typename Visitor>
+    bool
+    DispatchAs(const char* data, size_t size, Visitor& visitor)
+    {
+      T m;
+      if (!Decode(data, size, &m)) {
+        return false;
+      }
+      visitor(m);
+      return true;
+    }
+
+    // Decodes whichever message data holds and hands it to visitor.
+    // Returns false if it is malformed
+    template <typename Visitor>
+    bool
+    Dispatch(const char* data, size_t size, Visitor& visitor)
+    {
+      Header header;
+      if (!DecodeHeader(data, size, &header)) {
+        return false;
+      }
+      switch (header.type_) {
+      case kConstructTree:
+        return DispatchAs<ConstructTree>(data, size, visitor);
+      case kAckTree:
+        return DispatchAs<AckTree>(data, size, visitor);
+      case kNakTree:
+        return DispatchAs<NakTree>(data, size, visitor);
+      case kRecoverPropose:
+        return DispatchAs<RecoverPropose>(data, size, visitor);
+      case kAckRecover:
+        return DispatchAs<AckRecover>(data, size, visitor);
+      case kAckRecoverChunk:
+        return DispatchAs<AckRecoverChunk>(data, size, visitor);
+      case kRecoverCommit:
+        return DispatchAs<RecoverCommit>(data, size, visitor);
+      case kRecoverReconnect:
+        return DispatchAs<RecoverReconnect>(data, size, visitor);
+      case kPropose:
+        return DispatchAs<Propose>(data, size, visitor);
+      case kProposeBatch:
+        return DispatchAs<ProposeBatch>(data, size, visitor);
+      case kAck:
+        return DispatchAs<Ack>(data, size, visitor);
+      case kCommit:
+        return DispatchAs<Commit>(data, size, visitor);
+      case kReconnect:
+        return DispatchAs<Reconnect>(data, size, visitor);
+      case kReconnectResponse:
+        return DispatchAs<ReconnectResponse>(data, size, visitor);
+      case kSnapshot:
+        return DispatchAs<Snapshot>(data, size, visitor);
+      case kObserve:
+        return DispatchAs<Observe>(data, size, visitor);
+      case kObserveCommit:
+        return DispatchAs<ObserveCommit>(data, size, visitor);
+      }
+      return false;
+    }
+  }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Spob.hpp"
+
+namespace spob {
+  // Several independent groups, each its own StateMachine with its own
+  // primary and order, can share the same processes. Each group numbers
+  // the processes from a different starting point, so that the lowest
+  // rank, and with it the first primary, of group g is process g % size.
+  // Observers, from size up, keep their rank in every group
+  class GroupRanks {
+  public:
+    GroupRanks() : offset_(0), size_(0) {}
+    GroupRanks(uint32_t group, uint32_t size)
+      : offset_(group % size), size_(size) {}
+
+    uint32_t ToGroup(uint32_t process) const
+    {
+      return process < size_ ? (process + size_ - offset_) % size_ : process;
+    }
+    uint32_t ToProcess(uint32_t rank) const
+    {
+      return rank < size_ ? (rank + offset_) % size_ : rank;
+    }
+  private:
+    uint32_t offset_;
+    uint32_t size_;
+  };
+
+  // One group's view of a transport shared by every group. The transport
+  // provides Send(message, group, process) for each message type and
+  // hands what it receives for the group to its StateMachine, after
+  // mapping the sender through the group's GroupRanks
+  template <typename Transport>
+  class GroupCommunicator : public CommunicatorInterface {
+  public:
+    GroupCommunicator(Transport& transport, uint32_t group,
+                      const GroupRanks& ranks)
+      : transport_(transport), group_(group), ranks_(ranks) {}
+
+    void Send(const ConstructTree& ct, uint32_t to) { DoSend(ct, to); }
+    void Send(const AckTree& at, uint32_t to) { DoSend(at, to); }
+    void Send(const NakTree& nt, uint32_t to) { DoSend(nt, to); }
+    void Send(const RecoverPropose& rp, uint32_t to) { DoSend(rp, to); }
+    void Send(const AckRecover& ar, uint32_t to) { DoSend(ar, to); }
+    void Send(const AckRecoverChunk& arc, uint32_t to) { DoSend(arc, to); }
+    void Send(const RecoverCommit& rc, uint32_t to) { DoSend(rc, to); }
+    void Send(const RecoverReconnect& rr, uint32_t to) { DoSend(rr, to); }
+    void Send(const Propose& p, uint32_t to) { DoSend(p, to); }
+    void Send(const ProposeBatch& pb, uint32_t to) { DoSend(pb, to); }
+    void Send(const Ack& a, uint32_t to) { DoSend(a, to); }
+    void Send(const Commit& c, uint32_t to) { DoSend(c, to); }
+    void Send(const Reconnect& r, uint32_t to) { DoSend(r, to); }
+    void Send(const ReconnectResponse& recon_resp, uint32_t to)
+    {
+      DoSend(recon_resp, to);
+    }
+    void Send(const Snapshot& s, uint32_t to) { DoSend(s, to); }
+    void Send(const Observe& o, uint32_t to) { DoSend(o, to); }
+    void Send(const ObserveCommit& oc, uint32_t to) { DoSend(oc, to); }
+  private:
+    template <typename T>
+    void DoSend(const T& t, uint32_t to)
+    {
+      transport_.Send(t, group_, ranks_.ToProcess(to));
+    }
+
+    Transport& transport_;
+    uint32_t group_;
+    GroupRanks ranks_;
+  };
+}
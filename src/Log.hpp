@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include <boost/iterator/iterator_facade.hpp>
+
+namespace spob {
+  // The proposals a process holds, in mid order. Entries are appended
+  // at the back, committed from the front and truncated from the back,
+  // so they live in a ring buffer that grows on demand. Mids are dense
+  // within an epoch, so a lookup is index arithmetic; a log spanning an
+  // epoch boundary falls back to a binary search.
+  template <typename T>
+  class Log {
+  public:
+    typedef std::pair<uint64_t, T> value_type;
+
+    template <typename Value, typename LogPtr>
+    class Iterator
+      : public boost::iterator_facade<Iterator<Value, LogPtr>, Value,
+                                      boost::random_access_traversal_tag> {
+    public:
+      Iterator() : log_(0), pos_(0) {}
+      Iterator(LogPtr log, size_t pos) : log_(log), pos_(pos) {}
+      template <typename OtherValue, typename OtherLogPtr>
+      Iterator(const Iterator<OtherValue, OtherLogPtr>& other)
+        : log_(other.log_), pos_(other.pos_) {}
+    private:
+      friend class boost::iterator_core_access;
+      template <typename, typename> friend class Iterator;
+      Value& dereference() const { return log_->At(pos_); }
+      template <typename OtherValue, typename OtherLogPtr>
+      bool equal(const Iterator<OtherValue, OtherLogPtr>& other) const
+      {
+        return pos_ == other.pos_;
+      }
+      void increment() { ++pos_; }
+      void decrement() { --pos_; }
+      void advance(std::ptrdiff_t n) { pos_ += n; }
+      template <typename OtherValue, typename OtherLogPtr>
+      std::ptrdiff_t
+      distance_to(const Iterator<OtherValue, OtherLogPtr>& other) const
+      {
+        return static_cast<std::ptrdiff_t>(other.pos_) -
+          static_cast<std::ptrdiff_t>(pos_);
+      }
+      LogPtr log_;
+      size_t pos_;
+    };
+    typedef Iterator<value_type, Log*> iterator;
+    typedef Iterator<const value_type, const Log*> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    Log() : head_(0), size_(0) {}
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, size_); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size_); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const
+    {
+      return const_reverse_iterator(end());
+    }
+    const_reverse_iterator rend() const
+    {
+      return const_reverse_iterator(begin());
+    }
+
+    value_type& front() { return At(0); }
+    const value_type& front() const { return At(0); }
+    value_type& back() { return At(size_ - 1); }
+    const value_type& back() const { return At(size_ - 1); }
+
+    // First entry with a mid greater than mid
+    iterator upper_bound(uint64_t mid)
+    {
+      return iterator(this, UpperBound(mid));
+    }
+    const_iterator upper_bound(uint64_t mid) const
+    {
+      return const_iterator(this, UpperBound(mid));
+    }
+    size_t count(uint64_t mid) const
+    {
+      size_t pos = UpperBound(mid);
+      return (pos > 0 && At(pos - 1).first == mid) ? 1 : 0;
+    }
+
+    void push_back(const value_type& v)
+    {
+      assert(empty() || v.first > back().first);
+      if (size_ == buf_.size()) {
+        Grow();
+      }
+      At(size_) = v;
+      size_++;
+    }
+    void pop_front()
+    {
+      assert(!empty());
+      At(0) = value_type();
+      head_ = (head_ + 1) & (buf_.size() - 1);
+      size_--;
+    }
+    // Only a prefix or a suffix of the log can be erased
+    void erase(const_iterator first, const_iterator last)
+    {
+      size_t from = first - begin();
+      size_t to = last - begin();
+      if (from == 0) {
+        while (to-- > 0) {
+          pop_front();
+        }
+      } else {
+        assert(to == size_);
+        while (size_ > from) {
+          size_--;
+          At(size_) = value_type();
+        }
+      }
+    }
+    void clear()
+    {
+      erase(begin(), end());
+      head_ = 0;
+    }
+
+  private:
+    value_type& At(size_t pos)
+    {
+      return buf_[(head_ + pos) & (buf_.size() - 1)];
+    }
+    const value_type& At(size_t pos) const
+    {
+      return buf_[(head_ + pos) & (buf_.size() - 1)];
+    }
+    static bool MidLess(uint64_t mid, const value_type& v)
+    {
+      return mid < v.first;
+    }
+    size_t UpperBound(uint64_t mid) const
+    {
+      if (empty() || mid < front().first) {
+        return 0;
+      } else if (mid >= back().first) {
+        return size_;
+      } else if (back().first - front().first + 1 == size_) {
+        return mid - front().first + 1;
+      }
+      return std::upper_bound(begin(), end(), mid, MidLess) - begin();
+    }
+    void Grow()
+    {
+      // Capacity stays a power of two so positions wrap with a mask
+      std::vector<value_type> buf(buf_.empty() ? 16 : buf_.size() * 2);
+      for (size_t i = 0; i < size_; ++i) {
+        buf[i] = At(i);
+      }
+      buf_.swap(buf);
+      head_ = 0;
+    }
+
+    std::vector<value_type> buf_;
+    size_t head_;
+    size_t size_;
+  };
+}
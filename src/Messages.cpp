@@ -3,8 +3,13 @@
 #include <algorithm>
 #include <iterator>
 #include <sstream>
+#include <utility>
+
+#include <boost/make_shared.hpp>
 
 namespace {
+  const std::string empty_payload;
+
   std::string
   TransactionToString(const spob::Transaction &t)
   {
@@ -15,6 +20,32 @@ namespace {
   }
 }
 
+spob::Payload::Payload()
+{
+}
+
+spob::Payload::Payload(const std::string& data)
+  : data_(boost::make_shared<const std::string>(data))
+{
+}
+
+spob::Payload::Payload(std::string&& data)
+  : data_(boost::make_shared<const std::string>(std::move(data)))
+{
+}
+
+const std::string&
+spob::Payload::str() const
+{
+  return data_ ? *data_ : empty_payload;
+}
+
+std::ostream&
+spob::operator<<(std::ostream& strm, const spob::Payload& p)
+{
+  return strm << p.str();
+}
+
 std::ostream&
 spob::operator<<(std::ostream& strm, const spob::ConstructTree& ct)
 {
@@ -64,7 +95,7 @@ spob::operator<<(std::ostream& strm, const spob::RecoverPropose& rp)
                      TransactionToString);
       strm << TransactionToString(rp.proposals_.back());
     }
-    strm << "}";
+    strm << "}, more: " << rp.more_;
     break;
   case spob::RecoverPropose::kTrunc:
     strm << "TRUNC: {" <<
@@ -83,6 +114,14 @@ spob::operator<<(std::ostream& strm, const spob::AckRecover& ar)
     "}";
 }
 
+std::ostream&
+spob::operator<<(std::ostream& strm, const spob::AckRecoverChunk& arc)
+{
+  return strm << "AckRecoverChunk {" <<
+    "primary: " << arc.primary_ <<
+    "}";
+}
+
 std::ostream&
 spob::operator<<(std::ostream& strm, const spob::RecoverCommit& rc)
 {
@@ -96,6 +135,7 @@ spob::operator<<(std::ostream& strm, const spob::RecoverReconnect& rr)
 {
   return strm << "RecoverReconnect {" <<
     "primary: " << rr.primary_ <<
+    ", count: " << rr.count_ <<
     ", max_rank: " << rr.max_rank_ <<
     ", last_proposed: 0x" << std::hex << rr.last_proposed_ << std::dec <<
     ", got_propose: " << rr.got_propose_ <<
@@ -108,10 +148,27 @@ spob::operator<<(std::ostream& strm, const spob::Propose& p)
 {
   return strm << "Propose {" <<
     "primary: " << p.primary_ <<
+    ", last_committed: 0x" << std::hex << p.last_committed_ << std::dec <<
     ", proposal: " << TransactionToString(p.proposal_) <<
     "}";
 }
 
+std::ostream&
+spob::operator<<(std::ostream& strm, const spob::ProposeBatch& pb)
+{
+  strm << "ProposeBatch {" <<
+    "primary: " << pb.primary_ <<
+    ", last_committed: 0x" << std::hex << pb.last_committed_ << std::dec <<
+    ", proposals: {";
+  if (!pb.proposals_.empty()) {
+    std::transform(pb.proposals_.begin(), --(pb.proposals_.end()),
+                   std::ostream_iterator<std::string>(strm, ", "),
+                   TransactionToString);
+    strm << TransactionToString(pb.proposals_.back());
+  }
+  return strm << "}}";
+}
+
 std::ostream&
 spob::operator<<(std::ostream& strm, const spob::Ack& a)
 {
@@ -154,5 +211,38 @@ spob::operator<<(std::ostream& strm, const spob::ReconnectResponse& rr)
                    TransactionToString);
     strm << TransactionToString(rr.proposals_.back());
   }
+  return strm << "}, more: " << rr.more_ << "}";
+}
+
+std::ostream&
+spob::operator<<(std::ostream& strm, const spob::Observe& o)
+{
+  return strm << "Observe {" <<
+    "last_committed: 0x" << std::hex << o.last_committed_ << std::dec <<
+    "}";
+}
+
+std::ostream&
+spob::operator<<(std::ostream& strm, const spob::ObserveCommit& oc)
+{
+  strm << "ObserveCommit {" <<
+    "after: 0x" << std::hex << oc.after_ << std::dec <<
+    ", proposals: {";
+  if (!oc.proposals_.empty()) {
+    std::transform(oc.proposals_.begin(), --(oc.proposals_.end()),
+                   std::ostream_iterator<std::string>(strm, ", "),
+                   TransactionToString);
+    strm << TransactionToString(oc.proposals_.back());
+  }
   return strm << "}}";
 }
+
+std::ostream&
+spob::operator<<(std::ostream& strm, const spob::Snapshot& s)
+{
+  return strm << "Snapshot {" <<
+    "primary: " << s.primary_ <<
+    ", mid: 0x" << std::hex << s.mid_ << std::dec <<
+    ", state: " << s.state_.size() << " bytes" <<
+    "}";
+}
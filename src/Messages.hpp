@@ -2,15 +2,39 @@
 
 #include <stdint.h>
 
-#include <list>
 #include <ostream>
 #include <string>
+#include <vector>
+
+#include <boost/container/small_vector.hpp>
+#include <boost/shared_ptr.hpp>
 
 namespace spob {
+  // An immutable, reference counted message body. Copies share one
+  // buffer, so forwarding, logging and delivering a proposal never
+  // copies its bytes
+  class Payload {
+  public:
+    Payload();
+    explicit Payload(const std::string& data);
+    explicit Payload(std::string&& data);
+    const std::string& str() const;
+    const char* data() const { return str().data(); }
+    size_t size() const { return str().size(); }
+    void swap(Payload& other) { data_.swap(other.data_); }
+  private:
+    boost::shared_ptr<const std::string> data_;
+  };
+  std::ostream& operator<<(std::ostream& strm, const Payload& p);
+
+  // A chain of ancestors is only as long as the tree is deep, so short
+  // ones are kept inline
+  typedef boost::container::small_vector<uint32_t, 8> Ancestors;
+
   struct ConstructTree {
     uint32_t max_rank_;
     uint64_t count_;
-    std::list<uint32_t> ancestors_;
+    Ancestors ancestors_;
   };
   std::ostream& operator<<(std::ostream& strm, const ConstructTree& ct);
 
@@ -27,7 +51,7 @@ namespace spob {
   };
   std::ostream& operator<<(std::ostream& strm, const NakTree& nt);
 
-  typedef std::pair<uint64_t, std::string> Transaction;
+  typedef std::pair<uint64_t, Payload> Transaction;
   std::ostream& operator<<(std::ostream& strm, const Transaction& t);
 
   struct RecoverPropose {
@@ -37,8 +61,9 @@ namespace spob {
     };
     uint32_t primary_;
     RecoverType type_;
-    std::list<Transaction> proposals_; // for diff
+    std::vector<Transaction> proposals_; // for diff
     uint64_t last_mid_; // for trunc
+    bool more_; // further chunks of the diff follow
   };
   std::ostream& operator<<(std::ostream& strm, const RecoverPropose& rp);
 
@@ -47,6 +72,12 @@ namespace spob {
   };
   std::ostream& operator<<(std::ostream& strm, const AckRecover& ar);
 
+  // Returns the credit for one chunk of a recovery diff
+  struct AckRecoverChunk {
+    uint32_t primary_;
+  };
+  std::ostream& operator<<(std::ostream& strm, const AckRecoverChunk& arc);
+
   struct RecoverCommit {
     uint32_t primary_;
   };
@@ -54,6 +85,7 @@ namespace spob {
 
   struct RecoverReconnect {
     uint32_t primary_;
+    uint64_t count_;
     uint32_t max_rank_;
     uint64_t last_proposed_;
     bool got_propose_;
@@ -63,10 +95,18 @@ namespace spob {
 
   struct Propose {
     uint32_t primary_;
+    uint64_t last_committed_;
     Transaction proposal_;
   };
   std::ostream& operator<<(std::ostream& strm, const Propose& p);
 
+  struct ProposeBatch {
+    uint32_t primary_;
+    uint64_t last_committed_;
+    std::vector<Transaction> proposals_;
+  };
+  std::ostream& operator<<(std::ostream& strm, const ProposeBatch& pb);
+
   struct Ack {
     uint32_t primary_;
     uint64_t mid_;
@@ -90,10 +130,36 @@ namespace spob {
   struct ReconnectResponse {
     uint32_t primary_;
     uint64_t last_committed_;
-    std::list<Transaction> proposals_;
+    std::vector<Transaction> proposals_;
+    bool more_; // further chunks of the catch-up follow
   };
   std::ostream& operator<<(std::ostream& strm, const ReconnectResponse& rr);
 
+  // Attaches an observer to a host, which passes on everything committed
+  // after last_committed_
+  struct Observe {
+    uint64_t last_committed_;
+  };
+  std::ostream& operator<<(std::ostream& strm, const Observe& o);
+
+  // Committed proposals a host passes on to its observers, following on
+  // from after_. A host that can't catch an observer up refuses it with
+  // an empty run after its own commit point
+  struct ObserveCommit {
+    uint64_t after_;
+    std::vector<Transaction> proposals_;
+  };
+  std::ostream& operator<<(std::ostream& strm, const ObserveCommit& oc);
+
+  // The application state produced by every proposal up to and
+  // including mid, standing in for proposals the sender no longer logs
+  struct Snapshot {
+    uint32_t primary_;
+    uint64_t mid_;
+    Payload state_;
+  };
+  std::ostream& operator<<(std::ostream& strm, const Snapshot& s);
+
   struct Failure {
     uint32_t rank_;
   };
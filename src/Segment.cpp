@@ -0,0 +1,254 @@
+#include "Segment.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <system_error>
+
+#include "Wal.hpp"
+
+using namespace spob;
+
+namespace {
+  const uint64_t kMagic = 0x31474553424f5053ULL; // "SPOBSEG1"
+  const uint32_t kVersion = 1;
+
+  struct Header {
+    uint64_t magic_;
+    uint32_t version_;
+    uint32_t header_bytes_;
+    uint64_t capacity_;
+    // Just past the last published record
+    std::atomic<uint64_t> tail_;
+    // Set once the writer has moved on to the next segment
+    std::atomic<uint32_t> sealed_;
+  };
+  // Records start on the first cache line after the header
+  const uint64_t kHeaderBytes = 64;
+  static_assert(sizeof(Header) <= kHeaderBytes, "segment header too large");
+
+  // type, payload length and mid, records are padded to 8 bytes
+  const uint64_t kRecordHeader = 4 + 4 + 8;
+
+  uint64_t
+  RecordBytes(uint64_t size)
+  {
+    return (kRecordHeader + size + 7) & ~7ULL;
+  }
+
+  void
+  Fail(const std::string& what)
+  {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  std::string
+  SegmentPath(const std::string& path, uint64_t segment)
+  {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%08llx",
+             static_cast<unsigned long long>(segment));
+    return path + suffix;
+  }
+}
+
+SegmentWriter::SegmentWriter(const std::string& path, uint64_t segment_bytes)
+  : path_(path), segment_bytes_(segment_bytes), segment_(0), map_(0),
+    capacity_(0), tail_(0)
+{
+  // Segments go next to path, in a directory that may not exist yet
+  size_t slash = path_.rfind('/');
+  if (slash != std::string::npos && slash > 0) {
+    MakeDirs(path_.substr(0, slash));
+  }
+  Roll(0);
+}
+
+SegmentWriter::~SegmentWriter()
+{
+  if (map_) {
+    munmap(map_, capacity_);
+  }
+}
+
+void
+SegmentWriter::Append(const Transaction* first, const Transaction* last)
+{
+  for (; first != last; ++first) {
+    Write(SegmentReader::Record::kTransaction, first->first, first->second);
+  }
+  Publish();
+}
+
+void
+SegmentWriter::Snapshot(uint64_t mid, const Payload& state)
+{
+  Write(SegmentReader::Record::kSnapshot, mid, state);
+  Publish();
+}
+
+void
+SegmentWriter::Write(uint32_t type, uint64_t mid, const Payload& payload)
+{
+  uint64_t bytes = RecordBytes(payload.size());
+  if (tail_ + bytes > capacity_) {
+    Publish();
+    Roll(bytes);
+  }
+  char* p = map_ + tail_;
+  uint32_t length = payload.size();
+  memcpy(p, &type, 4);
+  memcpy(p + 4, &length, 4);
+  memcpy(p + 8, &mid, 8);
+  memcpy(p + kRecordHeader, payload.data(), length);
+  tail_ += bytes;
+}
+
+void
+SegmentWriter::Publish()
+{
+  reinterpret_cast<Header*>(map_)->tail_.store(tail_,
+                                               std::memory_order_release);
+}
+
+void
+SegmentWriter::Roll(uint64_t bytes)
+{
+  // Set up the next segment before sealing this one, so a reader that
+  // follows the seal never finds a segment left over from an older run
+  uint64_t capacity = std::max(segment_bytes_, kHeaderBytes + bytes);
+  std::string path = SegmentPath(path_, map_ ? segment_ + 1 : segment_);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    Fail("open " + path);
+  }
+  if (ftruncate(fd, capacity) != 0) {
+    close(fd);
+    Fail("ftruncate " + path);
+  }
+  void* map = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    Fail("mmap " + path);
+  }
+  Header* header = new (map) Header;
+  header->version_ = kVersion;
+  header->header_bytes_ = kHeaderBytes;
+  header->capacity_ = capacity;
+  header->tail_.store(kHeaderBytes, std::memory_order_relaxed);
+  header->sealed_.store(0, std::memory_order_relaxed);
+  // Readers take a segment to be ready once they see the magic
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic_ = kMagic;
+
+  if (map_) {
+    reinterpret_cast<Header*>(map_)->sealed_.store(1,
+                                                   std::memory_order_release);
+    munmap(map_, capacity_);
+    segment_++;
+  }
+  map_ = static_cast<char*>(map);
+  capacity_ = capacity;
+  tail_ = kHeaderBytes;
+}
+
+SegmentReader::SegmentReader(const std::string& path)
+  : path_(path), segment_(0), map_(0), capacity_(0), offset_(0)
+{
+}
+
+SegmentReader::~SegmentReader()
+{
+  Unmap();
+}
+
+bool
+SegmentReader::Next(Record* record)
+{
+  while (map_ || Map()) {
+    const Header* header = reinterpret_cast<const Header*>(map_);
+    // Check for the seal first, so that once it is set the tail read
+    // after it is final
+    bool sealed = header->sealed_.load(std::memory_order_acquire);
+    uint64_t tail = header->tail_.load(std::memory_order_acquire);
+    if (offset_ < tail) {
+      const char* p = map_ + offset_;
+      uint32_t type;
+      uint32_t length;
+      memcpy(&type, p, 4);
+      memcpy(&length, p + 4, 4);
+      memcpy(&record->mid_, p + 8, 8);
+      record->type_ = static_cast<Record::Type>(type);
+      record->data_ = p + kRecordHeader;
+      record->size_ = length;
+      offset_ += RecordBytes(length);
+      return true;
+    } else if (!sealed) {
+      return false;
+    }
+    Unmap();
+    segment_++;
+  }
+  return false;
+}
+
+bool
+SegmentReader::Map()
+{
+  // The segment may not have been created yet
+  std::string path = SegmentPath(path_, segment_);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    Fail("open " + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    Fail("fstat " + path);
+  }
+  if (static_cast<uint64_t>(st.st_size) < kHeaderBytes) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    Fail("mmap " + path);
+  }
+  const Header* header = static_cast<const Header*>(map);
+  if (header->magic_ != kMagic) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header->version_ != kVersion ||
+      header->capacity_ != static_cast<uint64_t>(st.st_size)) {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    Fail("unexpected segment header in " + path);
+  }
+  map_ = static_cast<const char*>(map);
+  capacity_ = st.st_size;
+  offset_ = header->header_bytes_;
+  return true;
+}
+
+void
+SegmentReader::Unmap()
+{
+  if (map_) {
+    munmap(const_cast<char*>(map_), capacity_);
+    map_ = 0;
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include "Messages.hpp"
+
+namespace spob {
+  // Committed transactions in an append-only series of memory mapped
+  // files, path.00000000, path.00000001 and so on. Each starts with a
+  // fixed header holding the offset just past its last published record.
+  // Records are length prefixed and only published by advancing that
+  // offset, so local processes can tail the delivered stream straight
+  // out of the page cache without touching the protocol. A writer always
+  // starts over at path.00000000, truncating what an earlier run left
+  // there. A reader still tailing that run silently stops seeing records,
+  // so restart readers along with the writer
+  class SegmentWriter {
+  public:
+    SegmentWriter(const std::string& path, uint64_t segment_bytes = 64 << 20);
+    ~SegmentWriter();
+
+    // Appends a run of transactions, publishing them together
+    void Append(const Transaction* first, const Transaction* last);
+    // Appends an application snapshot that replaces everything before it
+    void Snapshot(uint64_t mid, const Payload& state);
+  private:
+    SegmentWriter(const SegmentWriter&);
+    SegmentWriter& operator=(const SegmentWriter&);
+
+    void Write(uint32_t type, uint64_t mid, const Payload& payload);
+    void Publish();
+    void Roll(uint64_t bytes);
+
+    std::string path_;
+    uint64_t segment_bytes_;
+    uint64_t segment_;
+    char* map_;
+    uint64_t capacity_;
+    uint64_t tail_;
+  };
+
+  class SegmentReader {
+  public:
+    struct Record {
+      enum Type {
+        kTransaction = 1,
+        kSnapshot
+      };
+      Type type_;
+      uint64_t mid_;
+      // Points into the mapping, valid until the reader moves on to the
+      // next segment
+      const char* data_;
+      uint32_t size_;
+    };
+
+    explicit SegmentReader(const std::string& path);
+    ~SegmentReader();
+
+    // Returns false if nothing has been published past the last record
+    bool Next(Record* record);
+  private:
+    SegmentReader(const SegmentReader&);
+    SegmentReader& operator=(const SegmentReader&);
+
+    bool Map();
+    void Unmap();
+
+    std::string path_;
+    uint64_t segment_;
+    const char* map_;
+    uint64_t capacity_;
+    uint64_t offset_;
+  };
+}
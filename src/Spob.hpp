@@ -5,10 +5,15 @@
 #include <list>
 #include <map>
 #include <string>
+#include <vector>
 
+#include <boost/function.hpp>
 #include <boost/icl/interval_set.hpp>
 
+#include "Log.hpp"
 #include "Messages.hpp"
+#include "Segment.hpp"
+#include "Wal.hpp"
 
 namespace spob {
   class CommunicatorInterface {
@@ -18,13 +23,18 @@ namespace spob {
     virtual void Send(const NakTree& nt, uint32_t to) = 0;
     virtual void Send(const RecoverPropose& rp, uint32_t to) = 0;
     virtual void Send(const AckRecover& ar, uint32_t to) = 0;
+    virtual void Send(const AckRecoverChunk& arc, uint32_t to) = 0;
     virtual void Send(const RecoverCommit& rc, uint32_t to) = 0;
     virtual void Send(const RecoverReconnect& rr, uint32_t to) = 0;
     virtual void Send(const Propose& p, uint32_t to) = 0;
+    virtual void Send(const ProposeBatch& pb, uint32_t to) = 0;
     virtual void Send(const Ack& a, uint32_t to) = 0;
     virtual void Send(const Commit& c, uint32_t to) = 0;
     virtual void Send(const Reconnect& r, uint32_t to) = 0;
     virtual void Send(const ReconnectResponse& recon_resp, uint32_t to) = 0;
+    virtual void Send(const Snapshot& s, uint32_t to) = 0;
+    virtual void Send(const Observe& o, uint32_t to) = 0;
+    virtual void Send(const ObserveCommit& oc, uint32_t to) = 0;
 
     virtual ~CommunicatorInterface() {}
   };
@@ -34,66 +44,303 @@ namespace spob {
     enum Status {
       kRecovering,
       kFollowing,
-      kLeading
+      kLeading,
+      kObserving,
+      // An observer no host can catch up, because none has a snapshot
+      kDetached
     };
+    // A proposal's completion handler fires exactly once: kCommitted
+    // when the proposal is delivered, or kLeadershipLost if we stop
+    // leading first, in which case a new primary may still deliver it.
+    // Handlers run in mid order, each after the Callback has been handed
+    // its proposal, and like the Callback they may propose and flush
+    enum Outcome {
+      kCommitted,
+      kLeadershipLost
+    };
+    typedef boost::function<void (uint64_t id, Outcome outcome)>
+    CompletionHandler;
     struct Callback {
-      virtual void operator()(uint64_t id, const std::string& message) = 0;
+      virtual void operator()(uint64_t id, const Payload& message) = 0;
       virtual void operator()(Status status, uint32_t primary) = 0;
+      // Delivers a run of committed transactions in mid order. The
+      // default hands them to operator() one at a time
+      virtual void Deliver(const Transaction* first, const Transaction* last)
+      {
+        for (; first != last; ++first) {
+          (*this)(first->first, first->second);
+        }
+      }
+      // Called once commits make room after TryPropose found the
+      // window full
+      virtual void WindowOpened() {}
+      // The log only keeps uncommitted proposals, so a process missing
+      // committed ones is caught up from the application state instead.
+      // TakeSnapshot stores the state produced by everything delivered
+      // so far, through mid, or returns false if there is none to give.
+      // InstallSnapshot replaces the state with one taken through mid
+      virtual bool TakeSnapshot(uint64_t mid, Payload* state)
+      {
+        return false;
+      }
+      virtual void InstallSnapshot(uint64_t mid, const Payload& state) {}
       virtual ~Callback() {}
     };
+    // Proposals made while leading are held back and sent down the
+    // tree together once any of the limits is reached
+    struct BatchPolicy {
+      BatchPolicy() : max_messages_(1), max_bytes_(0), max_delay_(0) {}
+      uint32_t max_messages_; // 1 disables batching
+      uint64_t max_bytes_; // 0 for no limit
+      uint64_t max_delay_; // in the units passed to Tick, 0 for no limit
+    };
+    // Acks are cumulative, so a follower may acknowledge several
+    // proposals with one Ack carrying the highest mid its subtree holds
+    struct AckPolicy {
+      AckPolicy() : max_pending_(1), max_delay_(0) {}
+      uint32_t max_pending_; // 1 acks every proposal as soon as it can
+      uint64_t max_delay_; // in the units passed to Tick, 0 for no limit
+    };
+    // Every Propose carries the primary's commit watermark. With
+    // piggybacking, the primary only sends a standalone Commit once
+    // nothing it has proposed is left uncommitted
+    struct CommitPolicy {
+      CommitPolicy() : piggyback_(false), max_delay_(0) {}
+      bool piggyback_;
+      uint64_t max_delay_; // in the units passed to Tick, 0 for no limit
+    };
+    // Bounds what the primary has proposed but not yet committed.
+    // Propose ignores the window, TryPropose refuses to exceed it
+    struct WindowPolicy {
+      WindowPolicy() : max_messages_(0), max_bytes_(0) {}
+      uint32_t max_messages_; // 0 for no limit
+      uint64_t max_bytes_; // 0 for no limit
+    };
+    // Shapes the broadcast tree. Each process splits the ranks below it
+    // into fanout_ contiguous ranges and takes the lowest rank of each
+    // as a child. Given the host of each rank, ranges only break where
+    // the host changes, keeping subtrees host-local where possible. That
+    // takes each host's ranks to be contiguous. A host whose ranks are
+    // interleaved with another's is entered once per run of them, and
+    // each rank past the end of hosts_ counts as a host of its own
+    struct TreePolicy {
+      TreePolicy() : fanout_(2) {}
+      uint32_t fanout_;
+      std::vector<uint32_t> hosts_; // indexed by rank, empty for rank order
+    };
+    // Splits what a process sends to catch another up, during recovery
+    // or after a Reconnect, into chunks, which are passed down the tree
+    // as they arrive. Each child acknowledges the chunks, bounding how
+    // many are in flight
+    struct RecoverPolicy {
+      RecoverPolicy() : max_bytes_(0), max_chunks_(0) {}
+      uint64_t max_bytes_; // 0 to send everything held in one message
+      uint32_t max_chunks_; // per child, 0 for no limit
+    };
+    // Writes what a process logs to a Wal, which Start replays, and only
+    // acknowledges proposals once they are durable. Syncs are grouped:
+    // one covers everything logged since the last, and happens once
+    // max_pending_ proposals wait for it, on Flush, or after max_delay_.
+    // On Start and each time the Wal fills a segment, a snapshot from
+    // TakeSnapshot checkpoints it so the segments before can go. Without
+    // snapshots the Wal keeps everything, since replay redelivers it all
+    struct DurabilityPolicy {
+      DurabilityPolicy() : wal_(0), max_pending_(1), max_delay_(0) {}
+      Wal* wal_; // 0 keeps the log in memory only
+      uint32_t max_pending_;
+      uint64_t max_delay_; // in the units passed to Tick, 0 for no limit
+    };
+    // Besides handing them to the Callback, appends what we deliver to a
+    // memory mapped segment other local processes can tail
+    struct DeliveryPolicy {
+      DeliveryPolicy() : segment_(0) {}
+      SegmentWriter* segment_; // 0 for none
+    };
+    // Ranks from size up are observers. They take no part in the tree or
+    // in acknowledging proposals, but hang off a follower that passes on
+    // whatever it delivers. A host catches up an observer that starts
+    // late or loses its last host from a snapshot, or refuses it if the
+    // application takes none. Refused by every host, an observer detaches
     StateMachine(uint32_t rank, uint32_t size,
-                 CommunicatorInterface& comm, Callback& cb);
+                 CommunicatorInterface& comm, Callback& cb,
+                 const BatchPolicy& batch_policy = BatchPolicy(),
+                 const AckPolicy& ack_policy = AckPolicy(),
+                 const CommitPolicy& commit_policy = CommitPolicy(),
+                 const WindowPolicy& window_policy = WindowPolicy(),
+                 const TreePolicy& tree_policy = TreePolicy(),
+                 const RecoverPolicy& recover_policy = RecoverPolicy(),
+                 const DurabilityPolicy& durability_policy =
+                 DurabilityPolicy(),
+                 const DeliveryPolicy& delivery_policy = DeliveryPolicy());
 
     void Start();
+    uint64_t Propose(const Payload& message);
     uint64_t Propose(const std::string& message);
+    uint64_t Propose(std::string&& message);
+    // If we are not leading, proposes nothing, fails the handler at once
+    // and returns 0
+    uint64_t Propose(const Payload& message,
+                     const CompletionHandler& handler);
+    // Returns false without proposing if we are not leading or the
+    // window is full
+    bool TryPropose(const Payload& message, uint64_t* id = 0);
+    bool TryPropose(const Payload& message, const CompletionHandler& handler,
+                    uint64_t* id = 0);
+    void Flush();
+    void Tick(uint64_t now);
+    bool leading() const { return rank_ == primary_ && !recovering_; }
+    // Whether we are primary, even if still recovering to lead
+    bool primary() const { return rank_ == primary_; }
 
     void Receive(const spob::ConstructTree& ct, uint32_t from);
     void Receive(const spob::AckTree& at, uint32_t from);
     void Receive(const spob::NakTree& at, uint32_t from);
     void Receive(const spob::RecoverPropose& rp, uint32_t from);
     void Receive(const spob::AckRecover& ar, uint32_t from);
+    void Receive(const spob::AckRecoverChunk& arc, uint32_t from);
     void Receive(const spob::RecoverCommit& rc, uint32_t from);
     void Receive(const spob::RecoverReconnect& rr, uint32_t from);
     void Receive(const spob::Propose& p, uint32_t from);
+    void Receive(const spob::ProposeBatch& pb, uint32_t from);
     void Receive(const spob::Ack& a, uint32_t from);
     void Receive(const spob::Commit& c, uint32_t from);
     void Receive(const spob::Reconnect& r, uint32_t from);
     void Receive(const spob::ReconnectResponse& recon_resp, uint32_t from);
+    void Receive(const spob::Snapshot& s, uint32_t from);
+    void Receive(const spob::Observe& o, uint32_t from);
+    void Receive(const spob::ObserveCommit& oc, uint32_t from);
     void Receive(const spob::Failure& failure);
   private:
+    void Replay(const Wal::Record& record);
     void Recover();
+    // The primary, and anyone between trees, has no parent
+    bool IsParent(uint32_t rank) const
+    {
+      return !ancestors_.empty() && ancestors_.front() == rank;
+    }
+    void Attach();
     void ConstructTree();
+    std::vector<uint64_t> HostRuns() const;
     void AckTree();
     void NakTree(const spob::NakTree& nt);
     void RecoverPropose();
+    void PumpRecovery(uint32_t child);
+    void PumpCatchUp(uint32_t child);
+    // Whether child is still being sent what it missed before it
+    // reconnected, in which case our live traffic waits for it
+    bool CatchingUp(uint32_t child) const;
     void AckRecover();
     void RecoverCommit();
     void Propose(const spob::Propose& p);
-    void Ack(const spob::Ack& a);
+    void Propose(const spob::ProposeBatch& pb);
+    void Append(const Transaction& t);
+    void Persist();
+    void Sync();
+    void Checkpoint();
+    void Checkpoint(uint64_t mid, const Payload& state);
+    void Ack();
+    void AckThrough(uint64_t mid);
+    uint64_t SubtreeAcked() const;
+    void Commit();
     void Commit(const spob::Commit& c);
+    void Deliver(uint64_t mid);
+    uint64_t CatchUp(uint64_t last_proposed, uint32_t to);
+    void Install(uint64_t mid, const Payload& state);
+    void ReconnectResponse(uint64_t last_proposed, uint32_t to);
+    bool WindowFull() const;
     void PrintState();
 
     uint32_t rank_;
     uint32_t size_;
+    bool observer_;
+    // The follower an observer hangs off
+    uint32_t host_;
+    // Hosts that refused to catch an observer up since it last attached
+    boost::icl::interval_set<uint32_t> refused_;
+    // A follower's observers, and the last mid each has been sent
+    std::map<uint32_t, uint64_t> observers_;
     CommunicatorInterface& comm_;
     Callback& cb_;
+    BatchPolicy batch_policy_;
+    spob::ProposeBatch batch_;
+    uint64_t batch_bytes_;
+    uint64_t batch_opened_;
+    bool batch_timed_;
+    AckPolicy ack_policy_;
+    uint32_t ack_pending_;
+    uint64_t ack_opened_;
+    bool ack_timed_;
+    CommitPolicy commit_policy_;
+    bool commit_pending_;
+    uint64_t commit_opened_;
+    bool commit_timed_;
+    WindowPolicy window_policy_;
+    uint32_t window_messages_;
+    uint64_t window_bytes_;
+    bool window_full_;
+    TreePolicy tree_policy_;
+    RecoverPolicy recover_policy_;
+    DurabilityPolicy durability_policy_;
+    uint32_t sync_pending_;
+    uint64_t sync_opened_;
+    bool sync_timed_;
+    bool replaying_;
+    // The Wal segment we last checkpointed, or found no snapshot for
+    uint64_t wal_segment_;
+    DeliveryPolicy delivery_policy_;
     uint32_t primary_;
     uint64_t count_;
     uint64_t last_proposed_mid_;
+    uint64_t durable_mid_;
     uint64_t last_acked_mid_;
     uint64_t last_committed_mid_;
     uint64_t current_mid_;
     bool constructing_;
     bool recovering_;
     bool got_propose_;
+    bool streaming_;
+    // More of a catch-up is coming from our parent
+    bool catching_up_;
     bool acked_;
     unsigned int tree_acks_;
-    std::list<uint32_t> ancestors_;
+    Ancestors ancestors_;
+    // Each child's max rank, and the last mid it holds while recovering
+    // or has acknowledged while broadcasting
     std::map<uint32_t, std::pair<uint32_t, uint64_t> > children_;
-    typedef std::map<uint64_t,
-                     std::pair<std::string,
-                               boost::icl::interval_set<uint32_t> > > LogType;
+    // The recovery diff or catch-up being streamed to a child: chunks it
+    // has yet to acknowledge, and whether it has been sent all of it.
+    // A catch-up keeps the last mid sent in last_
+    struct RecoverStream {
+      RecoverStream()
+        : in_flight_(0), last_(0), started_(false), done_(false) {}
+      uint32_t in_flight_;
+      uint64_t last_;
+      bool started_;
+      bool done_;
+    };
+    std::map<uint32_t, RecoverStream> streams_;
+    typedef Log<Payload> LogType;
     LogType log_;
+    // Handlers of our own outstanding proposals, in mid order
+    Log<CompletionHandler> completions_;
+    // Reused to hand committed transactions to the application
+    std::vector<Transaction> delivering_;
+    // A handler settled by a run, which fires once the application has
+    // been handed that run
+    struct Completion {
+      uint64_t id_;
+      Outcome outcome_;
+      CompletionHandler handler_;
+    };
+    std::vector<Completion> completing_;
+    // Set while runs are handed over, through deliver_through_, which
+    // commits made meanwhile extend
+    bool delivering_now_;
+    uint64_t deliver_through_;
+    // Ranks orphaned by the failure of a child that have not reconnected
+    // yet, and the lowest mid their failed parents had acknowledged
+    boost::icl::interval_set<uint32_t> orphaned_;
+    uint64_t orphaned_mid_;
     boost::icl::interval_set<uint32_t> recover_ack_;
     boost::icl::interval_set<uint32_t> lower_correct_;
     boost::icl::interval_set<uint32_t> upper_correct_;
@@ -1,51 +1,450 @@
 #include "Spob.hpp"
 
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include <boost/bind/bind.hpp>
+
 using namespace spob;
 namespace icl = boost::icl;
 
+namespace {
+  // Host ids are 32 bits, so ranks TreePolicy::hosts_ leaves out are
+  // given ids from here up, one each, that no real host can share
+  const uint64_t kUnmappedHost = static_cast<uint64_t>(1) << 32;
+
+  // The pos'th lowest rank in ranks
+  uint32_t
+  Nth(const icl::interval_set<uint32_t>& ranks, uint64_t pos)
+  {
+    for (icl::interval_set<uint32_t>::const_iterator it = ranks.begin();
+         it != ranks.end(); ++it) {
+      if (icl::cardinality(*it) > pos) {
+        return icl::first(*it) + pos;
+      }
+      pos -= icl::cardinality(*it);
+    }
+    assert(false);
+    return 0;
+  }
+}
+
 StateMachine::StateMachine(uint32_t rank, uint32_t size,
                            CommunicatorInterface& comm,
-                           Callback& cb)
-  : rank_(rank), size_(size), comm_(comm), cb_(cb)
+                           Callback& cb,
+                           const BatchPolicy& batch_policy,
+                           const AckPolicy& ack_policy,
+                           const CommitPolicy& commit_policy,
+                           const WindowPolicy& window_policy,
+                           const TreePolicy& tree_policy,
+                           const RecoverPolicy& recover_policy,
+                           const DurabilityPolicy& durability_policy,
+                           const DeliveryPolicy& delivery_policy)
+  : rank_(rank), size_(size), comm_(comm), cb_(cb),
+    batch_policy_(batch_policy), ack_policy_(ack_policy),
+    commit_policy_(commit_policy), window_policy_(window_policy),
+    tree_policy_(tree_policy), recover_policy_(recover_policy),
+    durability_policy_(durability_policy), delivery_policy_(delivery_policy)
 {
+  batch_bytes_ = 0;
+  batch_opened_ = 0;
+  batch_timed_ = false;
+  ack_pending_ = 0;
+  ack_opened_ = 0;
+  ack_timed_ = false;
+  commit_pending_ = false;
+  commit_opened_ = 0;
+  commit_timed_ = false;
+  window_messages_ = 0;
+  window_bytes_ = 0;
+  window_full_ = false;
+  sync_pending_ = 0;
+  sync_opened_ = 0;
+  sync_timed_ = false;
+  replaying_ = false;
+  delivering_now_ = false;
+  deliver_through_ = 0;
+  wal_segment_ = 0;
+  primary_ = 0;
   count_ = 0;
+  current_mid_ = 0;
   last_proposed_mid_ = 0;
+  durable_mid_ = 0;
   last_acked_mid_ = 0;
   last_committed_mid_ = 0;
-  lower_correct_ += icl::interval<uint32_t>::closed(0, rank);
-  upper_correct_ += icl::interval<uint32_t>::closed(rank + 1, size - 1);
+  orphaned_mid_ = 0;
+  constructing_ = true;
+  recovering_ = true;
+  got_propose_ = false;
+  streaming_ = false;
+  catching_up_ = false;
+  acked_ = false;
+  tree_acks_ = 0;
+  observer_ = rank >= size;
+  host_ = 0;
+  if (observer_) {
+    // An observer only tracks which followers it could hang off
+    lower_correct_ += icl::interval<uint32_t>::closed(0, size - 1);
+  } else {
+    lower_correct_ += icl::interval<uint32_t>::closed(0, rank);
+    upper_correct_ += icl::interval<uint32_t>::closed(rank + 1, size - 1);
+  }
 }
 
 void
 StateMachine::Start()
 {
-  Recover();
+  if (durability_policy_.wal_) {
+    // Rebuild what we logged before a restart, redelivering what had
+    // committed. Recovery sorts out the rest
+    replaying_ = true;
+    durability_policy_.wal_->Replay(boost::bind(&StateMachine::Replay, this,
+                                                boost::placeholders::_1));
+    replaying_ = false;
+    durable_mid_ = last_proposed_mid_;
+    wal_segment_ = durability_policy_.wal_->segment();
+    if (last_proposed_mid_ > 0) {
+      // Leave one segment for the next restart to replay
+      Checkpoint();
+    }
+  }
+  if (observer_) {
+    Attach();
+  } else {
+    Recover();
+  }
+}
+
+void
+StateMachine::Attach()
+{
+  // Spread observers over the highest ranks, which sit at the leaves of
+  // the tree and so have the least to do. Skip any host that has already
+  // refused us
+  icl::interval_set<uint32_t> hosts = lower_correct_ - refused_;
+  if (hosts.empty()) {
+    if (!refused_.empty()) {
+      cb_(kDetached, 0);
+    }
+    return;
+  }
+  uint64_t n = icl::cardinality(hosts);
+  host_ = Nth(hosts, n - 1 - (rank_ - size_) % n);
+  spob::Observe o;
+  o.last_committed_ = last_committed_mid_;
+  comm_.Send(o, host_);
+  cb_(kObserving, host_);
+}
+
+void
+StateMachine::Receive(const spob::Observe& o, uint32_t from)
+{
+  if (observer_) {
+    return;
+  }
+  uint64_t after = CatchUp(o.last_committed_, from);
+  if (after < last_committed_mid_) {
+    // Without a snapshot we can't fill the gap, and passing on only what
+    // we deliver from here would silently skip it
+    observers_.erase(from);
+    spob::ObserveCommit oc;
+    oc.after_ = last_committed_mid_;
+    comm_.Send(oc, from);
+    return;
+  }
+  observers_[from] = after;
+}
+
+void
+StateMachine::Receive(const spob::ObserveCommit& oc, uint32_t from)
+{
+  if (observer_ && from == host_) {
+    if (oc.after_ > last_committed_mid_) {
+      // A refusal, or a run that doesn't follow on from what we have
+      refused_ += host_;
+      Attach();
+      return;
+    }
+    refused_.clear();
+    // A new host may pass on some of what the last one already did
+    for (std::vector<Transaction>::const_iterator it = oc.proposals_.begin();
+         it != oc.proposals_.end(); ++it) {
+      if (it->first > last_proposed_mid_) {
+        Append(*it);
+        last_proposed_mid_ = it->first;
+      }
+    }
+    Persist();
+    Deliver(last_proposed_mid_);
+  }
+}
+
+void
+StateMachine::Replay(const Wal::Record& record)
+{
+  switch (record.type_) {
+  case Wal::Record::kPropose:
+    if (record.mid_ > last_proposed_mid_) {
+      log_.push_back(std::make_pair(record.mid_, record.payload_));
+      last_proposed_mid_ = record.mid_;
+    }
+    break;
+  case Wal::Record::kCommit:
+    Deliver(record.mid_);
+    break;
+  case Wal::Record::kTruncate:
+    log_.erase(log_.upper_bound(record.mid_), log_.end());
+    last_proposed_mid_ = record.mid_;
+    break;
+  case Wal::Record::kSnapshot:
+    Install(record.mid_, record.payload_);
+    break;
+  }
 }
 
 uint64_t
 StateMachine::Propose(const std::string& message)
 {
-  spob::Propose p;
-  p.primary_ = primary_;
+  return Propose(Payload(message));
+}
+
+uint64_t
+StateMachine::Propose(std::string&& message)
+{
+  return Propose(Payload(std::move(message)));
+}
+
+uint64_t
+StateMachine::Propose(const Payload& message)
+{
   uint64_t id = current_mid_;
-  p.proposal_ = std::make_pair(id, message);
-  Propose(p);
   current_mid_++;
   // Make sure we don't wrap around with the same primary
   assert(current_mid_ >> 32 == id >> 32);
+  window_messages_++;
+  window_bytes_ += message.size();
+  if (batch_policy_.max_messages_ <= 1) {
+    spob::Propose p;
+    p.primary_ = primary_;
+    p.last_committed_ = last_committed_mid_;
+    p.proposal_ = std::make_pair(id, message);
+    Propose(p);
+    // The proposal carries the commit to our children
+    commit_pending_ = false;
+    commit_timed_ = false;
+  } else {
+    batch_.proposals_.push_back(std::make_pair(id, message));
+    batch_bytes_ += message.size();
+    if (batch_.proposals_.size() >= batch_policy_.max_messages_ ||
+        (batch_policy_.max_bytes_ > 0 &&
+         batch_bytes_ >= batch_policy_.max_bytes_)) {
+      Flush();
+    }
+  }
   return id;
 }
 
+uint64_t
+StateMachine::Propose(const Payload& message, const CompletionHandler& handler)
+{
+  if (!leading()) {
+    // Nothing would ever complete it, so fail it now
+    handler(0, kLeadershipLost);
+    return 0;
+  }
+  // Register first, a proposal may commit before Propose returns
+  completions_.push_back(std::make_pair(current_mid_, handler));
+  return Propose(message);
+}
+
+bool
+StateMachine::TryPropose(const Payload& message, uint64_t* id)
+{
+  return TryPropose(message, CompletionHandler(), id);
+}
+
+bool
+StateMachine::TryPropose(const Payload& message,
+                         const CompletionHandler& handler, uint64_t* id)
+{
+  if (rank_ != primary_ || recovering_) {
+    return false;
+  }
+  if (WindowFull()) {
+    window_full_ = true;
+    return false;
+  }
+  uint64_t mid = handler ? Propose(message, handler) : Propose(message);
+  if (id) {
+    *id = mid;
+  }
+  return true;
+}
+
+bool
+StateMachine::WindowFull() const
+{
+  // A message may overshoot the byte limit so that one larger than the
+  // whole window still gets through
+  return (window_policy_.max_messages_ > 0 &&
+          window_messages_ >= window_policy_.max_messages_) ||
+    (window_policy_.max_bytes_ > 0 &&
+     window_bytes_ >= window_policy_.max_bytes_);
+}
+
+void
+StateMachine::Flush()
+{
+  if (!batch_.proposals_.empty()) {
+    batch_.primary_ = primary_;
+    batch_.last_committed_ = last_committed_mid_;
+    Propose(batch_);
+    batch_.proposals_.clear();
+    batch_bytes_ = 0;
+    batch_timed_ = false;
+    commit_pending_ = false;
+    commit_timed_ = false;
+  }
+  if (sync_pending_ > 0) {
+    Sync();
+    if (!recovering_) {
+      AckThrough(SubtreeAcked());
+    }
+  }
+  Ack();
+  Commit();
+}
+
+void
+StateMachine::Tick(uint64_t now)
+{
+  // The batch is timed from the first tick that sees it open
+  if (!batch_.proposals_.empty() && batch_policy_.max_delay_ > 0) {
+    if (!batch_timed_) {
+      batch_opened_ = now;
+      batch_timed_ = true;
+    } else if (now - batch_opened_ >= batch_policy_.max_delay_) {
+      Flush();
+    }
+  }
+  if (ack_pending_ > 0 && ack_policy_.max_delay_ > 0) {
+    if (!ack_timed_) {
+      ack_opened_ = now;
+      ack_timed_ = true;
+    } else if (now - ack_opened_ >= ack_policy_.max_delay_) {
+      Ack();
+    }
+  }
+  if (sync_pending_ > 0 && durability_policy_.max_delay_ > 0) {
+    if (!sync_timed_) {
+      sync_opened_ = now;
+      sync_timed_ = true;
+    } else if (now - sync_opened_ >= durability_policy_.max_delay_) {
+      Sync();
+      if (!recovering_) {
+        AckThrough(SubtreeAcked());
+      }
+    }
+  }
+  if (commit_pending_ && commit_policy_.max_delay_ > 0) {
+    if (!commit_timed_) {
+      commit_opened_ = now;
+      commit_timed_ = true;
+    } else if (now - commit_opened_ >= commit_policy_.max_delay_) {
+      Commit();
+    }
+  }
+}
+
 void
 StateMachine::Propose(const spob::Propose& p)
 {
   for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator it =
          children_.begin(); it != children_.end(); ++it) {
-    comm_.Send(p, it->first);
+    if (!CatchingUp(it->first)) {
+      comm_.Send(p, it->first);
+    }
   }
   uint64_t id = p.proposal_.first;
-  log_[id] = std::make_pair(p.proposal_.second, subtree_correct_);
+  Append(p.proposal_);
   last_proposed_mid_ = id;
+  Persist();
+}
+
+void
+StateMachine::Propose(const spob::ProposeBatch& pb)
+{
+  for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator it =
+         children_.begin(); it != children_.end(); ++it) {
+    if (!CatchingUp(it->first)) {
+      comm_.Send(pb, it->first);
+    }
+  }
+  for (std::vector<Transaction>::const_iterator it = pb.proposals_.begin();
+       it != pb.proposals_.end(); ++it) {
+    Append(*it);
+  }
+  last_proposed_mid_ = pb.proposals_.back().first;
+  Persist();
+}
+
+void
+StateMachine::Append(const Transaction& t)
+{
+  log_.push_back(t);
+  if (durability_policy_.wal_) {
+    durability_policy_.wal_->Propose(t);
+    sync_pending_++;
+  }
+}
+
+void
+StateMachine::Persist()
+{
+  if (sync_pending_ > 0 && sync_pending_ >= durability_policy_.max_pending_) {
+    Sync();
+  }
+}
+
+void
+StateMachine::Sync()
+{
+  // One write makes everything logged so far durable
+  if (durability_policy_.wal_) {
+    durability_policy_.wal_->Sync();
+  }
+  durable_mid_ = last_proposed_mid_;
+  sync_pending_ = 0;
+  sync_timed_ = false;
+}
+
+void
+StateMachine::Checkpoint()
+{
+  // Only once the application state matches last_committed_mid_, so
+  // never from inside a delivery
+  wal_segment_ = durability_policy_.wal_->segment();
+  Payload state;
+  if (cb_.TakeSnapshot(last_committed_mid_, &state)) {
+    Checkpoint(last_committed_mid_, state);
+  }
+}
+
+void
+StateMachine::Checkpoint(uint64_t mid, const Payload& state)
+{
+  // A snapshot and the proposals logged after it are all a restart
+  // needs, so the Wal can drop every segment before them
+  Wal* wal = durability_policy_.wal_;
+  wal->Checkpoint(mid, state);
+  for (LogType::const_iterator it = log_.begin(); it != log_.end(); ++it) {
+    wal->Propose(*it);
+  }
+  wal->Sync();
+  wal_segment_ = wal->segment();
 }
 
 void
@@ -93,6 +492,7 @@ StateMachine::NakTree(const spob::NakTree& nt)
 {
   count_++;
   if (primary_ == rank_) {
+    subtree_correct_ = upper_correct_;
     ConstructTree();
   } else {
     comm_.Send(nt, ancestors_.front());
@@ -104,30 +504,39 @@ StateMachine::NakTree(const spob::NakTree& nt)
 void
 StateMachine::Receive(const spob::RecoverPropose& rp, uint32_t from)
 {
-  if (rp.primary_ == primary_ && from == ancestors_.front()) {
-    got_propose_ = true;
+  if (rp.primary_ == primary_ && IsParent(from)) {
     switch (rp.type_) {
     case RecoverPropose::kDiff:
       if (rp.proposals_.size() > 0) {
-        for (std::list<std::pair<uint64_t, std::string> >::const_iterator it =
+        for (std::vector<Transaction>::const_iterator it =
                rp.proposals_.begin(); it != rp.proposals_.end(); ++it) {
-          log_.insert(log_.end(),
-                      std::make_pair(it->first,
-                                     std::make_pair(it->second,
-                                                    subtree_correct_)));
+          Append(*it);
         }
         last_proposed_mid_ = rp.proposals_.rbegin()->first;
       }
+      if (rp.more_) {
+        spob::AckRecoverChunk arc;
+        arc.primary_ = primary_;
+        comm_.Send(arc, from);
+      } else {
+        got_propose_ = true;
+      }
       break;
     case RecoverPropose::kTrunc:
       log_.erase(log_.upper_bound(rp.last_mid_), log_.end());
       last_proposed_mid_ = rp.last_mid_;
+      if (durability_policy_.wal_) {
+        durability_policy_.wal_->Truncate(rp.last_mid_);
+        durable_mid_ = std::min(durable_mid_, rp.last_mid_);
+      }
+      got_propose_ = true;
       break;
     }
-    if (subtree_correct_.empty()) {
-      AckRecover();
-    } else {
+    if (!subtree_correct_.empty()) {
+      // Pass on what we have so far
       RecoverPropose();
+    } else if (got_propose_) {
+      AckRecover();
     }
   }
 }
@@ -137,46 +546,66 @@ StateMachine::Receive(const spob::AckRecover& ar, uint32_t from)
 {
   if (ar.primary_ == primary_ && children_.count(from)) {
     recover_ack_ -= icl::interval<uint32_t>::closed(from, children_[from].first);
-    if (recover_ack_.empty()) {
+    if (recover_ack_.empty() && got_propose_ && !acked_) {
       AckRecover();
     }
   }
 }
 
+void
+StateMachine::Receive(const spob::AckRecoverChunk& arc, uint32_t from)
+{
+  if (arc.primary_ == primary_ && streams_.count(from) &&
+      streams_[from].in_flight_ > 0) {
+    streams_[from].in_flight_--;
+    if (recovering_) {
+      PumpRecovery(from);
+    } else {
+      PumpCatchUp(from);
+    }
+  }
+}
+
 void
 StateMachine::Receive(const spob::RecoverReconnect& rr, uint32_t from)
 {
-  if (rr.primary_ == primary_) {
+  // While constructing, or if sent in an older tree, the child will be
+  // adopted by the new tree instead
+  if (rr.primary_ == primary_ && rr.count_ == count_ && !constructing_) {
+    // Adopt the child first so that a recovery commit triggered below
+    // reaches it too
+    children_[from] = std::make_pair(rr.max_rank_, rr.last_proposed_);
+    orphaned_ -= icl::interval<uint32_t>::closed(from, rr.max_rank_);
     if (!rr.got_propose_) {
-      //The child never received the propose
-      spob::RecoverPropose rp;
-      rp.primary_ = primary_;
-      if (rr.last_proposed_ <= last_proposed_mid_) {
-        rp.type_ = RecoverPropose::kDiff;
-        for (LogType::const_iterator it = log_.upper_bound(rr.last_proposed_);
-             it != log_.end(); ++it) {
-          rp.proposals_.push_back(std::make_pair(it->first, it->second.first));
-        }
-      } else {
-        rp.type_ = RecoverPropose::kTrunc;
-        rp.last_mid_ = last_proposed_mid_;
+      //The child never received all of the propose. If we haven't
+      //started on ours either, our own RecoverPropose will bring it up
+      //to date, otherwise stream it the rest from what it holds
+      if (streaming_) {
+        streams_[from] = RecoverStream();
+        PumpRecovery(from);
       }
-      comm_.Send(rp, from);
     } else if (rr.acked_ && !acked_) {
       //The child acknowledged the recovery already and we haven't acked
       recover_ack_ -= icl::interval<uint32_t>::closed(from, rr.max_rank_);
-      if (recover_ack_.empty()) {
+      if (recover_ack_.empty() && got_propose_) {
         AckRecover();
       }
+    } else if (rr.acked_ && !recovering_) {
+      //We already committed the recovery but the child's parent failed
+      //before passing the commit on, so commit it and catch the child up
+      //on everything proposed since
+      spob::RecoverCommit rc;
+      rc.primary_ = primary_;
+      comm_.Send(rc, from);
+      ReconnectResponse(rr.last_proposed_, from);
     }
-    children_[from] = std::make_pair(rr.max_rank_, rr.last_proposed_);
   }
 }
 
 void
 StateMachine::Receive(const spob::RecoverCommit& rc, uint32_t from)
 {
-  if (rc.primary_ == primary_ && from == ancestors_.front()) {
+  if (rc.primary_ == primary_ && IsParent(from)) {
     RecoverCommit();
     cb_(kFollowing, primary_);
   }
@@ -185,41 +614,120 @@ StateMachine::Receive(const spob::RecoverCommit& rc, uint32_t from)
 void
 StateMachine::Receive(const spob::Propose& p, uint32_t from)
 {
-  if (p.primary_ == primary_ && from == ancestors_.front()) {
+  if (p.primary_ == primary_ && IsParent(from)) {
     Propose(p);
-    if (subtree_correct_.empty()) {
-      spob::Ack a;
-      a.primary_ = primary_;
-      a.mid_ = p.proposal_.first;
-      Ack(a);
-    }
+    Deliver(p.last_committed_);
+    AckThrough(SubtreeAcked());
   }
 }
 
 void
-StateMachine::Ack(const spob::Ack& a)
+StateMachine::Receive(const spob::ProposeBatch& pb, uint32_t from)
 {
-  comm_.Send(a, ancestors_.front());
-  last_acked_mid_ = a.mid_;
+  if (pb.primary_ == primary_ && IsParent(from) &&
+      !pb.proposals_.empty()) {
+    Propose(pb);
+    Deliver(pb.last_committed_);
+    AckThrough(SubtreeAcked());
+  }
+}
+
+void
+StateMachine::Ack()
+{
+  // Report everything our subtree has acknowledged so far. Between trees
+  // there is no one to report to, and the next tree's AckTree covers it
+  if (ack_pending_ > 0 && !ancestors_.empty()) {
+    spob::Ack a;
+    a.primary_ = primary_;
+    a.mid_ = last_acked_mid_;
+    comm_.Send(a, ancestors_.front());
+    ack_pending_ = 0;
+    ack_timed_ = false;
+  }
 }
 
 void
 StateMachine::Receive(const spob::Ack& a, uint32_t from)
 {
-  if (a.primary_ == primary_ && children_.count(from) && log_.count(a.mid_)) {
-    uint64_t id = a.mid_;
-    log_[id].second -=
-      icl::interval<uint32_t>::closed(from, children_[from].first);
-    if (log_[id].second.empty()) {
-      if (rank_ == primary_) {
-        spob::Commit c;
-        c.primary_ = primary_;
-        c.mid_ = id;
-        Commit(c);
-      } else {
-        Ack(a);
+  // Acks are only sent once recovery has committed, so any we see while
+  // recovering are stale
+  if (a.primary_ == primary_ && !recovering_ && children_.count(from) &&
+      a.mid_ > children_[from].second) {
+    // Acks are cumulative, so this covers every earlier proposal too
+    children_[from].second = a.mid_;
+    AckThrough(SubtreeAcked());
+  }
+}
+
+uint64_t
+StateMachine::SubtreeAcked() const
+{
+  // Our subtree holds a proposal once we and every live child have it
+  // and no orphans are still waiting to reconnect. With a Wal we only
+  // hold what it has made durable
+  uint64_t acked = durability_policy_.wal_ ?
+    std::min(durable_mid_, last_proposed_mid_) : last_proposed_mid_;
+  for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator it =
+         children_.begin(); it != children_.end(); ++it) {
+    acked = std::min(acked, it->second.second);
+  }
+  if (!orphaned_.empty()) {
+    acked = std::min(acked, orphaned_mid_);
+  }
+  return acked;
+}
+
+void
+StateMachine::AckThrough(uint64_t mid)
+{
+  // Acknowledge (or commit, if we are the primary) every outstanding
+  // proposal up to and including mid. Followers hold the Ack back until
+  // the ack policy says enough proposals are covered by it
+  LogType::const_iterator first = log_.upper_bound(last_acked_mid_);
+  LogType::const_iterator last = log_.upper_bound(mid);
+  if (mid > last_acked_mid_ && first != last) {
+    if (rank_ == primary_ && commit_policy_.piggyback_) {
+      // Let the next proposal carry the commit, unless there is nothing
+      // left in flight to carry it
+      Deliver((--last)->first);
+      commit_pending_ = true;
+      if (log_.empty() && batch_.proposals_.empty()) {
+        Commit();
+      }
+    } else if (rank_ == primary_) {
+      spob::Commit c;
+      c.primary_ = primary_;
+      c.mid_ = (--last)->first;
+      Commit(c);
+    } else {
+      for (; first != last; ++first) {
+        ack_pending_++;
+        last_acked_mid_ = first->first;
+      }
+      if (ack_pending_ >= ack_policy_.max_pending_) {
+        Ack();
+      }
+    }
+  }
+}
+
+void
+StateMachine::Commit()
+{
+  // Send the commit no proposal has carried yet
+  if (commit_pending_) {
+    spob::Commit c;
+    c.primary_ = primary_;
+    c.mid_ = last_committed_mid_;
+    for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator
+           it = children_.begin(); it != children_.end(); ++it) {
+      if (!CatchingUp(it->first)) {
+        comm_.Send(c, it->first);
       }
     }
+    commit_pending_ = false;
+    commit_timed_ = false;
   }
 }
 
@@ -228,19 +736,116 @@ StateMachine::Commit(const spob::Commit& c)
 {
   for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator it =
          children_.begin(); it != children_.end(); ++it) {
-    comm_.Send(c, it->first);
+    if (!CatchingUp(it->first)) {
+      comm_.Send(c, it->first);
+    }
+  }
+  Deliver(c.mid_);
+}
+
+void
+StateMachine::Deliver(uint64_t mid)
+{
+  if (mid > last_committed_mid_) {
+    if (durability_policy_.wal_ && !replaying_) {
+      // Made durable along with the next proposals
+      durability_policy_.wal_->Commit(mid);
+    }
+    last_committed_mid_ = mid;
+  }
+  if (last_acked_mid_ <= last_committed_mid_) {
+    // Nothing our parent doesn't already know about
+    last_acked_mid_ = last_committed_mid_;
+    ack_pending_ = 0;
+    ack_timed_ = false;
+  }
+  if (delivering_now_) {
+    // The application proposed from a delivery or a handler, and that
+    // committed more. Left to the delivery under way, so runs and their
+    // handlers never nest and stay in mid order
+    deliver_through_ = std::max(deliver_through_, mid);
+    return;
+  }
+  delivering_now_ = true;
+  deliver_through_ = mid;
+  // A commit covers every proposal up to and including its mid. Move
+  // them out of the log before handing them over in one call, since
+  // the application may propose, and so grow the log, while we deliver
+  std::vector<Transaction> delivering;
+  delivering.swap(delivering_);
+  std::vector<Completion> completing;
+  completing.swap(completing_);
+  while (!log_.empty() && log_.front().first <= deliver_through_) {
+    while (!log_.empty() && log_.front().first <= deliver_through_) {
+      delivering.push_back(Transaction());
+      delivering.back().first = log_.front().first;
+      delivering.back().second.swap(log_.front().second);
+      log_.pop_front();
+    }
+    const Transaction* first = &delivering.front();
+    const Transaction* last = first + delivering.size();
+    if (delivery_policy_.segment_) {
+      delivery_policy_.segment_->Append(first, last);
+    }
+    // Pass the run on to our observers, skipping what each already has
+    for (std::map<uint32_t, uint64_t>::iterator it = observers_.begin();
+         it != observers_.end(); ++it) {
+      if (it->second < delivering.back().first) {
+        spob::ObserveCommit oc;
+        oc.after_ = it->second;
+        for (std::vector<Transaction>::const_iterator t = delivering.begin();
+             t != delivering.end(); ++t) {
+          if (t->first > it->second) {
+            oc.proposals_.push_back(*t);
+          }
+        }
+        comm_.Send(oc, it->first);
+        it->second = delivering.back().first;
+      }
+    }
+    for (std::vector<Transaction>::const_iterator it = delivering.begin();
+         it != delivering.end(); ++it) {
+      if (rank_ == primary_ && window_messages_ > 0) {
+        window_messages_--;
+        window_bytes_ -= it->second.size();
+      }
+      // A handler behind this mid whose proposal never got here won't
+      // ever be delivered, so it must not hold up those after it
+      while (!completions_.empty() &&
+             completions_.front().first <= it->first) {
+        completing.push_back(Completion());
+        completing.back().id_ = completions_.front().first;
+        completing.back().outcome_ =
+          completing.back().id_ == it->first ? kCommitted : kLeadershipLost;
+        completing.back().handler_.swap(completions_.front().second);
+        completions_.pop_front();
+      }
+    }
+    cb_.Deliver(first, last);
+    for (std::vector<Completion>::iterator it = completing.begin();
+         it != completing.end(); ++it) {
+      it->handler_(it->id_, it->outcome_);
+    }
+    delivering.clear();
+    completing.clear();
+  }
+  delivering_.swap(delivering);
+  completing_.swap(completing);
+  delivering_now_ = false;
+  if (durability_policy_.wal_ && !replaying_ &&
+      durability_policy_.wal_->segment() != wal_segment_) {
+    Checkpoint();
+  }
+  if (window_full_ && !WindowFull()) {
+    window_full_ = false;
+    cb_.WindowOpened();
   }
-  uint64_t id = c.mid_;
-  cb_(id, log_[id].first);
-  log_.erase(log_.begin());
-  last_committed_mid_ = id;
-  last_acked_mid_ = std::max(last_acked_mid_, last_committed_mid_);
 }
 
 void
 StateMachine::Receive(const spob::Commit& c, uint32_t from)
 {
-  if (c.primary_ == primary_ && from == ancestors_.front()) {
+  if (c.primary_ == primary_ && IsParent(from)) {
     Commit(c);
   }
 }
@@ -248,76 +853,175 @@ StateMachine::Receive(const spob::Commit& c, uint32_t from)
 void
 StateMachine::Receive(const spob::Reconnect& r, uint32_t from)
 {
-  if (r.primary_ == primary_ && icl::contains(subtree_correct_, from)) {
-    ReconnectResponse rr;
+  if (r.primary_ == primary_ && !constructing_ &&
+      icl::contains(subtree_correct_, from)) {
+    ReconnectResponse(r.last_proposed_, from);
+    children_[from] = std::make_pair(r.max_rank_, r.last_acked_);
+    orphaned_ -= icl::interval<uint32_t>::closed(from, r.max_rank_);
+    AckThrough(SubtreeAcked());
+  }
+}
+
+void
+StateMachine::ReconnectResponse(uint64_t last_proposed, uint32_t to)
+{
+  // Catch to up on everything after last_proposed. What we propose
+  // meanwhile is logged, so the stream takes it along too
+  RecoverStream& stream = streams_[to] = RecoverStream();
+  stream.last_ = CatchUp(last_proposed, to);
+  PumpCatchUp(to);
+}
+
+void
+StateMachine::PumpCatchUp(uint32_t child)
+{
+  // Send the child as much of the log after what it holds as its credit
+  // allows. Nothing it still needs can commit, since it isn't
+  // acknowledged, so it all stays in the log until sent
+  RecoverStream& stream = streams_[child];
+  while (!stream.done_ && (recover_policy_.max_chunks_ == 0 ||
+                           stream.in_flight_ < recover_policy_.max_chunks_)) {
+    spob::ReconnectResponse rr;
     rr.primary_ = primary_;
     rr.last_committed_ = last_committed_mid_;
-    for (LogType::const_iterator it = log_.upper_bound(r.last_proposed_);
-         it != log_.end(); ++it) {
-      rr.proposals_.push_back(std::make_pair(it->first, it->second.first));
-    }
-    comm_.Send(rr, from);
-    children_[from] = std::make_pair(r.max_rank_, r.last_proposed_);
-    // We look in the reverse order of all the outstanding
-    // proposals. If we see one that we are allowed to acknowledge
-    // then all preceding proposals can be acknowledged
-    for (LogType::reverse_iterator it =
-           static_cast<LogType::reverse_iterator>(log_.upper_bound(r.last_acked_));
-         it != log_.rend(); ++it) {
-      it->second.second -= icl::interval<uint32_t>::closed(from, r.max_rank_);
-      if (it->second.second.empty()) {
-        LogType::iterator cmp = it.base();
-        for (LogType::iterator it2 = log_.begin();
-             it2 != cmp; ++it2) {
-          if (rank_ == primary_) {
-            spob::Commit c;
-            c.primary_ = primary_;
-            c.mid_ = it2->first;
-            Commit(c);
-          } else {
-            spob::Ack a;
-            a.primary_ = primary_;
-            a.mid_ = it2->first;
-            Ack(a);
-          }
-        }
-        break;
-      }
+    uint64_t bytes = 0;
+    LogType::const_iterator it = log_.upper_bound(stream.last_);
+    for (; it != log_.end() && (recover_policy_.max_bytes_ == 0 ||
+                                bytes < recover_policy_.max_bytes_); ++it) {
+      rr.proposals_.push_back(*it);
+      bytes += it->second.size();
+    }
+    rr.more_ = catching_up_ || it != log_.end();
+    if (rr.more_ && rr.proposals_.empty()) {
+      // Nothing new to send until more of our own catch-up arrives
+      break;
+    }
+    if (!rr.proposals_.empty()) {
+      stream.last_ = rr.proposals_.back().first;
+    }
+    comm_.Send(rr, child);
+    if (rr.more_) {
+      stream.in_flight_++;
+    } else {
+      stream.done_ = true;
     }
   }
 }
 
+bool
+StateMachine::CatchingUp(uint32_t child) const
+{
+  std::map<uint32_t, RecoverStream>::const_iterator it = streams_.find(child);
+  return !recovering_ && it != streams_.end() && !it->second.done_;
+}
+
 void
 StateMachine::Receive(const spob::ReconnectResponse& recon_resp, uint32_t from)
 {
-  if (recon_resp.primary_ == primary_ && from == ancestors_.front()) {
-    for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator it
-           = children_.begin();
-         it != children_.end(); ++it) {
-      comm_.Send(recon_resp, it->first);
+  if (recon_resp.primary_ == primary_ && IsParent(from)) {
+    // Our children have been sent everything we held so far, and get
+    // the rest from us as it arrives
+    uint64_t sent = last_proposed_mid_;
+    catching_up_ = recon_resp.more_;
+    if (recon_resp.more_) {
+      spob::AckRecoverChunk arc;
+      arc.primary_ = primary_;
+      comm_.Send(arc, from);
     }
-    for (LogType::const_iterator it = log_.begin();
-         it != log_.upper_bound(recon_resp.last_committed_); ++it) {
-      cb_(it->first, it->second.first);
-    }
-    log_.erase(log_.begin(), log_.upper_bound(recon_resp.last_committed_));
-    last_committed_mid_ = recon_resp.last_committed_;
+    Deliver(recon_resp.last_committed_);
     if (!recon_resp.proposals_.empty()) {
-      for (std::list<std::pair<uint64_t, std::string> >::const_iterator it =
+      for (std::vector<Transaction>::const_iterator it =
              recon_resp.proposals_.begin();
            it != recon_resp.proposals_.end(); ++it) {
-        log_.insert(log_.end(),
-                    std::make_pair(it->first,
-                                   std::make_pair(it->second,
-                                                  subtree_correct_)));
-        if (subtree_correct_.empty()) {
-          spob::Ack a;
-          a.primary_ = primary_;
-          a.mid_ = it->first;
-          Ack(a);
-        }
+        Append(*it);
       }
       last_proposed_mid_ = recon_resp.proposals_.rbegin()->first;
+      Persist();
+    }
+    for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator it
+           = children_.begin();
+         it != children_.end(); ++it) {
+      if (!CatchingUp(it->first)) {
+        RecoverStream& stream = streams_[it->first] = RecoverStream();
+        stream.last_ = sent;
+      }
+      PumpCatchUp(it->first);
+    }
+    AckThrough(SubtreeAcked());
+  }
+}
+
+uint64_t
+StateMachine::CatchUp(uint64_t last_proposed, uint32_t to)
+{
+  // Committed proposals have left our log, so if to is missing any of
+  // them, send it our application state in their place. Returns the mid
+  // after which to sends the proposals it still needs
+  if (last_proposed >= last_committed_mid_) {
+    return last_proposed;
+  }
+  spob::Snapshot s;
+  s.primary_ = primary_;
+  s.mid_ = last_committed_mid_;
+  if (!cb_.TakeSnapshot(s.mid_, &s.state_)) {
+    return last_proposed;
+  }
+  comm_.Send(s, to);
+  return s.mid_;
+}
+
+void
+StateMachine::Receive(const spob::Snapshot& s, uint32_t from)
+{
+  if (observer_) {
+    if (from == host_ && s.mid_ > last_committed_mid_) {
+      refused_.clear();
+      Install(s.mid_, s.state_);
+    }
+  } else if (s.primary_ == primary_ && IsParent(from) &&
+             s.mid_ > last_committed_mid_) {
+    // While broadcasting our subtree shares our history, so it needs the
+    // snapshot too. While recovering each child is caught up separately
+    if (!recovering_) {
+      for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator
+             it = children_.begin(); it != children_.end(); ++it) {
+        comm_.Send(s, it->first);
+      }
+    }
+    Install(s.mid_, s.state_);
+  }
+}
+
+void
+StateMachine::Install(uint64_t mid, const Payload& state)
+{
+  cb_.InstallSnapshot(mid, state);
+  if (delivery_policy_.segment_) {
+    delivery_policy_.segment_->Snapshot(mid, state);
+  }
+  // Whatever we logged up to the snapshot is part of it now
+  log_.erase(log_.begin(), log_.upper_bound(mid));
+  last_committed_mid_ = mid;
+  last_proposed_mid_ = std::max(last_proposed_mid_, mid);
+  if (last_acked_mid_ < mid) {
+    last_acked_mid_ = mid;
+    ack_pending_ = 0;
+    ack_timed_ = false;
+  }
+  if (durability_policy_.wal_ && !replaying_) {
+    Checkpoint(mid, state);
+    Sync();
+  }
+  // Our observers skip to the snapshot with us
+  spob::Snapshot s;
+  s.primary_ = primary_;
+  s.mid_ = mid;
+  s.state_ = state;
+  for (std::map<uint32_t, uint64_t>::iterator it = observers_.begin();
+       it != observers_.end(); ++it) {
+    if (it->second < mid) {
+      comm_.Send(s, it->first);
+      it->second = mid;
     }
   }
 }
@@ -328,6 +1032,25 @@ StateMachine::Recover()
   children_.clear();
   ancestors_.clear();
   count_ = 0;
+  // Anything still batched was never sent and dies with our leadership
+  batch_.proposals_.clear();
+  batch_bytes_ = 0;
+  batch_timed_ = false;
+  ack_pending_ = 0;
+  ack_timed_ = false;
+  commit_pending_ = false;
+  commit_timed_ = false;
+  orphaned_.clear();
+  window_messages_ = 0;
+  window_bytes_ = 0;
+  window_full_ = false;
+  while (!completions_.empty()) {
+    uint64_t id = completions_.front().first;
+    CompletionHandler handler;
+    handler.swap(completions_.front().second);
+    completions_.pop_front();
+    handler(id, kLeadershipLost);
+  }
   // If the set of failed processes contains the set of processes
   // with lower rank than me, then I am the lowest ranked correct
   // process
@@ -343,30 +1066,43 @@ StateMachine::Recover()
 void
 StateMachine::ConstructTree()
 {
+  constructing_ = true;
+  recovering_ = true;
   got_propose_ = false;
+  streaming_ = false;
+  catching_up_ = false;
   acked_ = false;
   tree_acks_ = 0;
+  ack_pending_ = 0;
+  ack_timed_ = false;
+  commit_pending_ = false;
+  commit_timed_ = false;
+  orphaned_.clear();
   children_.clear();
+  streams_.clear();
   if (subtree_correct_.empty()) {
     AckTree();
   } else {
-
-    //left child is next lowest rank above ours
-    uint32_t left_child = icl::first(subtree_correct_);
-
-    //right child is the median process in our subtree
-    uint32_t right_child = 0;
-    uint32_t pos = icl::cardinality(subtree_correct_) / 2;
-    for (icl::interval_set<uint32_t>::const_iterator it =
-           subtree_correct_.begin();
-         it != subtree_correct_.end(); ++it) {
-      if (icl::cardinality(*it) > pos) {
-        right_child = icl::first(*it) + pos;
-        break;
+    //split our subtree into up to fanout contiguous ranges, the lowest
+    //rank of each range is our child for it. If the subtree spans
+    //several hosts, only split it where the host changes so that each
+    //run of ranks on one host is entered by a single cross-host edge.
+    //Otherwise split it into ranges of (nearly) equal size
+    uint64_t n = icl::cardinality(subtree_correct_);
+    std::vector<uint64_t> runs = HostRuns();
+    uint64_t k = std::max<uint32_t>(tree_policy_.fanout_, 1);
+    std::vector<uint32_t> child_ranks;
+    if (runs.size() > 1) {
+      k = std::min<uint64_t>(k, runs.size());
+      for (uint64_t i = 0; i < k; ++i) {
+        child_ranks.push_back(Nth(subtree_correct_, runs[i * runs.size() / k]));
+      }
+    } else {
+      k = std::min(k, n);
+      for (uint64_t i = 0; i < k; ++i) {
+        child_ranks.push_back(Nth(subtree_correct_, i * n / k));
       }
-      pos -= icl::cardinality(*it);
     }
-    assert(right_child > 0);
 
     spob::ConstructTree ct;
     ct.ancestors_.push_back(rank_);
@@ -374,19 +1110,45 @@ StateMachine::ConstructTree()
                          ancestors_.end());
     ct.count_ = count_;
 
-    //tell left child to construct
-    uint32_t left_child_max_rank = std::max(left_child, right_child - 1);
-    ct.max_rank_ = left_child_max_rank;
-    comm_.Send(ct, left_child);
-    children_[left_child] = std::make_pair(left_child_max_rank, 0);
+    //tell each child to construct, a child's subtree reaches up to the
+    //next child
+    for (uint64_t i = 0; i < k; ++i) {
+      if (i + 1 < k) {
+        ct.max_rank_ = child_ranks[i + 1] - 1;
+      } else {
+        ct.max_rank_ = icl::last(subtree_correct_);
+      }
+      comm_.Send(ct, child_ranks[i]);
+      children_[child_ranks[i]] = std::make_pair(ct.max_rank_, 0);
+    }
+  }
+}
 
-    if (left_child != right_child) {
-      //tell right child to construct
-      ct.max_rank_ = icl::last(subtree_correct_);
-      comm_.Send(ct, right_child);
-      children_[right_child] = std::make_pair(ct.max_rank_, 0);
+std::vector<uint64_t>
+StateMachine::HostRuns() const
+{
+  // Positions within subtree_correct_ at which a new run of ranks on
+  // the same host starts. Subtrees are rank ranges, so a host whose
+  // ranks are not contiguous starts a new run each time it reappears
+  std::vector<uint64_t> runs;
+  if (tree_policy_.hosts_.empty()) {
+    return runs;
+  }
+  uint64_t pos = 0;
+  uint64_t last_host = 0;
+  for (icl::interval_set<uint32_t>::const_iterator it =
+         subtree_correct_.begin(); it != subtree_correct_.end(); ++it) {
+    for (uint32_t rank = icl::first(*it); rank <= icl::last(*it); ++rank) {
+      uint64_t host = rank < tree_policy_.hosts_.size() ?
+        tree_policy_.hosts_[rank] : kUnmappedHost + rank;
+      if (pos == 0 || host != last_host) {
+        runs.push_back(pos);
+      }
+      last_host = host;
+      pos++;
     }
   }
+  return runs;
 }
 
 void
@@ -396,6 +1158,7 @@ StateMachine::AckTree()
   if (rank_ == primary_) {
     // Tree construction succeeded, send outstanding proposals down
     // the tree
+    got_propose_ = true;
     RecoverPropose();
   } else {
     spob::AckTree at;
@@ -409,39 +1172,91 @@ StateMachine::AckTree()
 void
 StateMachine::RecoverPropose()
 {
-  spob::RecoverPropose rp;
-  rp.primary_ = primary_;
-  // For each child, send a RECOVER_PROPOSE to get them up to date
-  for(std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator it
-        = children_.begin();
-      it != children_.end(); ++it) {
-    if (it->second.second <= last_proposed_mid_) {
-      rp.type_ = RecoverPropose::kDiff;
-      for(LogType::const_iterator it2 = log_.upper_bound(it->second.second);
-          it2 != log_.end(); ++it2) {
-        rp.proposals_.push_back(std::make_pair(it2->first, it2->second.first));
+  // For each child, stream a RECOVER_PROPOSE to get them up to date.
+  // We start as soon as the first chunk of our own arrives, so recovery
+  // is pipelined down the tree
+  if (!streaming_) {
+    streaming_ = true;
+    for (std::map<uint32_t, std::pair<uint32_t, uint64_t> >::const_iterator
+           it = children_.begin(); it != children_.end(); ++it) {
+      streams_[it->first] = RecoverStream();
+    }
+    recover_ack_ = subtree_correct_;
+  }
+  for (std::map<uint32_t, RecoverStream>::const_iterator it =
+         streams_.begin(); it != streams_.end(); ++it) {
+    PumpRecovery(it->first);
+  }
+}
+
+void
+StateMachine::PumpRecovery(uint32_t child)
+{
+  // Send the child as much of its diff as we hold and its credit allows.
+  // While recovering, its slot in children_ is the last mid it holds
+  RecoverStream& stream = streams_[child];
+  uint64_t& last = children_[child].second;
+  while (!stream.done_ && (recover_policy_.max_chunks_ == 0 ||
+                           stream.in_flight_ < recover_policy_.max_chunks_)) {
+    spob::RecoverPropose rp;
+    rp.primary_ = primary_;
+    if (last > last_proposed_mid_) {
+      // The child holds more than we do, which it keeps only if the
+      // rest of our diff catches us up
+      if (!got_propose_) {
+        break;
       }
-    } else {
       rp.type_ = RecoverPropose::kTrunc;
       rp.last_mid_ = last_proposed_mid_;
+      rp.more_ = false;
+      last = last_proposed_mid_;
+    } else {
+      if (!stream.started_) {
+        stream.started_ = true;
+        last = CatchUp(last, child);
+      }
+      rp.type_ = RecoverPropose::kDiff;
+      uint64_t bytes = 0;
+      LogType::const_iterator it = log_.upper_bound(last);
+      for (; it != log_.end() && (recover_policy_.max_bytes_ == 0 ||
+                                  bytes < recover_policy_.max_bytes_); ++it) {
+        rp.proposals_.push_back(*it);
+        bytes += it->second.size();
+      }
+      rp.more_ = !got_propose_ || it != log_.end();
+      if (rp.more_ && rp.proposals_.empty()) {
+        // Nothing new to send until more of our diff arrives
+        break;
+      }
+      if (!rp.proposals_.empty()) {
+        last = rp.proposals_.back().first;
+      }
+    }
+    comm_.Send(rp, child);
+    if (rp.more_) {
+      stream.in_flight_++;
+    } else {
+      stream.done_ = true;
     }
-    comm_.Send(rp, it->first);
   }
-  recover_ack_ = subtree_correct_;
 }
 
 void
 StateMachine::AckRecover()
 {
+  // What we acknowledge must survive a restart
+  Sync();
   acked_ = true;
   last_acked_mid_ = last_proposed_mid_;
+  ack_pending_ = 0;
+  ack_timed_ = false;
   if (rank_ == primary_) {
     RecoverCommit();
     current_mid_ = ((last_proposed_mid_ >> 32) + 1) << 32;
     // Make sure we don't wrap around the epoch
     assert(current_mid_ > last_proposed_mid_);
     cb_(kLeading, primary_);
-  } else {
+  } else if (!ancestors_.empty()) {
     spob::AckRecover ar;
     ar.primary_ = primary_;
     comm_.Send(ar, ancestors_.front());
@@ -458,16 +1273,23 @@ StateMachine::RecoverCommit()
       it != children_.end(); ++it) {
     comm_.Send(rc, it->first);
   }
-  for(LogType::const_iterator it = log_.begin(); it != log_.end(); ++it) {
-    cb_(it->first, it->second.first);
+  if (!log_.empty()) {
+    Deliver(log_.back().first);
   }
-  log_.clear();
   recovering_ = false;
 }
 
 void
 StateMachine::Receive(const spob::Failure& f)
 {
+  if (observer_) {
+    lower_correct_ -= f.rank_;
+    if (f.rank_ == host_) {
+      Attach();
+    }
+    return;
+  }
+  observers_.erase(f.rank_);
   // Remove from the set of correct nodes
   if (f.rank_ <= rank_) {
     lower_correct_ -= f.rank_;
@@ -487,52 +1309,47 @@ StateMachine::Receive(const spob::Failure& f)
     if (icl::contains(subtree_correct_, f.rank_)) {
       // failure in our subtree
       subtree_correct_ -= f.rank_;
-      children_.erase(f.rank_);
+      orphaned_ -= f.rank_;
+      if (children_.count(f.rank_)) {
+        // The failed child's subtree will reconnect to us. Until it
+        // does, hold acks to what the child had acknowledged for it
+        icl::interval_set<uint32_t> orphans = subtree_correct_ &
+          icl::interval<uint32_t>::closed(f.rank_, children_[f.rank_].first);
+        if (!recovering_ && !orphans.empty()) {
+          orphaned_mid_ = orphaned_.empty() ? children_[f.rank_].second :
+            std::min(orphaned_mid_, children_[f.rank_].second);
+          orphaned_ += orphans;
+        }
+        children_.erase(f.rank_);
+        streams_.erase(f.rank_);
+      }
       if (recovering_) {
-        // failure doing recovery, check if we can ack
+        // failure doing recovery, check if we can ack. recover_ack_ is
+        // only populated once we have forwarded the recovery proposal
         recover_ack_ -= f.rank_;
-        if (recover_ack_.empty()) {
+        if (recover_ack_.empty() && got_propose_ && !acked_) {
           AckRecover();
         }
       } else {
-        // failure during broadcast phase, check outstanding proposals
-        // to see if we can ack any of them
-        for (LogType::reverse_iterator it = log_.rbegin();
-             it != static_cast<LogType::reverse_iterator>
-               (log_.upper_bound(last_acked_mid_)); ++it) {
-          it->second.second -= f.rank_;
-          if (it->second.second.empty()) {
-            for (LogType::iterator it2 = log_.upper_bound(last_acked_mid_);
-                 it2 != it.base()++; it2++) {
-              if (rank_ == primary_) {
-                spob::Commit c;
-                c.primary_ = primary_;
-                c.mid_ = it2->first;
-                Commit(c);
-              } else {
-                spob::Ack a;
-                a.primary_ = primary_;
-                a.mid_ = it2->first;
-                Ack(a);
-              }
-            }
-            break;
-          }
-        }
+        // failure during broadcast phase, we may no longer be waiting
+        // on anyone for some outstanding proposals
+        AckThrough(SubtreeAcked());
       }
-    } else if (f.rank_ == ancestors_.front()) {
+    } else if (IsParent(f.rank_)) {
       // our parent failed, find the closest ancestor and reconnect
-      for (std::list<uint32_t>::iterator it = ++(ancestors_.begin());
+      for (Ancestors::iterator it = ancestors_.begin() + 1;
            it != ancestors_.end(); ++it) {
         if (icl::contains(lower_correct_, *it)) {
           if (recovering_) {
             RecoverReconnect rr;
             rr.primary_ = primary_;
+            rr.count_ = count_;
             if (subtree_correct_.empty()) {
               rr.max_rank_ = rank_;
             } else {
               rr.max_rank_ = icl::last(subtree_correct_);
             }
+            rr.last_proposed_ = last_proposed_mid_;
             rr.got_propose_ = got_propose_;
             rr.acked_ = acked_;
             comm_.Send(rr, *it);
@@ -547,6 +1364,9 @@ StateMachine::Receive(const spob::Failure& f)
             r.last_proposed_ = last_proposed_mid_;
             r.last_acked_ = last_acked_mid_;
             comm_.Send(r, *it);
+            // The new parent takes last_acked_ as our acknowledgement
+            ack_pending_ = 0;
+            ack_timed_ = false;
           }
           ancestors_.erase(ancestors_.begin(), it);
           break;
@@ -0,0 +1,127 @@
+#include "Submitter.hpp"
+
+#include <memory>
+
+using namespace spob;
+
+namespace {
+  class Fulfill {
+  public:
+    Fulfill() : promise_(new std::promise<StateMachine::Outcome>) {}
+    std::future<StateMachine::Outcome> future()
+    {
+      return promise_->get_future();
+    }
+    void operator()(uint64_t id, StateMachine::Outcome outcome) const
+    {
+      promise_->set_value(outcome);
+    }
+  private:
+    std::shared_ptr<std::promise<StateMachine::Outcome> > promise_;
+  };
+}
+
+Submitter::Submitter() : tail_(&stub_), held_(0)
+{
+  stub_.next_.store(0, std::memory_order_relaxed);
+  head_.store(&stub_, std::memory_order_relaxed);
+}
+
+Submitter::~Submitter()
+{
+  // Never proposed, so like those Drain fails they have no id
+  while (Node* node = held_ ? held_ : Pop()) {
+    held_ = 0;
+    if (node->handler_) {
+      node->handler_(0, StateMachine::kLeadershipLost);
+    }
+    delete node;
+  }
+}
+
+void
+Submitter::Submit(const Payload& message,
+                  const StateMachine::CompletionHandler& handler)
+{
+  Node* node = new Node;
+  node->message_ = message;
+  node->handler_ = handler;
+  Push(node);
+}
+
+std::future<StateMachine::Outcome>
+Submitter::Submit(const Payload& message)
+{
+  Fulfill fulfill;
+  std::future<StateMachine::Outcome> future = fulfill.future();
+  Submit(message, fulfill);
+  return future;
+}
+
+size_t
+Submitter::Drain(StateMachine& sm)
+{
+  size_t proposed = 0;
+  while (Node* node = held_ ? held_ : Pop()) {
+    held_ = 0;
+    if (!sm.primary()) {
+      // Never proposed, so it has no id
+      if (node->handler_) {
+        node->handler_(0, StateMachine::kLeadershipLost);
+      }
+    } else if (sm.TryPropose(node->message_, node->handler_)) {
+      proposed++;
+    } else {
+      // The window is full or we are still recovering. WindowOpened or
+      // kLeading tells the application when to drain again
+      held_ = node;
+      break;
+    }
+    delete node;
+  }
+  if (proposed > 0) {
+    sm.Flush();
+  }
+  return proposed;
+}
+
+void
+Submitter::Push(Node* node)
+{
+  node->next_.store(0, std::memory_order_relaxed);
+  Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+  // Until this store the consumer sees the list end at prev
+  prev->next_.store(node, std::memory_order_release);
+}
+
+Submitter::Node*
+Submitter::Pop()
+{
+  Node* tail = tail_;
+  Node* next = tail->next_.load(std::memory_order_acquire);
+  if (tail == &stub_) {
+    if (!next) {
+      return 0;
+    }
+    tail_ = next;
+    tail = next;
+    next = next->next_.load(std::memory_order_acquire);
+  }
+  if (next) {
+    tail_ = next;
+    return tail;
+  }
+  // A producer has swapped in a new head but not yet linked it, so the
+  // tail can't be handed out until it has
+  if (tail != head_.load(std::memory_order_acquire)) {
+    return 0;
+  }
+  // The tail is the last node; put the stub behind it so it can go
+  Push(&stub_);
+  next = tail->next_.load(std::memory_order_acquire);
+  if (next) {
+    tail_ = next;
+    return tail;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <future>
+
+#include "Spob.hpp"
+
+namespace spob {
+  // Lets any number of threads propose through a StateMachine that only
+  // the protocol thread touches. Submit pushes onto a lock-free queue
+  // (multiple producers, one consumer). The protocol thread calls Drain
+  // between receives, which proposes everything queued and flushes it as
+  // one batch. Completion handlers run on the protocol thread; a thread
+  // that wants to wait for its proposal takes the future instead.
+  // Receiving is up to each transport, so the protocol thread is the
+  // application's own receive loop rather than one started here
+  class Submitter {
+  public:
+    Submitter();
+    // Protocol thread only, once no thread submits any more. Whatever is
+    // still queued completes with kLeadershipLost
+    ~Submitter();
+
+    // Safe from any thread
+    void Submit(const Payload& message,
+                const StateMachine::CompletionHandler& handler);
+    std::future<StateMachine::Outcome> Submit(const Payload& message);
+
+    // Protocol thread only. Proposes as much as the window allows and
+    // returns how many it proposed. While we recover to lead, everything
+    // stays queued until we do. If another rank is primary, everything
+    // queued completes with kLeadershipLost
+    size_t Drain(StateMachine& sm);
+  private:
+    Submitter(const Submitter&);
+    Submitter& operator=(const Submitter&);
+
+    struct Node {
+      std::atomic<Node*> next_;
+      Payload message_;
+      StateMachine::CompletionHandler handler_;
+    };
+    void Push(Node* node);
+    Node* Pop();
+
+    // Producers swap themselves in at the head, the consumer follows
+    // next_ from the tail. stub_ keeps the list from ever being empty
+    std::atomic<Node*> head_;
+    Node* tail_;
+    Node stub_;
+    // Popped, but the window was full
+    Node* held_;
+  };
+}
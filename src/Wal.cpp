@@ -0,0 +1,402 @@
+#include "Wal.hpp"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <boost/crc.hpp>
+
+using namespace spob;
+
+namespace {
+  // O_DIRECT transfers must be aligned to the device's logical block
+  const size_t kBlock = 4096;
+  // type, payload length, mid and crc
+  const size_t kHeader = 4 + 4 + 8 + 4;
+  const char kPrefix[] = "segment-";
+
+  void
+  Fail(const std::string& what)
+  {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  uint32_t
+  Checksum(uint32_t type, uint32_t length, uint64_t mid, const char* payload)
+  {
+    boost::crc_32_type crc;
+    crc.process_bytes(&type, sizeof(type));
+    crc.process_bytes(&length, sizeof(length));
+    crc.process_bytes(&mid, sizeof(mid));
+    crc.process_bytes(payload, length);
+    return crc.checksum();
+  }
+
+  // Reads a segment front to back a buffer at a time
+  class Reader {
+  public:
+    explicit Reader(const std::string& path)
+      : path_(path), fd_(open(path.c_str(), O_RDONLY)), pos_(0), end_(0),
+        left_(0)
+    {
+      if (fd_ < 0) {
+        Fail("open " + path_);
+      }
+      struct stat st;
+      if (fstat(fd_, &st) != 0) {
+        close(fd_);
+        Fail("fstat " + path_);
+      }
+      left_ = st.st_size;
+    }
+    ~Reader() { close(fd_); }
+    // Bytes of the file not read yet
+    uint64_t left() const { return left_; }
+    // Copies the next size bytes to out, or returns false if the file
+    // ends first
+    bool Read(char* out, size_t size)
+    {
+      if (size > left_) {
+        return false;
+      }
+      while (size > 0) {
+        if (pos_ == end_) {
+          ssize_t n = read(fd_, buf_, sizeof(buf_));
+          if (n < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            Fail("read " + path_);
+          }
+          if (n == 0) {
+            return false;
+          }
+          pos_ = 0;
+          end_ = n;
+        }
+        size_t n = std::min(size, end_ - pos_);
+        memcpy(out, buf_ + pos_, n);
+        pos_ += n;
+        left_ -= n;
+        out += n;
+        size -= n;
+      }
+      return true;
+    }
+  private:
+    Reader(const Reader&);
+    Reader& operator=(const Reader&);
+
+    std::string path_;
+    int fd_;
+    char buf_[1 << 16];
+    size_t pos_;
+    size_t end_;
+    uint64_t left_;
+  };
+
+  // The segment numbers in dir, in ascending order
+  std::vector<uint64_t>
+  Segments(const std::string& dir)
+  {
+    std::vector<uint64_t> segments;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+      Fail("opendir " + dir);
+    }
+    while (struct dirent* entry = readdir(d)) {
+      unsigned long long segment;
+      if (strncmp(entry->d_name, kPrefix, sizeof(kPrefix) - 1) == 0 &&
+          sscanf(entry->d_name + sizeof(kPrefix) - 1, "%llx", &segment) == 1) {
+        segments.push_back(segment);
+      }
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+  }
+}
+
+void
+spob::MakeDirs(const std::string& dir)
+{
+  for (size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+    std::string path = dir.substr(0, pos);
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+      Fail("mkdir " + path);
+    }
+    if (pos == std::string::npos) {
+      break;
+    }
+  }
+}
+
+Wal::Wal(const std::string& dir, SyncMode mode, uint64_t segment_bytes)
+  : dir_(dir), mode_(mode), segment_bytes_(segment_bytes), segment_(0),
+    reclaim_(0), fd_(-1), offset_(0), buf_(0), size_(0), written_(0),
+    capacity_(0)
+{
+  MakeDirs(dir_);
+  // Never append to a segment a previous run may have left torn
+  std::vector<uint64_t> segments = Segments(dir_);
+  if (!segments.empty()) {
+    segment_ = segments.back() + 1;
+  }
+}
+
+Wal::~Wal()
+{
+  if (fd_ >= 0) {
+    try {
+      Sync();
+    } catch (const std::system_error&) {
+    }
+    Close();
+  }
+  free(buf_);
+}
+
+void
+Wal::Replay(const ReplayHandler& handler)
+{
+  std::vector<uint64_t> segments = Segments(dir_);
+  for (std::vector<uint64_t>::const_iterator it = segments.begin();
+       it != segments.end() && *it < segment_; ++it) {
+    Reader reader(SegmentPath(*it));
+    char header[kHeader];
+    while (reader.Read(header, kHeader)) {
+      uint32_t type, length, crc;
+      uint64_t mid;
+      memcpy(&type, header, 4);
+      memcpy(&length, header + 4, 4);
+      memcpy(&mid, header + 8, 8);
+      memcpy(&crc, header + 16, 4);
+      // Zeroes are preallocated space that was never written
+      if (type < Record::kPropose || type > Record::kSnapshot ||
+          length > reader.left()) {
+        break;
+      }
+      std::string payload(length, '\0');
+      if (!reader.Read(&payload[0], length) ||
+          crc != Checksum(type, length, mid, payload.data())) {
+        break;
+      }
+      Record record;
+      record.type_ = static_cast<Record::Type>(type);
+      record.mid_ = mid;
+      if (length > 0) {
+        record.payload_ = Payload(std::move(payload));
+      }
+      handler(record);
+    }
+  }
+}
+
+void
+Wal::Propose(const Transaction& t)
+{
+  Append(Record::kPropose, t.first, t.second);
+}
+
+void
+Wal::Commit(uint64_t mid)
+{
+  Append(Record::kCommit, mid, Payload());
+}
+
+void
+Wal::Truncate(uint64_t mid)
+{
+  Append(Record::kTruncate, mid, Payload());
+}
+
+void
+Wal::Checkpoint(uint64_t mid, const Payload& state)
+{
+  if (fd_ >= 0 && offset_ + size_ > 0) {
+    if (pending()) {
+      Write();
+    }
+    Close();
+    segment_++;
+  }
+  Append(Record::kSnapshot, mid, state);
+  reclaim_ = segment_;
+}
+
+void
+Wal::Sync()
+{
+  if (pending()) {
+    Write();
+  }
+  if (reclaim_ > 0) {
+    Reclaim();
+  }
+}
+
+void
+Wal::Append(Record::Type type, uint64_t mid, const Payload& payload)
+{
+  size_t record = kHeader + payload.size();
+  if (fd_ < 0) {
+    Open();
+  } else if (offset_ + size_ > 0 &&
+             offset_ + size_ + record > segment_bytes_) {
+    // Records never span segments. Not a Sync, which would reclaim
+    // before a checkpoint is whole
+    if (pending()) {
+      Write();
+    }
+    Close();
+    segment_++;
+    Open();
+  }
+  Reserve(size_ + record);
+  uint32_t t = type;
+  uint32_t length = payload.size();
+  uint32_t crc = Checksum(t, length, mid, payload.data());
+  char* p = buf_ + size_;
+  memcpy(p, &t, 4);
+  memcpy(p + 4, &length, 4);
+  memcpy(p + 8, &mid, 8);
+  memcpy(p + 16, &crc, 4);
+  memcpy(p + kHeader, payload.data(), length);
+  size_ += record;
+}
+
+void
+Wal::Reserve(size_t size)
+{
+  // Leave room to pad the last block
+  if (size + kBlock > capacity_) {
+    size_t capacity = std::max(capacity_ * 2,
+                               (size + 2 * kBlock - 1) & ~(kBlock - 1));
+    void* buf;
+    if (posix_memalign(&buf, kBlock, capacity) != 0) {
+      throw std::bad_alloc();
+    }
+    memcpy(buf, buf_, size_);
+    free(buf_);
+    buf_ = static_cast<char*>(buf);
+    capacity_ = capacity;
+  }
+}
+
+void
+Wal::Write()
+{
+  // O_DIRECT writes whole blocks, so the partial block at the end is
+  // padded now and written again once more records fill it
+  size_t length = size_;
+  if (mode_ == kDirect) {
+    length = (size_ + kBlock - 1) & ~(kBlock - 1);
+    memset(buf_ + size_, 0, length - size_);
+  }
+  for (size_t done = 0; done < length; ) {
+    ssize_t n = pwrite(fd_, buf_ + done, length - done, offset_ + done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Fail("pwrite " + SegmentPath(segment_));
+    }
+    done += n;
+  }
+  if (mode_ == kFdatasync && fdatasync(fd_) != 0) {
+    Fail("fdatasync " + SegmentPath(segment_));
+  }
+  size_t full = mode_ == kDirect ? size_ & ~(kBlock - 1) : size_;
+  memmove(buf_, buf_ + full, size_ - full);
+  offset_ += full;
+  size_ -= full;
+  written_ = size_;
+}
+
+void
+Wal::Open()
+{
+  std::string path = SegmentPath(segment_);
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (mode_ == kDirect) {
+#ifdef O_DIRECT
+    flags |= O_DIRECT;
+#endif
+    flags |= O_DSYNC;
+  }
+  fd_ = open(path.c_str(), flags, 0644);
+  if (fd_ < 0) {
+    Fail("open " + path);
+  }
+  if (mode_ == kDirect) {
+    // Writing into allocated space leaves no metadata to flush
+    errno = posix_fallocate(fd_, 0, segment_bytes_);
+    if (errno != 0 && errno != EOPNOTSUPP && errno != EINVAL) {
+      Fail("posix_fallocate " + path);
+    }
+  }
+  // Make the new segment's directory entry durable too
+  SyncDir();
+  offset_ = 0;
+  size_ = 0;
+  written_ = 0;
+}
+
+void
+Wal::Close()
+{
+  close(fd_);
+  fd_ = -1;
+}
+
+void
+Wal::Reclaim()
+{
+  std::vector<uint64_t> segments = Segments(dir_);
+  for (std::vector<uint64_t>::const_iterator it = segments.begin();
+       it != segments.end() && *it < reclaim_; ++it) {
+    std::string path = SegmentPath(*it);
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+      Fail("unlink " + path);
+    }
+  }
+  SyncDir();
+  reclaim_ = 0;
+}
+
+void
+Wal::SyncDir()
+{
+  if (mode_ == kNone) {
+    return;
+  }
+  int dir = open(dir_.c_str(), O_RDONLY);
+  if (dir < 0) {
+    Fail("open " + dir_);
+  }
+  if (fsync(dir) != 0) {
+    close(dir);
+    Fail("fsync " + dir_);
+  }
+  close(dir);
+}
+
+std::string
+Wal::SegmentPath(uint64_t segment) const
+{
+  char name[sizeof(kPrefix) + 16];
+  snprintf(name, sizeof(name), "%s%016llx", kPrefix,
+           static_cast<unsigned long long>(segment));
+  return dir_ + "/" + name;
+}
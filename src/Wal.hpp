@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include <boost/function.hpp>
+
+#include "Messages.hpp"
+
+namespace spob {
+  // Creates dir and any of its parents that are missing
+  void MakeDirs(const std::string& dir);
+
+  // An append-only, on-disk record of what a process logged. Records are
+  // buffered in memory until Sync, so one write (and one flush, if the
+  // sync mode asks for it) makes a whole group of them durable. Each
+  // process writes to numbered segment files in a directory of its own
+  // and starts a fresh segment every time the directory is opened. A
+  // checkpoint makes every segment before it unnecessary, and they are
+  // removed once it is durable
+  class Wal {
+  public:
+    enum SyncMode {
+      kNone, // write to the page cache only
+      kFdatasync, // fdatasync after every write
+      kDirect // O_DIRECT | O_DSYNC writes to preallocated segments
+    };
+    struct Record {
+      enum Type {
+        kPropose = 1,
+        kCommit,
+        kTruncate,
+        kSnapshot
+      };
+      Type type_;
+      uint64_t mid_;
+      Payload payload_; // the proposal or the snapshot state
+    };
+    typedef boost::function<void (const Record& record)> ReplayHandler;
+
+    Wal(const std::string& dir, SyncMode mode,
+        uint64_t segment_bytes = 64 << 20);
+    ~Wal();
+
+    // Hands every intact record in dir to handler, in the order they
+    // were appended. A torn record ends its segment
+    void Replay(const ReplayHandler& handler);
+    void Propose(const Transaction& t);
+    void Commit(uint64_t mid);
+    void Truncate(uint64_t mid);
+    // Starts a new segment with a snapshot through mid. Whatever the
+    // snapshot leaves out must be appended again before the next Sync,
+    // which removes the segments before it
+    void Checkpoint(uint64_t mid, const Payload& state);
+    // Makes every record appended so far durable
+    void Sync();
+    bool pending() const { return size_ > written_; }
+    // The segment being appended to
+    uint64_t segment() const { return segment_; }
+  private:
+    Wal(const Wal&);
+    Wal& operator=(const Wal&);
+
+    void Append(Record::Type type, uint64_t mid, const Payload& payload);
+    void Reserve(size_t size);
+    void Write();
+    void Open();
+    void Close();
+    void Reclaim();
+    void SyncDir();
+    std::string SegmentPath(uint64_t segment) const;
+
+    std::string dir_;
+    SyncMode mode_;
+    uint64_t segment_bytes_;
+    uint64_t segment_;
+    // The segment of a checkpoint the segments before which are still to
+    // be removed, 0 for none
+    uint64_t reclaim_;
+    int fd_;
+    uint64_t offset_;
+    // Records not yet written. With kDirect the buffer stays block
+    // aligned and starts with the partial block last written
+    char* buf_;
+    size_t size_;
+    size_t written_;
+    size_t capacity_;
+  };
+}
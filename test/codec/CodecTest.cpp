@@ -0,0 +1,223 @@
+#include <stdint.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Codec.hpp"
+
+using namespace spob;
+
+namespace {
+  int failures = 0;
+
+  template <typename T>
+  std::string
+  Print(const T& t)
+  {
+    std::ostringstream strm;
+    strm << t;
+    return strm.str();
+  }
+
+  void
+  Fail(const std::string& what, const std::string& message)
+  {
+    std::cerr << "FAIL " << what << ": " << message << std::endl;
+    failures++;
+  }
+
+  // Encodes t, decodes it back and compares the two as printed. Every
+  // proper prefix of the encoding must fail to decode, and a buffer one
+  // byte short must be left alone
+  template <typename T>
+  void
+  RoundTrip(const T& t)
+  {
+    std::string what = Print(t);
+    size_t size = wire::Encode(t, 0, 0);
+    std::vector<char> buf(size + 1, 'x');
+    if (size > 0 && wire::Encode(t, buf.data(), size - 1) != size) {
+      Fail(what, "size changed with the buffer");
+    }
+    if (buf[0] != 'x') {
+      Fail(what, "wrote to a buffer that was too small");
+    }
+    if (wire::Encode(t, buf.data(), buf.size()) != size) {
+      Fail(what, "size changed on encoding");
+    }
+    if (buf[size] != 'x') {
+      Fail(what, "wrote past the encoding");
+    }
+
+    wire::Header header;
+    if (!wire::DecodeHeader(buf.data(), size, &header) ||
+        header.length_ != size) {
+      Fail(what, "bad header");
+    }
+    T decoded;
+    if (!wire::Decode(buf.data(), size, &decoded)) {
+      Fail(what, "did not decode");
+    } else if (Print(decoded) != what) {
+      Fail(what, "decoded as " + Print(decoded));
+    }
+    // Trailing bytes belong to the next message
+    if (!wire::Decode(buf.data(), buf.size(), &decoded)) {
+      Fail(what, "did not decode with bytes following");
+    }
+    for (size_t i = 0; i < size; ++i) {
+      if (wire::Decode(buf.data(), i, &decoded)) {
+        std::ostringstream strm;
+        strm << "decoded from a prefix of " << i << " bytes";
+        Fail(what, strm.str());
+      }
+    }
+  }
+
+  // Decoding as the wrong type or a corrupted length must fail
+  void
+  Mismatch()
+  {
+    Ack a = {3, 7};
+    std::vector<char> buf(wire::Encode(a, 0, 0));
+    wire::Encode(a, buf.data(), buf.size());
+    Commit c;
+    if (wire::Decode(buf.data(), buf.size(), &c)) {
+      Fail(Print(a), "decoded as a Commit");
+    }
+    buf[0]++;
+    if (wire::Decode(buf.data(), buf.size(), &a)) {
+      Fail(Print(a), "decoded with a length past the end");
+    }
+    buf[0] -= 2;
+    if (wire::Decode(buf.data(), buf.size(), &a)) {
+      Fail(Print(a), "decoded with a length short of its body");
+    }
+  }
+
+  uint64_t
+  Mid(uint32_t epoch, uint32_t seq)
+  {
+    return static_cast<uint64_t>(epoch) << 32 | seq;
+  }
+
+  std::vector<Transaction>
+  Transactions(uint64_t first, size_t count, size_t bytes)
+  {
+    std::vector<Transaction> ts;
+    for (size_t i = 0; i < count; ++i) {
+      Payload payload(std::string(bytes, 'a' + i % 26));
+      ts.push_back(Transaction(first + i, payload));
+    }
+    return ts;
+  }
+}
+
+int main()
+{
+  const uint64_t kMaxMid = Mid(0xffffffff, 0xffffffff);
+
+  ConstructTree ct = {0, 0, Ancestors()};
+  RoundTrip(ct);
+  ct.max_rank_ = 0xffffffff;
+  ct.count_ = ~0ULL;
+  for (uint32_t i = 0; i < 20; ++i) {
+    ct.ancestors_.push_back(i * 1000);
+  }
+  RoundTrip(ct);
+
+  AckTree at = {4, 17, Mid(2, 300)};
+  RoundTrip(at);
+  at.last_mid_ = kMaxMid;
+  RoundTrip(at);
+
+  NakTree nt = {0xffffffff, 0};
+  RoundTrip(nt);
+
+  RecoverPropose rp;
+  rp.primary_ = 1;
+  rp.type_ = RecoverPropose::kDiff;
+  rp.last_mid_ = 0;
+  rp.more_ = false;
+  RoundTrip(rp);
+  rp.proposals_ = Transactions(Mid(1, 1), 100, 64);
+  rp.more_ = true;
+  RoundTrip(rp);
+  rp.proposals_.clear();
+  rp.type_ = RecoverPropose::kTrunc;
+  rp.last_mid_ = Mid(3, 0);
+  RoundTrip(rp);
+
+  AckRecover ar = {2};
+  RoundTrip(ar);
+  AckRecoverChunk arc = {5};
+  RoundTrip(arc);
+  RecoverCommit rc = {9};
+  RoundTrip(rc);
+
+  for (int flags = 0; flags < 4; ++flags) {
+    RecoverReconnect rr = {1, 12, 7, Mid(1, 40), (flags & 1) != 0,
+                           (flags & 2) != 0};
+    RoundTrip(rr);
+  }
+
+  Propose p = {0, 0, Transaction(Mid(1, 1), Payload())};
+  RoundTrip(p);
+  p.last_committed_ = kMaxMid;
+  p.proposal_ = Transaction(kMaxMid, Payload(std::string(70000, 'z')));
+  RoundTrip(p);
+
+  ProposeBatch pb = {3, Mid(1, 10), Transactions(Mid(1, 11), 1, 0)};
+  RoundTrip(pb);
+  pb.proposals_ = Transactions(Mid(1, 11), 64, 16);
+  RoundTrip(pb);
+  // Mids across an epoch change don't differ by one
+  pb.proposals_.push_back(Transaction(Mid(2, 1), Payload(std::string("x"))));
+  RoundTrip(pb);
+
+  Ack a = {1, Mid(1, 0x7f)};
+  RoundTrip(a);
+  a.mid_ = Mid(1, 0x80);
+  RoundTrip(a);
+  Commit c = {1, Mid(0x80, 0x3fff)};
+  RoundTrip(c);
+  c.mid_ = Mid(1, 0x4000);
+  RoundTrip(c);
+
+  Reconnect r = {2, 10, Mid(1, 5), Mid(1, 4)};
+  RoundTrip(r);
+
+  ReconnectResponse recon_resp = {2, Mid(1, 4), std::vector<Transaction>(),
+                                  false};
+  RoundTrip(recon_resp);
+  recon_resp.proposals_ = Transactions(Mid(1, 5), 3, 200);
+  recon_resp.more_ = true;
+  RoundTrip(recon_resp);
+
+  Snapshot s = {1, Mid(1, 1000), Payload(std::string("state"))};
+  RoundTrip(s);
+  s.state_ = Payload();
+  RoundTrip(s);
+
+  Observe o = {0};
+  RoundTrip(o);
+  o.last_committed_ = Mid(4, 1);
+  RoundTrip(o);
+
+  ObserveCommit oc;
+  oc.after_ = 0;
+  RoundTrip(oc);
+  oc.after_ = Mid(1, 0);
+  oc.proposals_ = Transactions(Mid(1, 1), 10, 8);
+  RoundTrip(oc);
+
+  Mismatch();
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "All passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,219 @@
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Spob.hpp"
+
+using namespace spob;
+
+namespace {
+  int failures = 0;
+
+  void
+  Fail(const std::string& what, const std::string& message)
+  {
+    std::cerr << "FAIL " << what << ": " << message << std::endl;
+    failures++;
+  }
+
+  // Delivers between the StateMachines of one process, in the order
+  // sent, whenever the test pumps it
+  class Loopback : public CommunicatorInterface {
+  public:
+    typedef std::deque<std::function<void ()> > Queue;
+    Loopback(uint32_t rank, Queue& queue, std::vector<StateMachine*>& sms)
+      : rank_(rank), queue_(queue), sms_(sms) {}
+    void Send(const ConstructTree& ct, uint32_t to) { DoSend(ct, to); }
+    void Send(const AckTree& at, uint32_t to) { DoSend(at, to); }
+    void Send(const NakTree& nt, uint32_t to) { DoSend(nt, to); }
+    void Send(const RecoverPropose& rp, uint32_t to) { DoSend(rp, to); }
+    void Send(const AckRecover& ar, uint32_t to) { DoSend(ar, to); }
+    void Send(const AckRecoverChunk& arc, uint32_t to) { DoSend(arc, to); }
+    void Send(const RecoverCommit& rc, uint32_t to) { DoSend(rc, to); }
+    void Send(const RecoverReconnect& rr, uint32_t to) { DoSend(rr, to); }
+    void Send(const Propose& p, uint32_t to) { DoSend(p, to); }
+    void Send(const ProposeBatch& pb, uint32_t to) { DoSend(pb, to); }
+    void Send(const Ack& a, uint32_t to) { DoSend(a, to); }
+    void Send(const Commit& c, uint32_t to) { DoSend(c, to); }
+    void Send(const Reconnect& r, uint32_t to) { DoSend(r, to); }
+    void Send(const ReconnectResponse& recon_resp, uint32_t to)
+    {
+      DoSend(recon_resp, to);
+    }
+    void Send(const Snapshot& s, uint32_t to) { DoSend(s, to); }
+    void Send(const Observe& o, uint32_t to) { DoSend(o, to); }
+    void Send(const ObserveCommit& oc, uint32_t to) { DoSend(oc, to); }
+  private:
+    template <typename T>
+    void DoSend(const T& t, uint32_t to)
+    {
+      std::vector<StateMachine*>& sms = sms_;
+      uint32_t from = rank_;
+      queue_.push_back([&sms, t, to, from]() { sms[to]->Receive(t, from); });
+    }
+    uint32_t rank_;
+    Queue& queue_;
+    std::vector<StateMachine*>& sms_;
+  };
+
+  // Records what it is handed and how proposals complete, in the order
+  // both happen. On delivering the message named in propose_on_, it
+  // proposes one more and flushes, as an application may
+  class Application : public StateMachine::Callback {
+  public:
+    Application() : sm_(0) {}
+    void operator()(uint64_t id, const Payload& message)
+    {
+      events_.push_back("deliver " + message.str());
+      if (message.str() == propose_on_) {
+        Propose(propose_);
+        sm_->Flush();
+      }
+    }
+    void operator()(StateMachine::Status status, uint32_t primary) {}
+    void Propose(const std::string& message)
+    {
+      sm_->Propose(Payload(message),
+                   [this, message](uint64_t id,
+                                   StateMachine::Outcome outcome) {
+        events_.push_back((outcome == StateMachine::kCommitted ?
+                           "commit " : "lose ") + message);
+      });
+    }
+    StateMachine* sm_;
+    std::string propose_on_;
+    std::string propose_;
+    std::vector<std::string> events_;
+  };
+
+  // Delivers everything sent, including what that sends in turn
+  void
+  Pump(Loopback::Queue& queue)
+  {
+    while (!queue.empty()) {
+      std::function<void ()> deliver;
+      deliver.swap(queue.front());
+      queue.pop_front();
+      deliver();
+    }
+  }
+
+  std::string
+  Join(const std::vector<std::string>& events)
+  {
+    std::string joined;
+    for (size_t i = 0; i < events.size(); ++i) {
+      joined += (i > 0 ? ", " : "") + events[i];
+    }
+    return joined;
+  }
+
+  void
+  RemoveDir(const std::string& dir)
+  {
+    if (DIR* d = opendir(dir.c_str())) {
+      while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..") {
+          unlink((dir + "/" + name).c_str());
+        }
+      }
+      closedir(d);
+    }
+    rmdir(dir.c_str());
+  }
+
+  // A proposal made and flushed from a delivery can commit before the
+  // delivery returns. It must be delivered after the run under way, and
+  // must not take that run's handlers with it. The primary's Wal holds
+  // its own acknowledgement back until a flush, and the follower acks
+  // two proposals at a time, so the flush commits the next proposal
+  void
+  ProposeFromDelivery()
+  {
+    const std::string what = "propose from delivery";
+    char dir[] = "/tmp/delivery-test.XXXXXX";
+    if (!mkdtemp(dir)) {
+      Fail(what, "mkdtemp");
+      return;
+    }
+    {
+      Wal wal(std::string(dir) + "/0", Wal::kNone);
+      StateMachine::DurabilityPolicy durability_policy;
+      durability_policy.wal_ = &wal;
+      durability_policy.max_pending_ = 1000;
+      StateMachine::AckPolicy ack_policy;
+      ack_policy.max_pending_ = 2;
+      Loopback::Queue queue;
+      std::vector<StateMachine*> sms;
+      Loopback comm0(0, queue, sms);
+      Loopback comm1(1, queue, sms);
+      Application app0;
+      Application app1;
+      StateMachine sm0(0, 2, comm0, app0, StateMachine::BatchPolicy(),
+                       StateMachine::AckPolicy(),
+                       StateMachine::CommitPolicy(),
+                       StateMachine::WindowPolicy(),
+                       StateMachine::TreePolicy(),
+                       StateMachine::RecoverPolicy(), durability_policy);
+      StateMachine sm1(1, 2, comm1, app1, StateMachine::BatchPolicy(),
+                       ack_policy);
+      sms.push_back(&sm0);
+      sms.push_back(&sm1);
+      app0.sm_ = &sm0;
+      app0.propose_on_ = "a";
+      app0.propose_ = "c";
+      sm0.Start();
+      sm1.Start();
+      Pump(queue);
+      // a is durable before anyone acks it, b only once c is proposed.
+      // The follower's Ack of both commits a, whose delivery commits b
+      app0.Propose("a");
+      sm0.Flush();
+      app0.Propose("b");
+      Pump(queue);
+      // Only then does the follower ack c
+      sm1.Flush();
+      Pump(queue);
+      std::vector<std::string> expected;
+      expected.push_back("deliver a");
+      expected.push_back("commit a");
+      expected.push_back("deliver b");
+      expected.push_back("commit b");
+      expected.push_back("deliver c");
+      expected.push_back("commit c");
+      if (app0.events_ != expected) {
+        Fail(what, "primary saw " + Join(app0.events_));
+      }
+      expected.clear();
+      expected.push_back("deliver a");
+      expected.push_back("deliver b");
+      expected.push_back("deliver c");
+      if (app1.events_ != expected) {
+        Fail(what, "follower saw " + Join(app1.events_));
+      }
+    }
+    RemoveDir(std::string(dir) + "/0");
+    RemoveDir(dir);
+  }
+}
+
+int main()
+{
+  ProposeFromDelivery();
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "All passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,178 @@
+#include <cmath>
+#include <iostream>
+#include <memory>
+
+#include <boost/program_options.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "Launcher.hpp"
+#include "Spob.hpp"
+
+namespace po = boost::program_options;
+
+// mpi-latency-test with the ranks forked on this host and talking over a
+// local transport
+namespace {
+  bool quit = false;
+  bool verbose;
+  uint32_t string_size;
+  uint32_t fanout;
+  uint32_t spin;
+  boost::timer::cpu_timer timer;
+  typedef boost::timer::nanosecond_type my_time_t;
+  my_time_t GetTime() {
+    return timer.elapsed().wall;
+  }
+  const std::string timer_unit("nanoseconds");
+  // Longest a rank with nothing to do sleeps before looking again
+  const uint64_t kWait = 1000000;
+}
+
+class Callback : public spob::StateMachine::Callback {
+public:
+  Callback(spob::StateMachine** sm, uint32_t rank, long int num_messages,
+           std::ostream& report)
+    : rank_(rank), n_(num_messages), sm_(sm), report_(report),
+      message_(std::string(string_size, '\0'))
+  {
+    primary_ = 0;
+    count_ = 0;
+  }
+
+  void operator()(spob::StateMachine::Status status, uint32_t primary)
+  {
+    if (status == spob::StateMachine::kLeading) {
+      if (verbose) {
+        std::cout << rank_ << ": Recovered and Leading" << std::endl;
+      }
+      primary_ = primary;
+      start_ = GetTime();
+      (*sm_)->Propose(std::string(string_size, ' '));
+    } else if (spob::StateMachine::kFollowing) {
+      primary_ = primary;
+      if (verbose) {
+        std::cout << rank_ << ": Recovered and Following " << primary << std::endl;
+      }
+    }
+  }
+  void operator()(uint64_t id, const spob::Payload& message)
+  {
+    count_++;
+    if (verbose) {
+      std::cout << rank_ << ": Delivered message: 0x" << std::hex << id <<
+        std::dec << ", \"" << message << "\"" << std::endl;
+    }
+    if (count_ == n_) {
+      quit = true;
+      if (rank_ == primary_) {
+        report_ << "Mean = " << new_mean_ << " " << timer_unit
+                << ", StdDev = " << std::sqrt(new_square_/(count_ - 1))
+                << " " << timer_unit << std::endl;
+      }
+    } else if (rank_ == primary_) {
+      my_time_t sample = GetTime() - start_;
+      if (count_ == 1) {
+        old_mean_ = new_mean_ = sample;
+        old_square_ = 0.0;
+      } else {
+        new_mean_ = old_mean_ + (sample - old_mean_)/count_;
+        new_square_ = old_square_ + (sample - old_mean_)*(sample - new_mean_);
+
+        old_mean_ = new_mean_;
+        old_square_ = new_square_;
+      }
+      start_ = GetTime();
+      (*sm_)->Propose(message_);
+    }
+  }
+private:
+  uint32_t primary_;
+  uint32_t rank_;
+  long int count_;
+  long int n_;
+  spob::StateMachine** sm_;
+  std::ostream& report_;
+  my_time_t start_;
+  double old_mean_;
+  double new_mean_;
+  double old_square_;
+  double new_square_;
+  spob::Payload message_;
+};
+
+int main(int argc, char* argv[])
+{
+  int num_messages;
+  uint32_t size;
+  std::string transport;
+  size_t buffer;
+  size_t zero_copy;
+  po::options_description desc("Options");
+  try {
+    desc.add_options()
+      ("help", "produce help message")
+      ("v", po::value<bool>(&verbose)->default_value(false),
+       "enable verbose output")
+      ("np", po::value<uint32_t>(&size)->required(),
+       "set number of ranks")
+      ("nm", po::value<int>(&num_messages)->required(),
+       "set number of messages")
+      ("ss", po::value<uint32_t>(&string_size)->required(),
+       "set string size of message")
+      ("fanout", po::value<uint32_t>(&fanout)->default_value(2),
+       "set max number of children per process")
+      ("transport", po::value<std::string>(&transport)->default_value("shm"),
+       "set how the ranks talk (shm, tcp or uring)")
+      ("buffer", po::value<size_t>(&buffer)->default_value(1 << 20),
+       "set bytes buffered from each rank to each other")
+      ("zc", po::value<size_t>(&zero_copy)->default_value(0),
+       "set bytes from which proposals are sent without copying (uring)")
+      ("spin", po::value<uint32_t>(&spin)->default_value(0),
+       "set number of empty polls before a rank sleeps")
+      ;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 1;
+    }
+
+    po::notify(vm);
+  } catch (std::exception& e) {
+    std::cout << desc << std::endl;
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<Cluster> cluster(NewCluster(transport, size, buffer,
+                                              zero_copy));
+  if (!cluster) {
+    std::cout << "No such transport: " << transport << std::endl;
+    return 1;
+  }
+  return Launch(*cluster, size, [&](uint32_t rank, std::ostream& report) {
+    spob::StateMachine* sm;
+    Callback cb(&sm, rank, num_messages, report);
+    std::unique_ptr<Transport> comm(cluster->Connect(rank, &sm, verbose));
+    spob::StateMachine::TreePolicy tree_policy;
+    tree_policy.fanout_ = fanout;
+    sm = new spob::StateMachine(rank, size, *comm, cb,
+                                spob::StateMachine::BatchPolicy(),
+                                spob::StateMachine::AckPolicy(),
+                                spob::StateMachine::CommitPolicy(),
+                                spob::StateMachine::WindowPolicy(),
+                                tree_policy);
+    sm->Start();
+    uint32_t idle = 0;
+    while (!quit) {
+      if (comm->Process()) {
+        idle = 0;
+      } else if (++idle > spin) {
+        comm->Wait(kWait);
+      }
+    }
+    comm->Leave();
+    delete sm;
+    return 0;
+  });
+}
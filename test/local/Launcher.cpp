@@ -0,0 +1,155 @@
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Launcher.hpp"
+#include "Shm.hpp"
+#include "Tcp.hpp"
+#if HAVE_IO_URING
+#include "Uring.hpp"
+#endif
+
+namespace {
+  // Appends what is ready on fd to out, closing it at the end
+  void
+  Collect(int& fd, std::string& out)
+  {
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0) {
+      out.append(buf, n);
+    } else if (n == 0 || errno != EINTR) {
+      close(fd);
+      fd = -1;
+    }
+  }
+}
+
+Cluster*
+NewCluster(const std::string& transport, uint32_t size, size_t buffer,
+           size_t zero_copy)
+{
+  if (transport == "shm") {
+    return new ShmCluster(size, buffer);
+  }
+  if (transport == "tcp") {
+    return new TcpCluster(size, buffer);
+  }
+  if (transport == "uring") {
+    // Without it the same connections are driven by epoll instead
+#if HAVE_IO_URING
+    std::string why;
+    if (UringCluster::Supported(&why)) {
+      return new UringCluster(size, buffer, zero_copy);
+    }
+    std::cerr << "No io_uring (" << why << "), using tcp" << std::endl;
+#else
+    std::cerr << "Built without io_uring, using tcp" << std::endl;
+#endif
+    return new TcpCluster(size, buffer);
+  }
+  return 0;
+}
+
+int
+Launch(Cluster& cluster, uint32_t size,
+       const std::function<int (uint32_t rank, std::ostream& report)>& body)
+{
+  std::vector<pid_t> pids(size);
+  std::vector<int> fds(size);
+  std::cout.flush();
+  for (uint32_t rank = 0; rank < size; ++rank) {
+    int fd[2];
+    if (pipe(fd) != 0) {
+      std::cerr << "pipe failed" << std::endl;
+      return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fd[0]);
+      std::ostringstream report;
+      int status = body(rank, report);
+      std::cout.flush();
+      std::string out = report.str();
+      for (size_t done = 0; done < out.size();) {
+        ssize_t n = write(fd[1], out.data() + done, out.size() - done);
+        if (n < 0 && errno != EINTR) {
+          break;
+        }
+        done += n > 0 ? n : 0;
+      }
+      // Leave the parent's state, which we share, to the parent
+      _exit(status);
+    }
+    close(fd[1]);
+    if (pid < 0) {
+      std::cerr << "fork failed" << std::endl;
+      close(fd[0]);
+      return 1;
+    }
+    pids[rank] = pid;
+    fds[rank] = fd[0];
+  }
+  cluster.Forked();
+
+  // Reports are read as they come so that a long one can't block its
+  // rank from exiting
+  std::vector<std::string> reports(size);
+  int result = 0;
+  uint32_t running = size;
+  while (running > 0) {
+    std::vector<pollfd> pfds;
+    std::vector<uint32_t> ranks;
+    for (uint32_t rank = 0; rank < size; ++rank) {
+      if (fds[rank] >= 0) {
+        pollfd pfd = {fds[rank], POLLIN, 0};
+        pfds.push_back(pfd);
+        ranks.push_back(rank);
+      }
+    }
+    if (poll(pfds.data(), pfds.size(), 10) > 0) {
+      for (size_t i = 0; i < pfds.size(); ++i) {
+        if (pfds[i].revents) {
+          Collect(fds[ranks[i]], reports[ranks[i]]);
+        }
+      }
+    }
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      uint32_t rank = 0;
+      while (rank < size && pids[rank] != pid) {
+        rank++;
+      }
+      if (rank == size) {
+        continue;
+      }
+      running--;
+      bool finished = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      if (!finished) {
+        cluster.Failed(rank);
+      }
+      if (!finished && !(WIFEXITED(status) &&
+                         WEXITSTATUS(status) == kFailed)) {
+        std::cerr << "rank " << rank << " exited abnormally" << std::endl;
+        result = 1;
+      }
+    }
+  }
+  for (uint32_t rank = 0; rank < size; ++rank) {
+    while (fds[rank] >= 0) {
+      Collect(fds[rank], reports[rank]);
+    }
+    std::cout << reports[rank];
+  }
+  return result;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <ostream>
+#include <string>
+
+#include "Transport.hpp"
+
+// A rank that stops to simulate its failure exits with this
+const int kFailed = 2;
+
+// Sets up size ranks to talk over transport ("shm", "tcp" or "uring"),
+// each with buffer bytes of room for what it sends another. Where the
+// transport can, proposals that encode to at least zero_copy bytes are
+// sent without copying, 0 for never. Returns 0 for a transport we don't
+// have, and "tcp" for "uring" if the kernel lacks it
+Cluster* NewCluster(const std::string& transport, uint32_t size,
+                    size_t buffer, size_t zero_copy);
+
+// Runs body as ranks 0 to size - 1, each in a process of its own forked
+// from this one. What each writes to its report is printed in rank order
+// once they have all exited. A rank exiting with anything but 0 is
+// reported to the cluster as failed. Returns 1 if any rank exited with
+// an error rather than kFailed, otherwise 0
+int Launch(Cluster& cluster, uint32_t size,
+           const std::function<int (uint32_t rank, std::ostream& report)>&
+           body);
@@ -0,0 +1,540 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <system_error>
+
+#include "Codec.hpp"
+#include "Shm.hpp"
+
+namespace {
+  const size_t kCacheLine = 64;
+
+  void
+  Fail(const std::string& what)
+  {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  // The segment starts with a Control, then each rank's Doorbell, then a
+  // RingHeader and its data for every pair of ranks, in order of the
+  // sender and then the receiver
+  struct Control {
+    uint32_t size_;
+    uint64_t ring_bytes_;
+    // Bumped after a Doorbell's dead_ is set
+    alignas(kCacheLine) std::atomic<uint32_t> deaths_;
+  };
+
+  struct Doorbell {
+    // The futex word. Bumped by whoever gives the rank something to do
+    alignas(kCacheLine) std::atomic<uint32_t> seq_;
+    std::atomic<uint32_t> sleeping_;
+    std::atomic<uint32_t> dead_;
+  };
+
+  // The consumer only writes head_ and the producer only tail_. Both
+  // count bytes from the start, so they never wrap
+  struct RingHeader {
+    alignas(kCacheLine) std::atomic<uint64_t> head_;
+    alignas(kCacheLine) std::atomic<uint64_t> tail_;
+    // Set by the producer when the ring is too full for what it has
+    std::atomic<uint32_t> blocked_;
+  };
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "futex words must be plain integers");
+
+  size_t
+  Align(size_t n)
+  {
+    return (n + kCacheLine - 1) & ~(kCacheLine - 1);
+  }
+
+  size_t
+  DoorbellsOffset()
+  {
+    return Align(sizeof(Control));
+  }
+
+  size_t
+  RingsOffset(uint32_t size)
+  {
+    return DoorbellsOffset() + size * sizeof(Doorbell);
+  }
+
+  size_t
+  SegmentBytes(uint32_t size, uint64_t ring_bytes)
+  {
+    return RingsOffset(size) +
+      static_cast<size_t>(size) * size * (sizeof(RingHeader) + ring_bytes);
+  }
+
+  Control*
+  GetControl(char* base)
+  {
+    return reinterpret_cast<Control*>(base);
+  }
+
+  Doorbell*
+  GetDoorbell(char* base, uint32_t rank)
+  {
+    return reinterpret_cast<Doorbell*>(base + DoorbellsOffset()) + rank;
+  }
+
+  RingHeader*
+  GetRing(char* base, uint32_t from, uint32_t to)
+  {
+    Control* control = GetControl(base);
+    size_t stride = sizeof(RingHeader) + control->ring_bytes_;
+    return reinterpret_cast<RingHeader*>(base + RingsOffset(control->size_) +
+                                         (from * control->size_ + to) *
+                                         stride);
+  }
+
+  char*
+  RingData(RingHeader* ring)
+  {
+    return reinterpret_cast<char*>(ring + 1);
+  }
+
+  void
+  FutexWait(std::atomic<uint32_t>* word, uint32_t value, uint64_t ns)
+  {
+    timespec timeout;
+    timeout.tv_sec = ns / 1000000000;
+    timeout.tv_nsec = ns % 1000000000;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value,
+            &timeout, 0, 0);
+  }
+
+  void
+  Wake(Doorbell* doorbell)
+  {
+    doorbell->seq_.fetch_add(1);
+    if (doorbell->sleeping_.load()) {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&doorbell->seq_),
+              FUTEX_WAKE, INT_MAX, 0, 0, 0);
+    }
+  }
+}
+
+ShmCluster::ShmCluster(uint32_t size, size_t ring_bytes)
+{
+  size_t capacity = 4096;
+  while (capacity < ring_bytes) {
+    capacity <<= 1;
+  }
+  bytes_ = SegmentBytes(size, capacity);
+  std::ostringstream name;
+  name << "/spob-" << getpid();
+  int fd = shm_open(name.str().c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    Fail("shm_open " + name.str());
+  }
+  // The ranks are forked from us and inherit the mapping, so the name
+  // can go at once and never outlive a crash
+  shm_unlink(name.str().c_str());
+  if (ftruncate(fd, bytes_) != 0) {
+    close(fd);
+    Fail("ftruncate " + name.str());
+  }
+  void* base = mmap(0, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    Fail("mmap " + name.str());
+  }
+  base_ = static_cast<char*>(base);
+  Control* control = new (base_) Control;
+  control->size_ = size;
+  control->ring_bytes_ = capacity;
+  control->deaths_.store(0);
+  for (uint32_t rank = 0; rank < size; ++rank) {
+    Doorbell* doorbell = new (GetDoorbell(base_, rank)) Doorbell;
+    doorbell->seq_.store(0);
+    doorbell->sleeping_.store(0);
+    doorbell->dead_.store(0);
+  }
+  for (uint32_t from = 0; from < size; ++from) {
+    for (uint32_t to = 0; to < size; ++to) {
+      RingHeader* ring = new (GetRing(base_, from, to)) RingHeader;
+      ring->head_.store(0);
+      ring->tail_.store(0);
+      ring->blocked_.store(0);
+    }
+  }
+}
+
+ShmCluster::~ShmCluster()
+{
+  munmap(base_, bytes_);
+}
+
+Transport*
+ShmCluster::Connect(uint32_t rank, spob::StateMachine** sm, bool verbose)
+{
+  return new ShmCommunicator(base_, rank, sm, verbose);
+}
+
+void
+ShmCluster::Failed(uint32_t rank)
+{
+  Control* control = GetControl(base_);
+  GetDoorbell(base_, rank)->dead_.store(1);
+  control->deaths_.fetch_add(1);
+  for (uint32_t i = 0; i < control->size_; ++i) {
+    Wake(GetDoorbell(base_, i));
+  }
+}
+
+ShmCommunicator::ReceiveVisitor::ReceiveVisitor(ShmCommunicator& comm)
+  : comm_(comm)
+{
+}
+
+template <typename T>
+void
+ShmCommunicator::ReceiveVisitor::operator()(T& t) const
+{
+  if (comm_.verbose_) {
+    std::cout << comm_.rank_ << ": Received " << t << std::endl;
+  }
+  (*comm_.sm_)->Receive(t, from_);
+}
+
+ShmCommunicator::ShmCommunicator(char* base, uint32_t rank,
+                                 spob::StateMachine** sm, bool verbose)
+  : rv_(*this), base_(base), rank_(rank), size_(GetControl(base)->size_),
+    sm_(sm), verbose_(verbose), deaths_(0), dead_(size_),
+    queued_(size_), queued_offset_(size_), partial_(size_)
+{
+}
+
+template <typename T>
+void
+ShmCommunicator::DoSend(const T& t, uint32_t to)
+{
+  if (verbose_) {
+    std::cout << rank_ << ": Sending " << t << " to " << to << std::endl;
+  }
+  if (dead_[to] || GetDoorbell(base_, to)->dead_.load()) {
+    return;
+  }
+  size_t size = spob::wire::Encode(t, encoded_.data(), encoded_.size());
+  if (size > encoded_.size()) {
+    encoded_.resize(size);
+    spob::wire::Encode(t, encoded_.data(), size);
+  }
+  size_t written = 0;
+  if (queued_[to].empty()) {
+    written = Write(to, encoded_.data(), size);
+  }
+  if (written < size) {
+    queued_[to].push_back(std::vector<char>(encoded_.begin() + written,
+                                            encoded_.begin() + size));
+  }
+}
+
+size_t
+ShmCommunicator::Write(uint32_t to, const char* data, size_t size)
+{
+  RingHeader* ring = GetRing(base_, rank_, to);
+  uint64_t capacity = GetControl(base_)->ring_bytes_;
+  uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+  uint64_t free = capacity -
+    (tail - ring->head_.load(std::memory_order_acquire));
+  size_t n = std::min<uint64_t>(size, free);
+  if (n < size) {
+    // Have the receiver wake us once it makes room
+    ring->blocked_.store(1);
+  }
+  if (n == 0) {
+    return 0;
+  }
+  size_t offset = tail & (capacity - 1);
+  size_t first = std::min<size_t>(n, capacity - offset);
+  memcpy(RingData(ring) + offset, data, first);
+  memcpy(RingData(ring), data + first, n - first);
+  ring->tail_.store(tail + n, std::memory_order_release);
+  Wake(GetDoorbell(base_, to));
+  return n;
+}
+
+bool
+ShmCommunicator::Flush(uint32_t to)
+{
+  std::deque<std::vector<char> >& queue = queued_[to];
+  while (!queue.empty()) {
+    std::vector<char>& front = queue.front();
+    size_t& offset = queued_offset_[to];
+    offset += Write(to, front.data() + offset, front.size() - offset);
+    if (offset < front.size()) {
+      return false;
+    }
+    queue.pop_front();
+    offset = 0;
+  }
+  return true;
+}
+
+size_t
+ShmCommunicator::Length(const std::vector<char>& partial, uint32_t from)
+{
+  spob::wire::Header header;
+  if (!spob::wire::DecodeHeader(partial.data(), partial.size(), &header)) {
+    std::cerr << rank_ << ": Malformed message from " << from << std::endl;
+    abort();
+  }
+  return header.length_;
+}
+
+void
+ShmCommunicator::Deliver(const char* data, size_t size, uint32_t from)
+{
+  rv_.from_ = from;
+  if (!spob::wire::Dispatch(data, size, rv_)) {
+    std::cerr << rank_ << ": Malformed message from " << from << std::endl;
+    abort();
+  }
+}
+
+bool
+ShmCommunicator::Read(uint32_t from)
+{
+  RingHeader* ring = GetRing(base_, from, rank_);
+  uint64_t capacity = GetControl(base_)->ring_bytes_;
+  const char* data = RingData(ring);
+  uint64_t head = ring->head_.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail_.load(std::memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+  std::vector<char>& partial = partial_[from];
+  while (head != tail) {
+    size_t offset = head & (capacity - 1);
+    size_t contiguous = std::min<uint64_t>(tail - head, capacity - offset);
+    spob::wire::Header header;
+    if (partial.empty() &&
+        spob::wire::DecodeHeader(data + offset, contiguous, &header) &&
+        header.length_ <= contiguous) {
+      // The whole message is in one piece, so decode it where it is
+      Deliver(data + offset, header.length_, from);
+      head += header.length_;
+    } else {
+      // Put it together a piece at a time, the header first
+      size_t want = spob::wire::kHeaderBytes;
+      if (partial.size() >= want) {
+        want = Length(partial, from);
+      }
+      size_t n = std::min(want - partial.size(), contiguous);
+      partial.insert(partial.end(), data + offset, data + offset + n);
+      head += n;
+      if (partial.size() >= spob::wire::kHeaderBytes &&
+          partial.size() == Length(partial, from)) {
+        Deliver(partial.data(), partial.size(), from);
+        partial.clear();
+      }
+    }
+    // Hand the space back as we go, in case the sender is waiting on it
+    ring->head_.store(head, std::memory_order_release);
+    if (head == tail) {
+      tail = ring->tail_.load(std::memory_order_acquire);
+    }
+  }
+  // Order handing back the space before looking for a blocked sender,
+  // which looks for the space after saying it is blocked
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (ring->blocked_.load() && ring->blocked_.exchange(0)) {
+    Wake(GetDoorbell(base_, from));
+  }
+  return true;
+}
+
+bool
+ShmCommunicator::Process()
+{
+  bool handled = false;
+  uint32_t deaths = GetControl(base_)->deaths_.load();
+  if (deaths != deaths_) {
+    deaths_ = deaths;
+    for (uint32_t i = 0; i < size_; ++i) {
+      if (!dead_[i] && GetDoorbell(base_, i)->dead_.load()) {
+        // Whatever it sent before it died still counts
+        Read(i);
+        dead_[i] = true;
+        queued_[i].clear();
+        queued_offset_[i] = 0;
+        partial_[i].clear();
+        spob::Failure f;
+        f.rank_ = i;
+        (*sm_)->Receive(f);
+        handled = true;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < size_; ++i) {
+    if (i != rank_ && !dead_[i]) {
+      handled = Read(i) || handled;
+    }
+  }
+  for (uint32_t i = 0; i < size_; ++i) {
+    if (!queued_[i].empty()) {
+      Flush(i);
+    }
+  }
+  return handled;
+}
+
+bool
+ShmCommunicator::Ready()
+{
+  if (GetControl(base_)->deaths_.load() != deaths_) {
+    return true;
+  }
+  uint64_t capacity = GetControl(base_)->ring_bytes_;
+  for (uint32_t i = 0; i < size_; ++i) {
+    if (i == rank_ || dead_[i]) {
+      continue;
+    }
+    RingHeader* in = GetRing(base_, i, rank_);
+    if (in->head_.load(std::memory_order_relaxed) !=
+        in->tail_.load(std::memory_order_acquire)) {
+      return true;
+    }
+    RingHeader* out = GetRing(base_, rank_, i);
+    if (!queued_[i].empty() &&
+        out->tail_.load(std::memory_order_relaxed) -
+        out->head_.load(std::memory_order_acquire) < capacity) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+ShmCommunicator::Wait(uint64_t ns)
+{
+  Doorbell* doorbell = GetDoorbell(base_, rank_);
+  doorbell->sleeping_.store(1);
+  uint32_t seq = doorbell->seq_.load();
+  // Anything that arrives after this check bumps seq, so the wait
+  // returns at once
+  if (!Ready()) {
+    FutexWait(&doorbell->seq_, seq, ns);
+  }
+  doorbell->sleeping_.store(0);
+}
+
+void
+ShmCommunicator::Send(const spob::ConstructTree& ct, uint32_t to)
+{
+  DoSend(ct, to);
+}
+
+void
+ShmCommunicator::Send(const spob::AckTree& at, uint32_t to)
+{
+  DoSend(at, to);
+}
+
+void
+ShmCommunicator::Send(const spob::NakTree& nt, uint32_t to)
+{
+  DoSend(nt, to);
+}
+
+void
+ShmCommunicator::Send(const spob::RecoverPropose& rp, uint32_t to)
+{
+  DoSend(rp, to);
+}
+
+void
+ShmCommunicator::Send(const spob::AckRecover& ar, uint32_t to)
+{
+  DoSend(ar, to);
+}
+
+void
+ShmCommunicator::Send(const spob::AckRecoverChunk& arc, uint32_t to)
+{
+  DoSend(arc, to);
+}
+
+void
+ShmCommunicator::Send(const spob::RecoverCommit& rc, uint32_t to)
+{
+  DoSend(rc, to);
+}
+
+void
+ShmCommunicator::Send(const spob::RecoverReconnect& rr, uint32_t to)
+{
+  DoSend(rr, to);
+}
+
+void
+ShmCommunicator::Send(const spob::Propose& p, uint32_t to)
+{
+  DoSend(p, to);
+}
+
+void
+ShmCommunicator::Send(const spob::ProposeBatch& pb, uint32_t to)
+{
+  DoSend(pb, to);
+}
+
+void
+ShmCommunicator::Send(const spob::Ack& a, uint32_t to)
+{
+  DoSend(a, to);
+}
+
+void
+ShmCommunicator::Send(const spob::Commit& c, uint32_t to)
+{
+  DoSend(c, to);
+}
+
+void
+ShmCommunicator::Send(const spob::Reconnect& r, uint32_t to)
+{
+  DoSend(r, to);
+}
+
+void
+ShmCommunicator::Send(const spob::ReconnectResponse& recon_resp, uint32_t to)
+{
+  DoSend(recon_resp, to);
+}
+
+void
+ShmCommunicator::Send(const spob::Snapshot& s, uint32_t to)
+{
+  DoSend(s, to);
+}
+
+void
+ShmCommunicator::Send(const spob::Observe& o, uint32_t to)
+{
+  DoSend(o, to);
+}
+
+void
+ShmCommunicator::Send(const spob::ObserveCommit& oc, uint32_t to)
+{
+  DoSend(oc, to);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include "Transport.hpp"
+
+// Ranks on one host talking through a POSIX shared memory segment. Each
+// ordered pair of ranks has a single producer, single consumer byte ring
+// carrying messages in the wire codec's encoding, and each rank has a
+// doorbell: a futex word its peers bump when they give it something to
+// do, which it sleeps on when it has nothing
+class ShmCluster : public Cluster {
+public:
+  // ring_bytes is rounded up to a power of two
+  ShmCluster(uint32_t size, size_t ring_bytes);
+  ~ShmCluster();
+
+  Transport* Connect(uint32_t rank, spob::StateMachine** sm, bool verbose);
+  void Failed(uint32_t rank);
+private:
+  ShmCluster(const ShmCluster&);
+  ShmCluster& operator=(const ShmCluster&);
+
+  char* base_;
+  size_t bytes_;
+};
+
+class ShmCommunicator : public Transport {
+public:
+  ShmCommunicator(char* base, uint32_t rank, spob::StateMachine** sm,
+                  bool verbose);
+
+  void Send(const spob::ConstructTree& ct, uint32_t to);
+  void Send(const spob::AckTree& at, uint32_t to);
+  void Send(const spob::NakTree& nt, uint32_t to);
+  void Send(const spob::RecoverPropose& rp, uint32_t to);
+  void Send(const spob::AckRecover& ar, uint32_t to);
+  void Send(const spob::AckRecoverChunk& arc, uint32_t to);
+  void Send(const spob::RecoverCommit& rc, uint32_t to);
+  void Send(const spob::RecoverReconnect& rr, uint32_t to);
+  void Send(const spob::Propose& p, uint32_t to);
+  void Send(const spob::ProposeBatch& pb, uint32_t to);
+  void Send(const spob::Ack& a, uint32_t to);
+  void Send(const spob::Commit& c, uint32_t to);
+  void Send(const spob::Reconnect& r, uint32_t to);
+  void Send(const spob::ReconnectResponse& recon_resp, uint32_t to);
+  void Send(const spob::Snapshot& s, uint32_t to);
+  void Send(const spob::Observe& o, uint32_t to);
+  void Send(const spob::ObserveCommit& oc, uint32_t to);
+  bool Process();
+  void Wait(uint64_t ns);
+private:
+  template <typename T>
+  void DoSend(const T& t, uint32_t to);
+  // Copies as much of data into the ring to to as fits, returning how much
+  size_t Write(uint32_t to, const char* data, size_t size);
+  // Writes what is queued for to, returning whether it all went
+  bool Flush(uint32_t to);
+  // Hands on everything in the ring from from
+  bool Read(uint32_t from);
+  // The length of the message partial starts with
+  size_t Length(const std::vector<char>& partial, uint32_t from);
+  void Deliver(const char* data, size_t size, uint32_t from);
+  bool Ready();
+
+  class ReceiveVisitor {
+  public:
+    ReceiveVisitor(ShmCommunicator& comm);
+    template <typename T>
+    void operator()(T& t) const;
+    uint32_t from_;
+  private:
+    ShmCommunicator& comm_;
+  };
+  ReceiveVisitor rv_;
+  char* base_;
+  uint32_t rank_;
+  uint32_t size_;
+  spob::StateMachine** sm_;
+  bool verbose_;
+  uint32_t deaths_;
+  std::vector<bool> dead_;
+  std::vector<char> encoded_;
+  // Messages that didn't fit in a ring yet, and how much of the first
+  // has gone
+  std::vector<std::deque<std::vector<char> > > queued_;
+  std::vector<size_t> queued_offset_;
+  // A message that wrapped around the end of its ring, or has only
+  // partly arrived, is put together here
+  std::vector<std::vector<char> > partial_;
+};
@@ -0,0 +1,608 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <system_error>
+
+#include "Codec.hpp"
+#include "Tcp.hpp"
+
+namespace {
+  // Stands for the listener in epoll, where peers are their rank
+  const uint32_t kListener = ~0U;
+  // Most bytes read from a peer in one go
+  const size_t kReadBytes = 64 * 1024;
+  // Most messages gathered into one write
+  const size_t kMaxGather = 64;
+  // How long Leave waits for what is queued to go
+  const int kLeaveMs = 1000;
+
+  void
+  Fail(const std::string& what)
+  {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  void
+  SetNonBlocking(int fd)
+  {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+      Fail("fcntl");
+    }
+  }
+
+  sockaddr_in
+  Loopback(uint16_t port)
+  {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+  }
+
+  bool
+  WriteAll(int fd, const char* data, size_t size)
+  {
+    while (size > 0) {
+      ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+}
+
+int
+ConnectTo(uint16_t port, uint32_t rank)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    Fail("socket");
+  }
+  sockaddr_in addr = Loopback(port);
+  uint32_t hello = htonl(rank);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      !WriteAll(fd, reinterpret_cast<const char*>(&hello), sizeof(hello))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool
+ReadHello(int fd, uint32_t* rank)
+{
+  // What a listener accepts is blocking even if the listener is not, so
+  // the hello that follows the connect can be waited for
+  uint32_t hello;
+  if (recv(fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello)) {
+    return false;
+  }
+  *rank = ntohl(hello);
+  return true;
+}
+
+void
+TuneSocket(int fd, size_t buffer)
+{
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (buffer > 0) {
+    int size = buffer;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  }
+}
+
+TcpCluster::TcpCluster(uint32_t size, size_t buffer) : buffer_(buffer)
+{
+  for (uint32_t rank = 0; rank < size; ++rank) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      Fail("socket");
+    }
+    listeners_.push_back(fd);
+    sockaddr_in addr = Loopback(0);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), len) != 0 ||
+        listen(fd, SOMAXCONN) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+      Fail("listen");
+    }
+    ports_.push_back(ntohs(addr.sin_port));
+  }
+}
+
+TcpCluster::~TcpCluster()
+{
+  Forked();
+}
+
+Transport*
+TcpCluster::Connect(uint32_t rank, spob::StateMachine** sm, bool verbose)
+{
+  return new TcpCommunicator(rank, listeners_, ports_, buffer_, sm, verbose);
+}
+
+void
+TcpCluster::Forked()
+{
+  // Only the ranks accept, so a rank that has gone refuses connections
+  for (size_t i = 0; i < listeners_.size(); ++i) {
+    if (listeners_[i] >= 0) {
+      close(listeners_[i]);
+      listeners_[i] = -1;
+    }
+  }
+}
+
+TcpCommunicator::ReceiveVisitor::ReceiveVisitor(TcpCommunicator& comm)
+  : comm_(comm)
+{
+}
+
+template <typename T>
+void
+TcpCommunicator::ReceiveVisitor::operator()(T& t) const
+{
+  if (comm_.verbose_) {
+    std::cout << comm_.rank_ << ": Received " << t << std::endl;
+  }
+  (*comm_.sm_)->Receive(t, from_);
+}
+
+TcpCommunicator::TcpCommunicator(uint32_t rank,
+                                 const std::vector<int>& listeners,
+                                 const std::vector<uint16_t>& ports,
+                                 size_t buffer, spob::StateMachine** sm,
+                                 bool verbose)
+  : rv_(*this), rank_(rank), sm_(sm), verbose_(verbose), buffer_(buffer),
+    leaving_(false), peers_(ports.size()), iov_(kMaxGather)
+{
+  for (uint32_t i = 0; i < listeners.size(); ++i) {
+    if (i != rank) {
+      close(listeners[i]);
+    }
+  }
+  listener_ = listeners[rank];
+  SetNonBlocking(listener_);
+  epoll_ = epoll_create1(0);
+  if (epoll_ < 0) {
+    Fail("epoll_create1");
+  }
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = kListener;
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, listener_, &ev) != 0) {
+    Fail("epoll_ctl");
+  }
+  // Everyone is listening already, so these connect at once
+  for (uint32_t i = 0; i < rank; ++i) {
+    int fd = ConnectTo(ports[i], rank_);
+    if (fd < 0) {
+      // It has gone already
+      peers_[i].dead_ = true;
+      lost_.push_back(i);
+      continue;
+    }
+    Add(i, fd);
+  }
+}
+
+TcpCommunicator::~TcpCommunicator()
+{
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    if (peers_[i].fd_ >= 0) {
+      close(peers_[i].fd_);
+    }
+  }
+  close(listener_);
+  close(epoll_);
+}
+
+void
+TcpCommunicator::Add(uint32_t rank, int fd)
+{
+  SetNonBlocking(fd);
+  TuneSocket(fd, buffer_);
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = rank;
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    Fail("epoll_ctl");
+  }
+  Peer& peer = peers_[rank];
+  peer.fd_ = fd;
+  // Anything sent before it connected can go now
+  if (!peer.out_.empty()) {
+    dirty_.push_back(rank);
+  }
+}
+
+void
+TcpCommunicator::Accept()
+{
+  for (;;) {
+    int fd = accept(listener_, 0, 0);
+    if (fd < 0) {
+      return;
+    }
+    uint32_t rank;
+    if (!ReadHello(fd, &rank)) {
+      close(fd);
+      continue;
+    }
+    if (rank <= rank_ || rank >= peers_.size() || peers_[rank].fd_ >= 0) {
+      std::cerr << rank_ << ": Unexpected connection from " << rank <<
+        std::endl;
+      close(fd);
+      continue;
+    }
+    Add(rank, fd);
+  }
+}
+
+template <typename T>
+void
+TcpCommunicator::DoSend(const T& t, uint32_t to)
+{
+  if (verbose_) {
+    std::cout << rank_ << ": Sending " << t << " to " << to << std::endl;
+  }
+  Peer& peer = peers_[to];
+  if (leaving_ || peer.dead_ || peer.left_) {
+    return;
+  }
+  if (peer.out_.empty()) {
+    dirty_.push_back(to);
+  }
+  peer.out_.push_back(std::vector<char>(spob::wire::Encode(t, 0, 0)));
+  std::vector<char>& encoded = peer.out_.back();
+  spob::wire::Encode(t, encoded.data(), encoded.size());
+}
+
+void
+TcpCommunicator::Watch(uint32_t rank, bool writable)
+{
+  Peer& peer = peers_[rank];
+  if (peer.writable_ == writable) {
+    return;
+  }
+  epoll_event ev;
+  ev.events = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.u32 = rank;
+  epoll_ctl(epoll_, EPOLL_CTL_MOD, peer.fd_, &ev);
+  peer.writable_ = writable;
+}
+
+void
+TcpCommunicator::Flush(uint32_t rank)
+{
+  Peer& peer = peers_[rank];
+  if (peer.fd_ < 0) {
+    return;
+  }
+  while (!peer.out_.empty()) {
+    size_t count = std::min(peer.out_.size(), kMaxGather);
+    for (size_t i = 0; i < count; ++i) {
+      size_t offset = i == 0 ? peer.out_offset_ : 0;
+      iov_[i].iov_base = peer.out_[i].data() + offset;
+      iov_[i].iov_len = peer.out_[i].size() - offset;
+    }
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov_.data();
+    msg.msg_iovlen = count;
+    ssize_t n = sendmsg(peer.fd_, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Carry on when epoll says there is room
+        Watch(rank, true);
+      } else {
+        Lost(rank);
+      }
+      return;
+    }
+    size_t sent = n;
+    while (sent > 0) {
+      size_t left = peer.out_.front().size() - peer.out_offset_;
+      if (sent < left) {
+        peer.out_offset_ += sent;
+        break;
+      }
+      sent -= left;
+      peer.out_.pop_front();
+      peer.out_offset_ = 0;
+    }
+  }
+  Watch(rank, false);
+}
+
+void
+TcpCommunicator::FlushAll()
+{
+  std::vector<uint32_t> dirty;
+  dirty.swap(dirty_);
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    Flush(dirty[i]);
+  }
+}
+
+bool
+TcpCommunicator::Read(uint32_t rank)
+{
+  Peer& peer = peers_[rank];
+  bool handled = false;
+  for (;;) {
+    if (peer.in_.size() - peer.in_end_ < kReadBytes) {
+      // Move what is left of the last read to the front, and grow if a
+      // message needs more room than that makes
+      if (peer.in_start_ > 0) {
+        memmove(peer.in_.data(), peer.in_.data() + peer.in_start_,
+                peer.in_end_ - peer.in_start_);
+        peer.in_end_ -= peer.in_start_;
+        peer.in_start_ = 0;
+      }
+      if (peer.in_.size() - peer.in_end_ < kReadBytes) {
+        peer.in_.resize(peer.in_end_ + kReadBytes);
+      }
+    }
+    ssize_t n = read(peer.fd_, peer.in_.data() + peer.in_end_, kReadBytes);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return handled;
+    }
+    if (n <= 0) {
+      Lost(rank);
+      return handled;
+    }
+    peer.in_end_ += n;
+    while (peer.in_end_ - peer.in_start_ >= spob::wire::kHeaderBytes) {
+      const char* data = peer.in_.data() + peer.in_start_;
+      size_t size = peer.in_end_ - peer.in_start_;
+      if (memcmp(data, kGoodbye, sizeof(kGoodbye)) == 0) {
+        peer.left_ = true;
+        peer.in_start_ += sizeof(kGoodbye);
+        continue;
+      }
+      spob::wire::Header header;
+      if (!spob::wire::DecodeHeader(data, size, &header)) {
+        std::cerr << rank_ << ": Malformed message from " << rank <<
+          std::endl;
+        abort();
+      }
+      if (header.length_ > size) {
+        break;
+      }
+      if (!leaving_) {
+        rv_.from_ = rank;
+        if (!spob::wire::Dispatch(data, header.length_, rv_)) {
+          std::cerr << rank_ << ": Malformed message from " << rank <<
+            std::endl;
+          abort();
+        }
+        handled = true;
+      }
+      peer.in_start_ += header.length_;
+    }
+  }
+}
+
+void
+TcpCommunicator::Lost(uint32_t rank)
+{
+  Peer& peer = peers_[rank];
+  epoll_ctl(epoll_, EPOLL_CTL_DEL, peer.fd_, 0);
+  close(peer.fd_);
+  peer.fd_ = -1;
+  peer.out_.clear();
+  peer.out_offset_ = 0;
+  peer.in_start_ = peer.in_end_ = 0;
+  peer.writable_ = false;
+  if (!peer.left_) {
+    // Handed on by Process, so nothing reenters the StateMachine here
+    peer.dead_ = true;
+    lost_.push_back(rank);
+  }
+}
+
+bool
+TcpCommunicator::Process()
+{
+  bool handled = false;
+  epoll_event events[64];
+  int n = epoll_wait(epoll_, events, 64, 0);
+  for (int i = 0; i < n; ++i) {
+    uint32_t rank = events[i].data.u32;
+    if (rank == kListener) {
+      Accept();
+      continue;
+    }
+    if (peers_[rank].fd_ < 0) {
+      continue;
+    }
+    if (events[i].events & EPOLLOUT) {
+      Flush(rank);
+    }
+    if (peers_[rank].fd_ >= 0 &&
+        events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      handled = Read(rank) || handled;
+    }
+  }
+  while (!lost_.empty() && !leaving_) {
+    spob::Failure f;
+    f.rank_ = lost_.front();
+    lost_.pop_front();
+    (*sm_)->Receive(f);
+    handled = true;
+  }
+  FlushAll();
+  return handled;
+}
+
+void
+TcpCommunicator::Wait(uint64_t ns)
+{
+  FlushAll();
+  if (!lost_.empty()) {
+    return;
+  }
+  epoll_event event;
+  epoll_wait(epoll_, &event, 1, (ns + 999999) / 1000000);
+}
+
+void
+TcpCommunicator::Leave()
+{
+  leaving_ = true;
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    Peer& peer = peers_[i];
+    if (peer.fd_ >= 0) {
+      if (peer.out_.empty()) {
+        dirty_.push_back(i);
+      }
+      peer.out_.push_back(std::vector<char>(kGoodbye,
+                                            kGoodbye + sizeof(kGoodbye)));
+    }
+  }
+  // Keep reading, without handing anything on, so that a peer flushing
+  // to us at the same time gets through too
+  for (int ms = 0; ms < kLeaveMs; ++ms) {
+    FlushAll();
+    bool queued = false;
+    for (uint32_t i = 0; i < peers_.size(); ++i) {
+      if (peers_[i].fd_ >= 0 && !peers_[i].out_.empty()) {
+        queued = true;
+      }
+    }
+    if (!queued) {
+      return;
+    }
+    Wait(1000000);
+    Process();
+  }
+}
+
+void
+TcpCommunicator::Send(const spob::ConstructTree& ct, uint32_t to)
+{
+  DoSend(ct, to);
+}
+
+void
+TcpCommunicator::Send(const spob::AckTree& at, uint32_t to)
+{
+  DoSend(at, to);
+}
+
+void
+TcpCommunicator::Send(const spob::NakTree& nt, uint32_t to)
+{
+  DoSend(nt, to);
+}
+
+void
+TcpCommunicator::Send(const spob::RecoverPropose& rp, uint32_t to)
+{
+  DoSend(rp, to);
+}
+
+void
+TcpCommunicator::Send(const spob::AckRecover& ar, uint32_t to)
+{
+  DoSend(ar, to);
+}
+
+void
+TcpCommunicator::Send(const spob::AckRecoverChunk& arc, uint32_t to)
+{
+  DoSend(arc, to);
+}
+
+void
+TcpCommunicator::Send(const spob::RecoverCommit& rc, uint32_t to)
+{
+  DoSend(rc, to);
+}
+
+void
+TcpCommunicator::Send(const spob::RecoverReconnect& rr, uint32_t to)
+{
+  DoSend(rr, to);
+}
+
+void
+TcpCommunicator::Send(const spob::Propose& p, uint32_t to)
+{
+  DoSend(p, to);
+}
+
+void
+TcpCommunicator::Send(const spob::ProposeBatch& pb, uint32_t to)
+{
+  DoSend(pb, to);
+}
+
+void
+TcpCommunicator::Send(const spob::Ack& a, uint32_t to)
+{
+  DoSend(a, to);
+}
+
+void
+TcpCommunicator::Send(const spob::Commit& c, uint32_t to)
+{
+  DoSend(c, to);
+}
+
+void
+TcpCommunicator::Send(const spob::Reconnect& r, uint32_t to)
+{
+  DoSend(r, to);
+}
+
+void
+TcpCommunicator::Send(const spob::ReconnectResponse& recon_resp, uint32_t to)
+{
+  DoSend(recon_resp, to);
+}
+
+void
+TcpCommunicator::Send(const spob::Snapshot& s, uint32_t to)
+{
+  DoSend(s, to);
+}
+
+void
+TcpCommunicator::Send(const spob::Observe& o, uint32_t to)
+{
+  DoSend(o, to);
+}
+
+void
+TcpCommunicator::Send(const spob::ObserveCommit& oc, uint32_t to)
+{
+  DoSend(oc, to);
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <vector>
+
+#include "Codec.hpp"
+#include "Transport.hpp"
+
+// A header of zero length, which no message has, ends a peer's stream
+// when it leaves
+const char kGoodbye[spob::wire::kHeaderBytes] = {0};
+
+// Connects to the rank listening on port and tells it we are rank.
+// Returns the socket, or -1 if that rank has gone
+int ConnectTo(uint16_t port, uint32_t rank);
+// Reads which rank a connection we accepted is from
+bool ReadHello(int fd, uint32_t* rank);
+// Turns off Nagle, and sets the send buffer unless buffer is 0
+void TuneSocket(int fd, size_t buffer);
+
+// Ranks talking over TCP on the loopback interface, one persistent
+// connection between each pair. The cluster listens for every rank before
+// they are forked, so a rank can connect to any other at once: each
+// connects to those below it and says who it is, and accepts the rest
+class TcpCluster : public Cluster {
+public:
+  // buffer sets each socket's send buffer, 0 to leave the default
+  TcpCluster(uint32_t size, size_t buffer);
+  ~TcpCluster();
+
+  Transport* Connect(uint32_t rank, spob::StateMachine** sm, bool verbose);
+  void Forked();
+protected:
+  std::vector<int> listeners_;
+  std::vector<uint16_t> ports_;
+  size_t buffer_;
+private:
+  TcpCluster(const TcpCluster&);
+  TcpCluster& operator=(const TcpCluster&);
+};
+
+// Non-blocking sockets under epoll. Sends are queued and go out together
+// in one gathered write per peer when we next process or wait. Losing a
+// connection other than by Leave is delivered as a spob::Failure
+class TcpCommunicator : public Transport {
+public:
+  TcpCommunicator(uint32_t rank, const std::vector<int>& listeners,
+                  const std::vector<uint16_t>& ports, size_t buffer,
+                  spob::StateMachine** sm, bool verbose);
+  ~TcpCommunicator();
+
+  void Send(const spob::ConstructTree& ct, uint32_t to);
+  void Send(const spob::AckTree& at, uint32_t to);
+  void Send(const spob::NakTree& nt, uint32_t to);
+  void Send(const spob::RecoverPropose& rp, uint32_t to);
+  void Send(const spob::AckRecover& ar, uint32_t to);
+  void Send(const spob::AckRecoverChunk& arc, uint32_t to);
+  void Send(const spob::RecoverCommit& rc, uint32_t to);
+  void Send(const spob::RecoverReconnect& rr, uint32_t to);
+  void Send(const spob::Propose& p, uint32_t to);
+  void Send(const spob::ProposeBatch& pb, uint32_t to);
+  void Send(const spob::Ack& a, uint32_t to);
+  void Send(const spob::Commit& c, uint32_t to);
+  void Send(const spob::Reconnect& r, uint32_t to);
+  void Send(const spob::ReconnectResponse& recon_resp, uint32_t to);
+  void Send(const spob::Snapshot& s, uint32_t to);
+  void Send(const spob::Observe& o, uint32_t to);
+  void Send(const spob::ObserveCommit& oc, uint32_t to);
+  bool Process();
+  void Wait(uint64_t ns);
+  void Leave();
+private:
+  template <typename T>
+  void DoSend(const T& t, uint32_t to);
+
+  struct Peer {
+    Peer() : fd_(-1), out_offset_(0), in_start_(0), in_end_(0),
+             writable_(false), left_(false), dead_(false) {}
+    int fd_;
+    // Encoded messages waiting to go, and how much of the first has
+    std::deque<std::vector<char> > out_;
+    size_t out_offset_;
+    // Bytes received up to in_end_, of which those before in_start_ are
+    // handled
+    std::vector<char> in_;
+    size_t in_start_;
+    size_t in_end_;
+    // Whether epoll is watching for room to write
+    bool writable_;
+    bool left_;
+    bool dead_;
+  };
+  void Add(uint32_t rank, int fd);
+  void Accept();
+  // Writes as much of what is queued as the socket takes
+  void Flush(uint32_t rank);
+  void FlushAll();
+  // Reads what has arrived and hands on every whole message
+  bool Read(uint32_t rank);
+  // Closes the connection, and unless the peer left, queues a Failure
+  void Lost(uint32_t rank);
+  void Watch(uint32_t rank, bool writable);
+
+  class ReceiveVisitor {
+  public:
+    ReceiveVisitor(TcpCommunicator& comm);
+    template <typename T>
+    void operator()(T& t) const;
+    uint32_t from_;
+  private:
+    TcpCommunicator& comm_;
+  };
+  ReceiveVisitor rv_;
+  uint32_t rank_;
+  spob::StateMachine** sm_;
+  bool verbose_;
+  size_t buffer_;
+  bool leaving_;
+  int epoll_;
+  int listener_;
+  std::vector<Peer> peers_;
+  // Peers with sends queued since we last flushed
+  std::vector<uint32_t> dirty_;
+  std::deque<uint32_t> lost_;
+  std::vector<iovec> iov_;
+};
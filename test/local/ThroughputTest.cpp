@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <sstream>
+
+#include <boost/program_options.hpp>
+#include <boost/random.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "Launcher.hpp"
+#include "Spob.hpp"
+
+namespace po = boost::program_options;
+
+// mpi-throughput-test with the ranks forked on this host and talking over
+// a local transport. A rank fails by exiting, and the others learn of it
+// from the transport rather than after a set notify time
+namespace {
+  bool quit = false;
+  bool verbose;
+  uint32_t outstanding;
+  uint32_t batch_size;
+  uint32_t ack_size;
+  bool piggyback;
+  uint32_t fanout;
+  uint32_t string_size;
+  uint32_t samples;
+  uint32_t spin;
+  double pfail;
+  boost::random::mt19937 gen;
+  boost::timer::cpu_timer timer;
+  typedef boost::timer::nanosecond_type my_time_t;
+  my_time_t GetTime() {
+    return timer.elapsed().wall;
+  }
+  const double per_ms = 1000000;
+  my_time_t sample_time;
+  // Longest a rank with nothing to do sleeps before looking again
+  const uint64_t kWait = 1000000;
+
+  std::string
+  pair_to_string(const std::pair<double, uint64_t>& p)
+  {
+    std::ostringstream str;
+    str << p.first << "," << p.second;
+    return str.str();
+  }
+}
+
+class Callback : public spob::StateMachine::Callback {
+public:
+  Callback(spob::StateMachine** sm, uint32_t rank)
+    : rank_(rank), sm_(sm), message_(std::string(string_size, '\0'))
+  {
+    primary_ = -1;
+    count_ = 0;
+    last_count_ = 0;
+    tookover_ = 0;
+  }
+
+  my_time_t TookOver() const
+  {
+    return tookover_;
+  }
+
+  void operator()(spob::StateMachine::Status status, uint32_t primary)
+  {
+    if (status == spob::StateMachine::kLeading) {
+      tookover_ = GetTime();
+      if (verbose) {
+        std::cout << rank_ << ": Recovered and Leading" << std::endl;
+      }
+      primary_ = rank_;
+      last_count_ = count_;
+      for (uint32_t i = 0; i < outstanding; i++) {
+        (*sm_)->Propose(message_);
+      }
+      (*sm_)->Flush();
+    } else if (spob::StateMachine::kFollowing) {
+      primary_ = primary;
+      if (verbose) {
+        std::cout << rank_ << ": Recovered and Following " << primary_ <<
+          std::endl;
+      }
+    } else {
+      primary_ = -1;
+    }
+  }
+  void operator()(uint64_t id, const spob::Payload& message)
+  {
+    count_++;
+    if (verbose) {
+      std::cout << rank_ << ": Delivered message: 0x" << std::hex << id <<
+        std::dec << ", \"" << message << "\"" << std::endl;
+    }
+    if ((int)rank_ == primary_) {
+      (*sm_)->Propose(message_);
+    }
+  }
+  void Deliver(const spob::Transaction* first, const spob::Transaction* last)
+  {
+    if (verbose) {
+      spob::StateMachine::Callback::Deliver(first, last);
+      return;
+    }
+    count_ += last - first;
+    if ((int)rank_ == primary_) {
+      for (; first != last; ++first) {
+        (*sm_)->Propose(message_);
+      }
+    }
+  }
+  // Returns what we delivered since the last sample, if we lead
+  bool Sample(uint64_t* delivered)
+  {
+    if ((int)rank_ != primary_) {
+      return false;
+    }
+    *delivered = count_ - last_count_;
+    last_count_ = count_;
+    return true;
+  }
+private:
+  uint32_t rank_;
+  int primary_;
+  uint64_t count_;
+  uint64_t last_count_;
+  spob::StateMachine** sm_;
+  my_time_t tookover_;
+  spob::Payload message_;
+};
+
+int main(int argc, char* argv[])
+{
+  uint32_t size;
+  std::string transport;
+  size_t buffer;
+  size_t zero_copy;
+  uint32_t seed;
+  po::options_description desc("Options");
+  try {
+    desc.add_options()
+      ("help", "produce help message")
+      ("v", po::value<bool>(&verbose)->default_value(false),
+       "enable verbose output")
+      ("np", po::value<uint32_t>(&size)->required(),
+       "set number of ranks")
+      ("samples", po::value<uint32_t>(&samples)->required(),
+       "set number of samples")
+      ("ts", po::value<my_time_t>(&sample_time)->required(),
+       "set sample time (ms)")
+      ("pfail", po::value<double>(&pfail)->required(),
+       "set probability of failure at each sample")
+      ("seed", po::value<uint32_t>(&seed)->default_value(0),
+       "set random number generator seed")
+      ("no", po::value<uint32_t>(&outstanding)->required(),
+       "set max number of outstanding messages")
+      ("ss", po::value<uint32_t>(&string_size)->required(),
+       "set string size of message")
+      ("bs", po::value<uint32_t>(&batch_size)->default_value(1),
+       "set max number of messages per batch")
+      ("ack", po::value<uint32_t>(&ack_size)->default_value(1),
+       "set max number of messages acknowledged by one ack")
+      ("pb", po::value<bool>(&piggyback)->default_value(false),
+       "piggyback commits on proposals")
+      ("fanout", po::value<uint32_t>(&fanout)->default_value(2),
+       "set max number of children per process")
+      ("transport", po::value<std::string>(&transport)->default_value("shm"),
+       "set how the ranks talk (shm, tcp or uring)")
+      ("buffer", po::value<size_t>(&buffer)->default_value(1 << 20),
+       "set bytes buffered from each rank to each other")
+      ("zc", po::value<size_t>(&zero_copy)->default_value(0),
+       "set bytes from which proposals are sent without copying (uring)")
+      ("spin", po::value<uint32_t>(&spin)->default_value(0),
+       "set number of empty polls before a rank sleeps")
+      ;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 1;
+    }
+
+    po::notify(vm);
+  } catch (std::exception& e) {
+    std::cout << desc << std::endl;
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<Cluster> cluster(NewCluster(transport, size, buffer,
+                                              zero_copy));
+  if (!cluster) {
+    std::cout << "No such transport: " << transport << std::endl;
+    return 1;
+  }
+  return Launch(*cluster, size, [&](uint32_t rank, std::ostream& report) {
+    gen.seed(seed + rank);
+    boost::random::bernoulli_distribution<> dist(pfail);
+    spob::StateMachine* sm;
+    Callback cb(&sm, rank);
+    std::unique_ptr<Transport> comm(cluster->Connect(rank, &sm, verbose));
+    spob::StateMachine::BatchPolicy batch_policy;
+    batch_policy.max_messages_ = batch_size;
+    spob::StateMachine::AckPolicy ack_policy;
+    ack_policy.max_pending_ = ack_size;
+    spob::StateMachine::CommitPolicy commit_policy;
+    commit_policy.piggyback_ = piggyback;
+    spob::StateMachine::TreePolicy tree_policy;
+    tree_policy.fanout_ = fanout;
+    sm = new spob::StateMachine(rank, size, *comm, cb, batch_policy,
+                                ack_policy, commit_policy,
+                                spob::StateMachine::WindowPolicy(),
+                                tree_policy);
+    sm->Start();
+    my_time_t start = GetTime();
+    my_time_t last_time = start;
+    my_time_t failed = 0;
+    uint32_t taken = 0;
+    std::list<std::pair<double, uint64_t> > counts;
+    uint32_t idle = 0;
+    while (!quit) {
+      if (comm->Process()) {
+        idle = 0;
+      } else if (++idle > spin) {
+        comm->Wait(std::min<uint64_t>(kWait, sample_time * per_ms));
+      }
+      sm->Tick(GetTime());
+      if ((GetTime() - last_time) <= (sample_time * per_ms)) {
+        continue;
+      }
+      taken++;
+      last_time = GetTime();
+      uint64_t delivered;
+      if (cb.Sample(&delivered)) {
+        counts.push_back(std::make_pair((last_time - start) / per_ms,
+                                        delivered));
+      }
+      if (taken == samples) {
+        quit = true;
+      } else if (dist(gen)) {
+        failed = last_time;
+        quit = true;
+      }
+    }
+    std::transform(counts.begin(), counts.end(),
+                   std::ostream_iterator<std::string>(report, "\n"),
+                   pair_to_string);
+    if (cb.TookOver() || failed) {
+      report << rank << ": ";
+      if (failed) {
+        report << "failed at " << (failed - start) / per_ms << "ms ";
+      }
+      if (cb.TookOver()) {
+        report << "tookover at " << (cb.TookOver() - start) / per_ms <<
+          "ms ";
+      }
+      report << std::endl;
+    }
+    if (!failed) {
+      comm->Leave();
+    }
+    delete sm;
+    return failed ? kFailed : 0;
+  });
+}
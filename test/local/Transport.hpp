@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Spob.hpp"
+
+// What the local drivers need from a transport besides sending. Process
+// hands whatever has arrived to the StateMachine, including a Failure for
+// each rank the transport finds has died, and returns whether there was
+// anything. Wait blocks until there may be, or ns nanoseconds pass
+class Transport : public spob::CommunicatorInterface {
+public:
+  virtual bool Process() = 0;
+  virtual void Wait(uint64_t ns) = 0;
+  // Called by a rank that is finishing rather than failing, before it
+  // goes, so that the others don't take its going for a failure
+  virtual void Leave() {}
+};
+
+// Sets up whatever the ranks share before they are forked, then connects
+// each of them from its own process
+class Cluster {
+public:
+  virtual Transport* Connect(uint32_t rank, spob::StateMachine** sm,
+                             bool verbose) = 0;
+  // Called in the parent once every rank is forked
+  virtual void Forked() {}
+  // Called in the parent when rank exits without finishing. A transport
+  // that can't see that for itself passes it on to the others
+  virtual void Failed(uint32_t rank) {}
+  virtual ~Cluster() {}
+};
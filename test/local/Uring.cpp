@@ -0,0 +1,923 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <system_error>
+
+#include "Codec.hpp"
+#include "Uring.hpp"
+
+namespace {
+  // Submissions and completions the ring has room for. A tick submits at
+  // most a send and a receive per peer, and a receive completes at most
+  // once per buffer, so neither fills
+  const uint32_t kEntries = 256;
+  const uint32_t kCompletions = 1024;
+  // Receive buffers, and their size. The kernel picks one for whatever
+  // has arrived on any socket
+  const uint32_t kRecvBuffers = 32;
+  const size_t kRecvBytes = 64 * 1024;
+  const uint16_t kGroup = 0;
+  // Size of a block of the send pool, and most blocks it has. Blocks are
+  // pinned while registered, so the pool is kept small, and a send it has
+  // no room for goes from the heap
+  const size_t kSendBytes = 64 * 1024;
+  const size_t kMaxBlocks = 64;
+  // How long a rank waits for those above it to connect
+  const int kConnectMs = 10000;
+  // How long Leave waits for what is queued to go
+  const int kLeaveMs = 1000;
+  // What a completion is for, in the low byte of its user_data with the
+  // rank above. Zero-copy sends carry their ZeroCopy, whose address is
+  // even, so kinds are odd
+  const uint64_t kRecv = 1;
+  const uint64_t kSend = 3;
+
+  void
+  Fail(const std::string& what)
+  {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  uint64_t
+  UserData(uint32_t rank, uint64_t kind)
+  {
+    return static_cast<uint64_t>(rank) << 8 | kind;
+  }
+
+  template <typename T>
+  T*
+  At(void* base, uint32_t offset)
+  {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+  }
+}
+
+UringCluster::UringCluster(uint32_t size, size_t buffer, size_t zero_copy)
+  : TcpCluster(size, buffer), zero_copy_(zero_copy)
+{
+}
+
+Transport*
+UringCluster::Connect(uint32_t rank, spob::StateMachine** sm, bool verbose)
+{
+  return new UringCommunicator(rank, listeners_, ports_, buffer_, zero_copy_,
+                               sm, verbose);
+}
+
+bool
+UringCluster::Supported(std::string* why)
+{
+  try {
+    Ring ring(4, 8);
+    std::vector<char> probe(sizeof(io_uring_probe) +
+                            256 * sizeof(io_uring_probe_op));
+    io_uring_probe* p = reinterpret_cast<io_uring_probe*>(probe.data());
+    ring.Register(IORING_REGISTER_PROBE, p, 256);
+    // Multishot receive has no opcode of its own, but came with SEND_ZC
+    const uint8_t ops[] = {IORING_OP_RECV, IORING_OP_SEND,
+                           IORING_OP_WRITE_FIXED, IORING_OP_SEND_ZC};
+    for (size_t i = 0; i < sizeof(ops); ++i) {
+      if (ops[i] > p->last_op ||
+          !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+        *why = "kernel too old";
+        return false;
+      }
+    }
+  } catch (std::system_error& e) {
+    *why = e.what();
+    return false;
+  }
+  return true;
+}
+
+Ring::Ring(uint32_t entries, uint32_t completions)
+  : fd_(-1), rings_(MAP_FAILED),
+    sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)), tail_(0), submitted_(0)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = completions;
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) {
+    Fail("io_uring_setup");
+  }
+  const uint32_t needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+    IORING_FEAT_EXT_ARG;
+  if ((params.features & needed) != needed) {
+    close(fd_);
+    errno = ENOTSUP;
+    Fail("io_uring_setup");
+  }
+  // The submission and completion rings share one mapping
+  rings_size_ = std::max(params.sq_off.array +
+                         params.sq_entries * sizeof(unsigned),
+                         params.cq_off.cqes +
+                         params.cq_entries * sizeof(io_uring_cqe));
+  rings_ = mmap(0, rings_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(mmap(0, sqes_size_,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd_,
+                                          IORING_OFF_SQES));
+  if (rings_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+    int error = errno;
+    if (rings_ != MAP_FAILED) {
+      munmap(rings_, rings_size_);
+    }
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    close(fd_);
+    errno = error;
+    Fail("mmap");
+  }
+  sq_head_ = At<unsigned>(rings_, params.sq_off.head);
+  sq_tail_ = At<unsigned>(rings_, params.sq_off.tail);
+  sq_mask_ = *At<unsigned>(rings_, params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = At<unsigned>(rings_, params.cq_off.head);
+  cq_tail_ = At<unsigned>(rings_, params.cq_off.tail);
+  cq_mask_ = *At<unsigned>(rings_, params.cq_off.ring_mask);
+  cqes_ = At<io_uring_cqe>(rings_, params.cq_off.cqes);
+  // Submissions are always taken in order, so each slot is its own index
+  unsigned* array = At<unsigned>(rings_, params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i) {
+    array[i] = i;
+  }
+  tail_ = submitted_ = *sq_tail_;
+}
+
+Ring::~Ring()
+{
+  Close();
+}
+
+void
+Ring::Close()
+{
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+  }
+  if (rings_ != MAP_FAILED) {
+    munmap(rings_, rings_size_);
+    rings_ = MAP_FAILED;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+io_uring_sqe*
+Ring::Next()
+{
+  while (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+         sq_entries_) {
+    Enter(0, 0);
+  }
+  io_uring_sqe* sqe = &sqes_[tail_ & sq_mask_];
+  ++tail_;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void
+Ring::Enter(uint32_t wait, uint64_t ns)
+{
+  __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+  unsigned flags = 0;
+  io_uring_getevents_arg arg;
+  __kernel_timespec ts;
+  if (wait > 0) {
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<uintptr_t>(&ts);
+  }
+  int n = syscall(__NR_io_uring_enter, fd_, tail_ - submitted_, wait, flags,
+                  wait > 0 ? &arg : 0, wait > 0 ? sizeof(arg) : 0);
+  if (n >= 0) {
+    submitted_ += n;
+  } else if (errno != EINTR && errno != ETIME && errno != EAGAIN &&
+             errno != EBUSY) {
+    Fail("io_uring_enter");
+  }
+}
+
+bool
+Ring::Queued() const
+{
+  return tail_ != submitted_;
+}
+
+const io_uring_cqe*
+Ring::Peek() const
+{
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  return &cqes_[head & cq_mask_];
+}
+
+void
+Ring::Pop()
+{
+  __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+void
+Ring::Register(uint32_t opcode, void* arg, uint32_t count)
+{
+  if (syscall(__NR_io_uring_register, fd_, opcode, arg, count) < 0) {
+    Fail("io_uring_register");
+  }
+}
+
+UringCommunicator::ReceiveVisitor::ReceiveVisitor(UringCommunicator& comm)
+  : comm_(comm)
+{
+}
+
+template <typename T>
+void
+UringCommunicator::ReceiveVisitor::operator()(T& t) const
+{
+  if (comm_.verbose_) {
+    std::cout << comm_.rank_ << ": Received " << t << std::endl;
+  }
+  (*comm_.sm_)->Receive(t, from_);
+}
+
+UringCommunicator::UringCommunicator(uint32_t rank,
+                                     const std::vector<int>& listeners,
+                                     const std::vector<uint16_t>& ports,
+                                     size_t buffer, size_t zero_copy,
+                                     spob::StateMachine** sm, bool verbose)
+  : rv_(*this), rank_(rank), sm_(sm), verbose_(verbose),
+    zero_copy_(zero_copy), leaving_(false), peers_(ports.size()),
+    buffers_(static_cast<io_uring_buf_ring*>(MAP_FAILED)), buffers_tail_(0),
+    ring_(kEntries, kCompletions)
+{
+  // A write to a peer that has gone raises SIGPIPE in whichever thread
+  // the kernel writes from, so it can't be asked for per send
+  signal(SIGPIPE, SIG_IGN);
+  size_t blocks = (ports.size() - 1) * std::max<size_t>(buffer / kSendBytes,
+                                                        2);
+  blocks = std::min(std::max<size_t>(blocks, 2), kMaxBlocks);
+  pool_.resize(blocks * kSendBytes);
+  for (size_t i = blocks; i > 0; --i) {
+    free_.push_back(i - 1);
+  }
+  iovec iov = {pool_.data(), pool_.size()};
+  ring_.Register(IORING_REGISTER_BUFFERS, &iov, 1);
+
+  recv_.resize(kRecvBuffers * kRecvBytes);
+  buffers_ = static_cast<io_uring_buf_ring*>(
+    mmap(0, kRecvBuffers * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (buffers_ == MAP_FAILED) {
+    Fail("mmap");
+  }
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uintptr_t>(buffers_);
+  reg.ring_entries = kRecvBuffers;
+  reg.bgid = kGroup;
+  ring_.Register(IORING_REGISTER_PBUF_RING, &reg, 1);
+  for (uint32_t bid = 0; bid < kRecvBuffers; ++bid) {
+    Recycle(bid);
+  }
+
+  Connect(listeners, ports, buffer);
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    if (peers_[i].fd_ >= 0) {
+      Arm(i);
+    }
+  }
+  ring_.Enter(0, 0);
+}
+
+UringCommunicator::~UringCommunicator()
+{
+  // Shut every connection down and wait a while for the receives, sends
+  // and zero-copy notifications in flight to complete, so that the kernel
+  // is done with our buffers. Then tear the ring down before freeing any
+  // of them, which cancels whatever is still in flight
+  leaving_ = true;
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    Lost(i);
+  }
+  for (int ms = 0; ms < kLeaveMs && InFlight(); ++ms) {
+    ring_.Enter(1, 1000000);
+    Process();
+  }
+  ring_.Close();
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    if (peers_[i].fd_ >= 0) {
+      close(peers_[i].fd_);
+    }
+  }
+  for (std::set<ZeroCopy*>::iterator it = zero_copies_.begin();
+       it != zero_copies_.end(); ++it) {
+    delete *it;
+  }
+  if (buffers_ != MAP_FAILED) {
+    munmap(buffers_, kRecvBuffers * sizeof(io_uring_buf));
+  }
+}
+
+void
+UringCommunicator::Connect(const std::vector<int>& listeners,
+                           const std::vector<uint16_t>& ports, size_t buffer)
+{
+  for (uint32_t i = 0; i < listeners.size(); ++i) {
+    if (i != rank_) {
+      close(listeners[i]);
+    }
+  }
+  for (uint32_t i = 0; i < rank_; ++i) {
+    int fd = ConnectTo(ports[i], rank_);
+    if (fd >= 0) {
+      Add(i, fd, buffer);
+    }
+  }
+  // The ranks are all started at once, so those above us connect while we
+  // do, and the listener's backlog holds them until we get here
+  int listener = listeners[rank_];
+  uint32_t expected = peers_.size() - rank_ - 1;
+  while (expected > 0) {
+    pollfd pfd = {listener, POLLIN, 0};
+    if (poll(&pfd, 1, kConnectMs) <= 0) {
+      break;
+    }
+    int fd = accept(listener, 0, 0);
+    if (fd < 0) {
+      continue;
+    }
+    uint32_t rank;
+    if (!ReadHello(fd, &rank)) {
+      close(fd);
+      continue;
+    }
+    if (rank <= rank_ || rank >= peers_.size() || peers_[rank].fd_ >= 0) {
+      std::cerr << rank_ << ": Unexpected connection from " << rank <<
+        std::endl;
+      close(fd);
+      continue;
+    }
+    Add(rank, fd, buffer);
+    expected--;
+  }
+  close(listener);
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    if (i != rank_ && peers_[i].fd_ < 0) {
+      // It has gone already
+      peers_[i].dead_ = true;
+      lost_.push_back(i);
+    }
+  }
+}
+
+void
+UringCommunicator::Add(uint32_t rank, int fd, size_t buffer)
+{
+  // Left blocking, since io_uring hands a non-blocking socket's EAGAIN
+  // back rather than waiting for it to be ready
+  TuneSocket(fd, buffer);
+  peers_[rank].fd_ = fd;
+}
+
+void
+UringCommunicator::Arm(uint32_t rank)
+{
+  io_uring_sqe* sqe = ring_.Next();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = peers_[rank].fd_;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kGroup;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = UserData(rank, kRecv);
+  peers_[rank].receiving_ = true;
+}
+
+void
+UringCommunicator::Recycle(uint16_t bid)
+{
+  // Not buffers_->bufs, which C++ lays out after the empty struct the
+  // header puts before it, where C gives that no size
+  io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(buffers_);
+  io_uring_buf& buf = bufs[buffers_tail_ & (kRecvBuffers - 1)];
+  buf.addr = reinterpret_cast<uintptr_t>(recv_.data() + bid * kRecvBytes);
+  buf.len = kRecvBytes;
+  buf.bid = bid;
+  ++buffers_tail_;
+  __atomic_store_n(&buffers_->tail, buffers_tail_, __ATOMIC_RELEASE);
+}
+
+bool
+UringCommunicator::Received(uint32_t rank, int32_t result, uint32_t flags)
+{
+  Peer& peer = peers_[rank];
+  bool handled = false;
+  if (!(flags & IORING_CQE_F_MORE)) {
+    peer.receiving_ = false;
+  }
+  if (result > 0 && !peer.shut_) {
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    const char* data = recv_.data() + bid * kRecvBytes;
+    // Decode straight from the buffer unless a message is split across
+    // it, in which case the rest is copied after the start
+    if (peer.in_.empty()) {
+      size_t used = Handle(rank, data, result, &handled);
+      peer.in_.assign(data + used, data + result);
+    } else {
+      peer.in_.insert(peer.in_.end(), data, data + result);
+      size_t used = Handle(rank, peer.in_.data(), peer.in_.size(),
+                           &handled);
+      peer.in_.erase(peer.in_.begin(), peer.in_.begin() + used);
+    }
+  }
+  if (flags & IORING_CQE_F_BUFFER) {
+    Recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+  }
+  if (peer.shut_) {
+    Close(rank);
+  } else if (result == 0 || (result < 0 && result != -ENOBUFS)) {
+    Lost(rank);
+  } else if (!peer.receiving_) {
+    // It stops when it runs out of buffers, which we have given back
+    Arm(rank);
+  }
+  return handled;
+}
+
+size_t
+UringCommunicator::Handle(uint32_t rank, const char* data, size_t size,
+                          bool* handled)
+{
+  Peer& peer = peers_[rank];
+  size_t used = 0;
+  while (size - used >= spob::wire::kHeaderBytes) {
+    const char* start = data + used;
+    if (memcmp(start, kGoodbye, sizeof(kGoodbye)) == 0) {
+      peer.left_ = true;
+      used += sizeof(kGoodbye);
+      continue;
+    }
+    spob::wire::Header header;
+    if (!spob::wire::DecodeHeader(start, size - used, &header)) {
+      std::cerr << rank_ << ": Malformed message from " << rank << std::endl;
+      abort();
+    }
+    if (header.length_ > size - used) {
+      break;
+    }
+    if (!leaving_) {
+      rv_.from_ = rank;
+      if (!spob::wire::Dispatch(start, header.length_, rv_)) {
+        std::cerr << rank_ << ": Malformed message from " << rank <<
+          std::endl;
+        abort();
+      }
+      *handled = true;
+    }
+    used += header.length_;
+  }
+  return used;
+}
+
+char*
+UringCommunicator::Data(const Chunk& chunk)
+{
+  if (chunk.block_ >= 0) {
+    return pool_.data() + chunk.block_ * kSendBytes;
+  }
+  if (chunk.zero_copy_) {
+    return chunk.zero_copy_->data_.data();
+  }
+  return const_cast<char*>(chunk.heap_.data());
+}
+
+void
+UringCommunicator::Seal(uint32_t rank)
+{
+  Peer& peer = peers_[rank];
+  if (peer.block_ < 0 || peer.filled_ == 0) {
+    return;
+  }
+  peer.out_.push_back(Chunk());
+  peer.out_.back().block_ = peer.block_;
+  peer.out_.back().size_ = peer.filled_;
+  peer.block_ = -1;
+  peer.filled_ = 0;
+}
+
+void
+UringCommunicator::Release(const Chunk& chunk)
+{
+  if (chunk.block_ >= 0) {
+    free_.push_back(chunk.block_);
+  }
+  if (chunk.zero_copy_) {
+    chunk.zero_copy_->sent_ = true;
+    if (chunk.zero_copy_->notifs_ == 0) {
+      zero_copies_.erase(chunk.zero_copy_);
+      delete chunk.zero_copy_;
+    }
+  }
+}
+
+void
+UringCommunicator::MarkDirty(uint32_t rank)
+{
+  if (!peers_[rank].dirty_) {
+    peers_[rank].dirty_ = true;
+    dirty_.push_back(rank);
+  }
+}
+
+template <typename T>
+void
+UringCommunicator::DoSend(const T& t, uint32_t to, bool proposal)
+{
+  if (verbose_) {
+    std::cout << rank_ << ": Sending " << t << " to " << to << std::endl;
+  }
+  Peer& peer = peers_[to];
+  if (leaving_ || peer.fd_ < 0 || peer.shut_ || peer.left_) {
+    return;
+  }
+  MarkDirty(to);
+  if (proposal && zero_copy_ > 0) {
+    size_t size = spob::wire::Encode(t, 0, 0);
+    if (size >= zero_copy_) {
+      Seal(to);
+      ZeroCopy* zc = new ZeroCopy(to, size);
+      zero_copies_.insert(zc);
+      spob::wire::Encode(t, zc->data_.data(), size);
+      peer.out_.push_back(Chunk());
+      peer.out_.back().size_ = size;
+      peer.out_.back().zero_copy_ = zc;
+      return;
+    }
+  }
+  // Into what is left of the block being filled, or failing that a fresh
+  // one, or failing that the heap
+  for (;;) {
+    if (peer.block_ < 0 && !free_.empty()) {
+      peer.block_ = free_.back();
+      free_.pop_back();
+    }
+    if (peer.block_ < 0) {
+      break;
+    }
+    size_t room = kSendBytes - peer.filled_;
+    size_t size = spob::wire::Encode(t, pool_.data() +
+                                     peer.block_ * kSendBytes +
+                                     peer.filled_, room);
+    if (size <= room) {
+      peer.filled_ += size;
+      return;
+    }
+    if (peer.filled_ == 0) {
+      break;
+    }
+    Seal(to);
+  }
+  Seal(to);
+  peer.out_.push_back(Chunk());
+  Chunk& chunk = peer.out_.back();
+  chunk.heap_.resize(spob::wire::Encode(t, 0, 0));
+  chunk.size_ = chunk.heap_.size();
+  spob::wire::Encode(t, chunk.heap_.data(), chunk.size_);
+}
+
+void
+UringCommunicator::FlushAll()
+{
+  std::vector<uint32_t> dirty;
+  dirty.swap(dirty_);
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    uint32_t rank = dirty[i];
+    Peer& peer = peers_[rank];
+    peer.dirty_ = false;
+    if (peer.fd_ < 0 || peer.shut_ || peer.sending_) {
+      // Whatever is encoded meanwhile goes after the send in flight
+      continue;
+    }
+    Seal(rank);
+    if (peer.out_.empty()) {
+      continue;
+    }
+    const Chunk& chunk = peer.out_.front();
+    io_uring_sqe* sqe = ring_.Next();
+    sqe->fd = peer.fd_;
+    sqe->addr = reinterpret_cast<uintptr_t>(Data(chunk) + peer.out_offset_);
+    sqe->len = chunk.size_ - peer.out_offset_;
+    sqe->user_data = UserData(rank, kSend);
+    if (chunk.block_ >= 0) {
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->buf_index = 0;
+    } else if (chunk.zero_copy_) {
+      sqe->opcode = IORING_OP_SEND_ZC;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = reinterpret_cast<uintptr_t>(chunk.zero_copy_);
+    } else {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    peer.sending_ = true;
+  }
+}
+
+void
+UringCommunicator::Sent(uint32_t rank, int32_t result)
+{
+  Peer& peer = peers_[rank];
+  peer.sending_ = false;
+  if (result > 0 && !peer.shut_) {
+    peer.out_offset_ += result;
+    if (peer.out_offset_ < peer.out_.front().size_) {
+      MarkDirty(rank);
+      return;
+    }
+  }
+  Release(peer.out_.front());
+  peer.out_.pop_front();
+  peer.out_offset_ = 0;
+  if (peer.shut_) {
+    Close(rank);
+  } else if (result <= 0) {
+    Lost(rank);
+  } else {
+    MarkDirty(rank);
+  }
+}
+
+void
+UringCommunicator::Lost(uint32_t rank)
+{
+  Peer& peer = peers_[rank];
+  if (peer.fd_ < 0 || peer.shut_) {
+    return;
+  }
+  // Ends the receive and any send in flight, which close it once they
+  // have completed
+  shutdown(peer.fd_, SHUT_RDWR);
+  peer.shut_ = true;
+  while (peer.out_.size() > (peer.sending_ ? 1 : 0)) {
+    Release(peer.out_.back());
+    peer.out_.pop_back();
+  }
+  if (peer.block_ >= 0) {
+    free_.push_back(peer.block_);
+    peer.block_ = -1;
+    peer.filled_ = 0;
+  }
+  peer.in_.clear();
+  if (!peer.left_) {
+    // Handed on by Process, so nothing reenters the StateMachine here
+    peer.dead_ = true;
+    lost_.push_back(rank);
+  }
+  Close(rank);
+}
+
+bool
+UringCommunicator::InFlight() const
+{
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    if (peers_[i].receiving_ || peers_[i].sending_) {
+      return true;
+    }
+  }
+  for (std::set<ZeroCopy*>::const_iterator it = zero_copies_.begin();
+       it != zero_copies_.end(); ++it) {
+    if ((*it)->notifs_ > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+UringCommunicator::Close(uint32_t rank)
+{
+  Peer& peer = peers_[rank];
+  if (peer.fd_ >= 0 && !peer.receiving_ && !peer.sending_) {
+    close(peer.fd_);
+    peer.fd_ = -1;
+  }
+}
+
+bool
+UringCommunicator::Process()
+{
+  bool handled = false;
+  const io_uring_cqe* cqe;
+  while ((cqe = ring_.Peek()) != 0) {
+    uint64_t data = cqe->user_data;
+    int32_t result = cqe->res;
+    uint32_t flags = cqe->flags;
+    ring_.Pop();
+    if (data & 1) {
+      uint32_t rank = data >> 8;
+      if ((data & 0xff) == kRecv) {
+        handled = Received(rank, result, flags) || handled;
+      } else {
+        Sent(rank, result);
+      }
+      continue;
+    }
+    ZeroCopy* zc = reinterpret_cast<ZeroCopy*>(data);
+    if (flags & IORING_CQE_F_NOTIF) {
+      if (--zc->notifs_ == 0 && zc->sent_) {
+        zero_copies_.erase(zc);
+        delete zc;
+      }
+      continue;
+    }
+    // Counted before Sent can release it
+    if (flags & IORING_CQE_F_MORE) {
+      zc->notifs_++;
+    }
+    Sent(zc->rank_, result);
+  }
+  while (!lost_.empty() && !leaving_) {
+    spob::Failure f;
+    f.rank_ = lost_.front();
+    lost_.pop_front();
+    (*sm_)->Receive(f);
+    handled = true;
+  }
+  FlushAll();
+  if (ring_.Queued()) {
+    ring_.Enter(0, 0);
+  }
+  return handled;
+}
+
+void
+UringCommunicator::Wait(uint64_t ns)
+{
+  FlushAll();
+  if (!lost_.empty() || ring_.Peek()) {
+    if (ring_.Queued()) {
+      ring_.Enter(0, 0);
+    }
+    return;
+  }
+  ring_.Enter(1, ns);
+}
+
+void
+UringCommunicator::Leave()
+{
+  leaving_ = true;
+  for (uint32_t i = 0; i < peers_.size(); ++i) {
+    Peer& peer = peers_[i];
+    if (peer.fd_ >= 0 && !peer.shut_) {
+      Seal(i);
+      peer.out_.push_back(Chunk());
+      peer.out_.back().heap_.assign(kGoodbye, kGoodbye + sizeof(kGoodbye));
+      peer.out_.back().size_ = sizeof(kGoodbye);
+      MarkDirty(i);
+    }
+  }
+  // Keep receiving, without handing anything on, so that a peer flushing
+  // to us at the same time gets through too
+  for (int ms = 0; ms < kLeaveMs; ++ms) {
+    FlushAll();
+    bool queued = false;
+    for (uint32_t i = 0; i < peers_.size(); ++i) {
+      const Peer& peer = peers_[i];
+      if (peer.fd_ >= 0 && !peer.shut_ &&
+          (peer.sending_ || !peer.out_.empty())) {
+        queued = true;
+      }
+    }
+    if (!queued) {
+      return;
+    }
+    Wait(1000000);
+    Process();
+  }
+}
+
+void
+UringCommunicator::Send(const spob::ConstructTree& ct, uint32_t to)
+{
+  DoSend(ct, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::AckTree& at, uint32_t to)
+{
+  DoSend(at, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::NakTree& nt, uint32_t to)
+{
+  DoSend(nt, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::RecoverPropose& rp, uint32_t to)
+{
+  DoSend(rp, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::AckRecover& ar, uint32_t to)
+{
+  DoSend(ar, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::AckRecoverChunk& arc, uint32_t to)
+{
+  DoSend(arc, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::RecoverCommit& rc, uint32_t to)
+{
+  DoSend(rc, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::RecoverReconnect& rr, uint32_t to)
+{
+  DoSend(rr, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::Propose& p, uint32_t to)
+{
+  DoSend(p, to, true);
+}
+
+void
+UringCommunicator::Send(const spob::ProposeBatch& pb, uint32_t to)
+{
+  DoSend(pb, to, true);
+}
+
+void
+UringCommunicator::Send(const spob::Ack& a, uint32_t to)
+{
+  DoSend(a, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::Commit& c, uint32_t to)
+{
+  DoSend(c, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::Reconnect& r, uint32_t to)
+{
+  DoSend(r, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::ReconnectResponse& recon_resp,
+                        uint32_t to)
+{
+  DoSend(recon_resp, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::Snapshot& s, uint32_t to)
+{
+  DoSend(s, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::Observe& o, uint32_t to)
+{
+  DoSend(o, to, false);
+}
+
+void
+UringCommunicator::Send(const spob::ObserveCommit& oc, uint32_t to)
+{
+  DoSend(oc, to, false);
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Tcp.hpp"
+
+// The same connections as TcpCluster, driven through io_uring instead of
+// epoll
+class UringCluster : public TcpCluster {
+public:
+  // Proposals that encode to at least zero_copy bytes are sent without
+  // being copied into the socket, 0 for never
+  UringCluster(uint32_t size, size_t buffer, size_t zero_copy);
+
+  Transport* Connect(uint32_t rank, spob::StateMachine** sm, bool verbose);
+  // Whether this kernel has all UringCommunicator uses, and if not, why
+  static bool Supported(std::string* why);
+private:
+  size_t zero_copy_;
+};
+
+// An io_uring set up with the raw system calls. Submissions are queued by
+// Next and only reach the kernel on Enter, so everything queued between
+// two calls goes in one system call
+class Ring {
+public:
+  Ring(uint32_t entries, uint32_t completions);
+  ~Ring();
+  // Tears the ring down early. The kernel cancels whatever is in flight
+  void Close();
+
+  // A cleared submission to fill in
+  io_uring_sqe* Next();
+  // Submits what is queued, then waits up to ns for wait completions
+  void Enter(uint32_t wait, uint64_t ns);
+  // Whether there are submissions Enter hasn't passed on
+  bool Queued() const;
+  // The oldest completion, or 0 if there is none, and dropping it
+  const io_uring_cqe* Peek() const;
+  void Pop();
+  void Register(uint32_t opcode, void* arg, uint32_t count);
+private:
+  Ring(const Ring&);
+  Ring& operator=(const Ring&);
+
+  int fd_;
+  void* rings_;
+  size_t rings_size_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+  // Submissions queued, and those of them passed on
+  unsigned tail_;
+  unsigned submitted_;
+};
+
+// Each peer's socket has a multishot receive that stays armed, filling
+// buffers the kernel picks from a ring of them we hand back as we are
+// done. Sends are encoded straight into blocks of a registered pool and
+// written one block at a time per peer. Losing a connection other than
+// by Leave is delivered as a spob::Failure
+class UringCommunicator : public Transport {
+public:
+  UringCommunicator(uint32_t rank, const std::vector<int>& listeners,
+                    const std::vector<uint16_t>& ports, size_t buffer,
+                    size_t zero_copy, spob::StateMachine** sm, bool verbose);
+  ~UringCommunicator();
+
+  void Send(const spob::ConstructTree& ct, uint32_t to);
+  void Send(const spob::AckTree& at, uint32_t to);
+  void Send(const spob::NakTree& nt, uint32_t to);
+  void Send(const spob::RecoverPropose& rp, uint32_t to);
+  void Send(const spob::AckRecover& ar, uint32_t to);
+  void Send(const spob::AckRecoverChunk& arc, uint32_t to);
+  void Send(const spob::RecoverCommit& rc, uint32_t to);
+  void Send(const spob::RecoverReconnect& rr, uint32_t to);
+  void Send(const spob::Propose& p, uint32_t to);
+  void Send(const spob::ProposeBatch& pb, uint32_t to);
+  void Send(const spob::Ack& a, uint32_t to);
+  void Send(const spob::Commit& c, uint32_t to);
+  void Send(const spob::Reconnect& r, uint32_t to);
+  void Send(const spob::ReconnectResponse& recon_resp, uint32_t to);
+  void Send(const spob::Snapshot& s, uint32_t to);
+  void Send(const spob::Observe& o, uint32_t to);
+  void Send(const spob::ObserveCommit& oc, uint32_t to);
+  bool Process();
+  void Wait(uint64_t ns);
+  void Leave();
+private:
+  template <typename T>
+  void DoSend(const T& t, uint32_t to, bool proposal);
+
+  // A proposal sent without copying, which the kernel may read until it
+  // notifies us, after we are told it is sent
+  struct ZeroCopy {
+    ZeroCopy(uint32_t rank, size_t size)
+      : rank_(rank), data_(size), notifs_(0), sent_(false) {}
+    uint32_t rank_;
+    std::vector<char> data_;
+    uint32_t notifs_;
+    bool sent_;
+  };
+  struct Chunk {
+    Chunk() : block_(-1), size_(0), zero_copy_(0) {}
+    // The pool block it is in, or -1 if it is in heap_ or zero_copy_
+    int block_;
+    size_t size_;
+    std::vector<char> heap_;
+    ZeroCopy* zero_copy_;
+  };
+  struct Peer {
+    Peer() : fd_(-1), block_(-1), filled_(0), out_offset_(0),
+             receiving_(false), sending_(false), dirty_(false),
+             shut_(false), left_(false), dead_(false) {}
+    int fd_;
+    // The block messages are being encoded into, and how much is used
+    int block_;
+    size_t filled_;
+    // What is ready to go, the first of which is being sent if sending_,
+    // and how much of that has gone
+    std::deque<Chunk> out_;
+    size_t out_offset_;
+    // The start of a message the last buffer received ended in
+    std::vector<char> in_;
+    bool receiving_;
+    bool sending_;
+    bool dirty_;
+    // Shut down, and closed once nothing on it is in flight
+    bool shut_;
+    bool left_;
+    bool dead_;
+  };
+  void Connect(const std::vector<int>& listeners,
+               const std::vector<uint16_t>& ports, size_t buffer);
+  void Add(uint32_t rank, int fd, size_t buffer);
+  // Arms the multishot receive
+  void Arm(uint32_t rank);
+  // Hands buffer bid back to the kernel to receive into
+  void Recycle(uint16_t bid);
+  bool Received(uint32_t rank, int32_t result, uint32_t flags);
+  // Hands on every whole message at the start of data, and returns how
+  // many bytes they take
+  size_t Handle(uint32_t rank, const char* data, size_t size,
+                bool* handled);
+  void Sent(uint32_t rank, int32_t result);
+  char* Data(const Chunk& chunk);
+  // Queues the block being filled to go after what is queued already
+  void Seal(uint32_t rank);
+  void Release(const Chunk& chunk);
+  void MarkDirty(uint32_t rank);
+  // Submits the next send to each peer with something queued and nothing
+  // in flight
+  void FlushAll();
+  // Shuts the connection down, and unless the peer left, queues a Failure
+  void Lost(uint32_t rank);
+  void Close(uint32_t rank);
+  // Whether the kernel may still be using any of our buffers
+  bool InFlight() const;
+
+  class ReceiveVisitor {
+  public:
+    ReceiveVisitor(UringCommunicator& comm);
+    template <typename T>
+    void operator()(T& t) const;
+    uint32_t from_;
+  private:
+    UringCommunicator& comm_;
+  };
+  ReceiveVisitor rv_;
+  uint32_t rank_;
+  spob::StateMachine** sm_;
+  bool verbose_;
+  size_t zero_copy_;
+  bool leaving_;
+  std::vector<Peer> peers_;
+  // Registered for sends, and the blocks of it not in use
+  std::vector<char> pool_;
+  std::vector<int> free_;
+  // Buffers the kernel receives into, and the ring it takes them from
+  std::vector<char> recv_;
+  io_uring_buf_ring* buffers_;
+  uint16_t buffers_tail_;
+  std::vector<uint32_t> dirty_;
+  std::deque<uint32_t> lost_;
+  // Every ZeroCopy not yet freed, including those sent but not notified
+  std::set<ZeroCopy*> zero_copies_;
+  // Last, so that it goes before the buffers and sockets it uses
+  Ring ring_;
+};
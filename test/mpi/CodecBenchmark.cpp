@@ -0,0 +1,148 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/mpi.hpp>
+#include <boost/program_options.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "Codec.hpp"
+#include "Serialization.hpp"
+
+namespace po = boost::program_options;
+namespace mpi = boost::mpi;
+
+// Times encoding and decoding each kind of message with the wire codec
+// against the Boost.MPI packed archives the transport used before it. Runs
+// on one rank; the archives only need a communicator to pack against
+namespace {
+  uint32_t iterations;
+  boost::timer::cpu_timer timer;
+
+  uint64_t
+  Mid(uint32_t epoch, uint32_t seq)
+  {
+    return static_cast<uint64_t>(epoch) << 32 | seq;
+  }
+
+  std::vector<spob::Transaction>
+  Transactions(uint64_t first, size_t count, size_t bytes)
+  {
+    std::vector<spob::Transaction> ts;
+    for (size_t i = 0; i < count; ++i) {
+      spob::Payload payload(std::string(bytes, 'a' + i % 26));
+      ts.push_back(spob::Transaction(first + i, payload));
+    }
+    return ts;
+  }
+
+  double
+  PerOp(boost::timer::nanosecond_type start, uint32_t n)
+  {
+    return static_cast<double>(timer.elapsed().wall - start) / n;
+  }
+
+  // Messages of many transactions take proportionally fewer iterations
+  template <typename T>
+  void
+  Compare(const std::string& name, const T& t, size_t transactions,
+          const mpi::communicator& comm)
+  {
+    uint32_t n = std::max<uint32_t>(iterations / transactions, 1);
+    mpi::packed_oarchive::buffer_type packed;
+    boost::timer::nanosecond_type start = timer.elapsed().wall;
+    for (uint32_t i = 0; i < n; ++i) {
+      packed.clear();
+      mpi::packed_oarchive oa(comm, packed);
+      oa << t;
+    }
+    double packed_encode = PerOp(start, n);
+    start = timer.elapsed().wall;
+    for (uint32_t i = 0; i < n; ++i) {
+      mpi::packed_iarchive ia(comm, packed);
+      T decoded;
+      ia >> decoded;
+    }
+    double packed_decode = PerOp(start, n);
+
+    std::vector<char> wire(spob::wire::Encode(t, 0, 0));
+    start = timer.elapsed().wall;
+    for (uint32_t i = 0; i < n; ++i) {
+      spob::wire::Encode(t, wire.data(), wire.size());
+    }
+    double wire_encode = PerOp(start, n);
+    start = timer.elapsed().wall;
+    for (uint32_t i = 0; i < n; ++i) {
+      T decoded;
+      spob::wire::Decode(wire.data(), wire.size(), &decoded);
+    }
+    double wire_decode = PerOp(start, n);
+
+    std::cout << std::setw(24) << name <<
+      std::setw(10) << packed.size() << std::setw(10) << wire.size() <<
+      std::setw(12) << packed_encode << std::setw(12) << wire_encode <<
+      std::setw(12) << packed_decode << std::setw(12) << wire_decode <<
+      std::endl;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  mpi::environment env(argc, argv);
+  mpi::communicator world;
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "produce help message")
+    ("iterations", po::value<uint32_t>(&iterations)->default_value(100000),
+     "Encodes and decodes of a one transaction message to time")
+    ;
+  try {
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+  } catch (std::exception& e) {
+    std::cout << desc << std::endl;
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << std::setw(24) << "message" <<
+    std::setw(10) << "packed B" << std::setw(10) << "wire B" <<
+    std::setw(12) << "packed enc" << std::setw(12) << "wire enc" <<
+    std::setw(12) << "packed dec" << std::setw(12) << "wire dec" <<
+    " (ns per op)" << std::endl;
+
+  spob::Ack a = {1, Mid(1, 1000)};
+  Compare("Ack", a, 1, world);
+
+  spob::Propose p = {1, Mid(1, 999),
+                     spob::Transaction(Mid(1, 1000),
+                                       spob::Payload(std::string(64, 'p')))};
+  Compare("Propose 64B", p, 1, world);
+
+  spob::ProposeBatch pb = {1, Mid(1, 999), Transactions(Mid(1, 1000), 64, 64)};
+  Compare("ProposeBatch 64x64B", pb, pb.proposals_.size(), world);
+
+  spob::RecoverPropose rp;
+  rp.primary_ = 1;
+  rp.type_ = spob::RecoverPropose::kDiff;
+  rp.proposals_ = Transactions(Mid(1, 1), 4096, 64);
+  rp.last_mid_ = 0;
+  rp.more_ = false;
+  Compare("RecoverPropose 4096x64B", rp, rp.proposals_.size(), world);
+
+  spob::ConstructTree ct = {63, 2, spob::Ancestors()};
+  for (uint32_t i = 0; i < 6; ++i) {
+    ct.ancestors_.push_back(i);
+  }
+  Compare("ConstructTree", ct, 1, world);
+  return 0;
+}
@@ -1,149 +1,297 @@
-#include <boost/serialization/list.hpp>
-#include <boost/serialization/variant.hpp>
-#include <boost/serialization/utility.hpp>
+#include <algorithm>
+#include <iostream>
 
+#include "Codec.hpp"
 #include "Communicator.hpp"
 
-namespace boost {
-  namespace serialization {
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::ConstructTree &ct, const unsigned int file_version)
-    {
-      ar & ct.max_rank_;
-      ar & ct.count_;
-      ar & ct.ancestors_;
-    }
+namespace {
+  // Receives kept posted, and the most each takes
+  const size_t kPostedReceives = 16;
+  const size_t kReceiveBytes = 256 * 1024;
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::AckTree &at, const unsigned int file_version)
-    {
-      ar & at.primary_;
-      ar & at.count_;
-      ar & at.last_mid_;
-    }
+Communicator::ReceiveVisitor::ReceiveVisitor(Communicator& comm) : comm_(comm) {}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::NakTree &nt, const unsigned int file_version)
-    {
-      ar & nt.primary_;
-      ar & nt.count_;
-    }
+template <typename T>
+void
+Communicator::ReceiveVisitor::operator()(T& t) const
+{
+  if (comm_.verbose_) {
+    std::cout << comm_.rank_ << ": Received " << t << " in group " <<
+      group_ << std::endl;
+  }
+  const Group& group = comm_.groups_[group_];
+  (*group.sm_)->Receive(t, group.ranks_.ToGroup(from_));
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::RecoverPropose &rp, const unsigned int file_version)
-    {
-      ar & rp.primary_;
-      ar & rp.type_;
-      ar & rp.proposals_;
-      ar & rp.last_mid_;
-    }
+namespace mpi = boost::mpi;
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::AckRecover &are, const unsigned int file_version)
-    {
-      ar & are.primary_;
-    }
+Communicator::Communicator(spob::StateMachine** sm, bool verbose,
+                           size_t queue)
+  : rv_(*this), world_(MPI_COMM_WORLD, mpi::comm_duplicate),
+    verbose_(verbose), receives_(kPostedReceives),
+    statuses_(kPostedReceives), done_(kPostedReceives),
+    received_(kPostedReceives * kReceiveBytes), next_(0),
+    bulk_(MPI_COMM_WORLD, mpi::comm_duplicate), completed_(kPostedReceives),
+    cross_host_sends_(0), stop_(false)
+{
+  Join(0, sm, spob::GroupRanks());
+  rank_ = world_.rank();
+  for (size_t slot = 0; slot < kPostedReceives; ++slot) {
+    Repost(slot);
+  }
+  if (queue > 0) {
+    inbound_.reset(new Ring<Envelope>(queue));
+    outbound_.reset(new Ring<Envelope>(queue));
+    io_thread_ = std::thread(&Communicator::Run, this);
+  }
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::RecoverCommit &rc, const unsigned int file_version)
-    {
-      ar & rc.primary_;
+template <typename T>
+void
+Communicator::DoSend(const T& t, uint32_t to, uint32_t group)
+{
+  if (verbose_) {
+    std::cout << rank_ << ": Sending " << t << " to " << to <<
+      " in group " << group << std::endl;
+  }
+  if (!hosts_.empty() && hosts_[rank_] != hosts_[to]) {
+    cross_host_sends_++;
+  }
+  if (outbound_) {
+    Envelope e;
+    e.rank_ = to;
+    e.group_ = group;
+    e.message_ = t;
+    while (!outbound_->Push(e)) {
+      std::this_thread::yield();
     }
+  } else {
+    Post(t, to, group);
+  }
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::RecoverReconnect &rr, const unsigned int file_version)
-    {
-      ar & rr.primary_;
-      ar & rr.max_rank_;
-      ar & rr.last_proposed_;
-      ar & rr.got_propose_;
-      ar & rr.acked_;
-    }
+template <typename T>
+void
+Communicator::Post(const T& t, uint32_t to, uint32_t group)
+{
+  std::vector<char> bytes;
+  if (!spare_.empty()) {
+    bytes.swap(spare_.back());
+    spare_.pop_back();
+  }
+  bytes.resize(spob::wire::Encode(t, 0, 0));
+  spob::wire::Encode(t, bytes.data(), bytes.size());
+  if (bytes.size() > kReceiveBytes) {
+    std::vector<char> header(bytes.begin(),
+                             bytes.begin() + spob::wire::kHeaderBytes);
+    Isend(bytes, to, group, bulk_);
+    Isend(header, to, group, world_);
+  } else {
+    Isend(bytes, to, group, world_);
+  }
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::Propose &p, const unsigned int file_version)
-    {
-      ar & p.primary_;
-      ar & p.proposal_;
-    }
+void
+Communicator::Isend(std::vector<char>& bytes, uint32_t to, uint32_t group,
+                    MPI_Comm comm)
+{
+  // Moving the vectors about leaves the bytes where MPI has them
+  sends_.push_back(MPI_REQUEST_NULL);
+  sending_.push_back(std::vector<char>());
+  sending_.back().swap(bytes);
+  MPI_Isend(sending_.back().data(), sending_.back().size(), MPI_CHAR, to,
+            group, comm, &sends_.back());
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::Ack &a, const unsigned int file_version)
-    {
-      ar & a.primary_;
-      ar & a.mid_;
+void
+Communicator::Reclaim()
+{
+  if (sends_.empty()) {
+    return;
+  }
+  indices_.resize(std::max(indices_.size(), sends_.size()));
+  int count;
+  MPI_Testsome(sends_.size(), sends_.data(), &count, indices_.data(),
+               MPI_STATUSES_IGNORE);
+  if (count == MPI_UNDEFINED || count == 0) {
+    return;
+  }
+  // Those done are null now. Each is replaced by the last
+  for (size_t i = 0; i < sends_.size();) {
+    if (sends_[i] != MPI_REQUEST_NULL) {
+      ++i;
+      continue;
     }
+    spare_.push_back(std::vector<char>());
+    spare_.back().swap(sending_[i]);
+    sends_[i] = sends_.back();
+    sending_[i].swap(sending_.back());
+    sends_.pop_back();
+    sending_.pop_back();
+  }
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::Commit &c, const unsigned int file_version)
-    {
-      ar & c.primary_;
-      ar & c.mid_;
-    }
+void
+Communicator::TestReceives()
+{
+  indices_.resize(std::max(indices_.size(), receives_.size()));
+  int count;
+  MPI_Testsome(receives_.size(), receives_.data(), &count, indices_.data(),
+               completed_.data());
+  if (count == MPI_UNDEFINED) {
+    return;
+  }
+  for (int i = 0; i < count; ++i) {
+    done_[indices_[i]] = true;
+    statuses_[indices_[i]] = completed_[i];
+  }
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive &ar, spob::Reconnect &r, const unsigned int file_version)
-    {
-      ar & r.primary_;
-      ar & r.max_rank_;
-      ar & r.last_proposed_;
-      ar & r.last_acked_;
-    }
+void
+Communicator::Repost(size_t slot)
+{
+  MPI_Irecv(&received_[slot * kReceiveBytes], kReceiveBytes, MPI_CHAR,
+            MPI_ANY_SOURCE, MPI_ANY_TAG, world_, &receives_[slot]);
+}
 
-    template<class Archive>
-    inline void
-    serialize(Archive& ar, spob::ReconnectResponse& rr, const unsigned int file_version)
-    {
-      ar & rr.primary_;
-      ar & rr.last_committed_;
-      ar & rr.proposals_;
+template <typename Visitor>
+bool
+Communicator::Hand(Visitor& visitor, const char* data, size_t size,
+                   const MPI_Status& status)
+{
+  visitor.from_ = status.MPI_SOURCE;
+  visitor.group_ = status.MPI_TAG;
+  if (!spob::wire::Dispatch(data, size, visitor)) {
+    std::cerr << rank_ << ": Malformed message from " << status.MPI_SOURCE <<
+      std::endl;
+    return false;
+  }
+  return true;
+}
+
+template <typename Visitor>
+bool
+Communicator::Poll(Visitor& visitor)
+{
+  // Every receive matches any message, so they match in the order they
+  // were posted, which is the order they are handled in here. One done
+  // behind one that isn't waits for it
+  size_t slot = next_;
+  if (!done_[slot]) {
+    TestReceives();
+    if (!done_[slot]) {
+      return false;
     }
   }
+  done_[slot] = false;
+  next_ = (next_ + 1) % receives_.size();
+  MPI_Status status = statuses_[slot];
+  int count;
+  MPI_Get_count(&status, MPI_CHAR, &count);
+  const char* data = &received_[slot * kReceiveBytes];
+  spob::wire::Header header;
+  if (spob::wire::DecodeHeader(data, count, &header) &&
+      header.length_ > static_cast<size_t>(count)) {
+    // Just its header, the whole of it having been sent just before, so
+    // waiting for that is short
+    long_.resize(header.length_);
+    MPI_Recv(long_.data(), long_.size(), MPI_CHAR, status.MPI_SOURCE,
+             status.MPI_TAG, bulk_, MPI_STATUS_IGNORE);
+    Repost(slot);
+    return Hand(visitor, long_.data(), long_.size(), status);
+  }
+  bool handled = Hand(visitor, data, count, status);
+  Repost(slot);
+  return handled;
 }
 
-Communicator::ReceiveVisitor::ReceiveVisitor(Communicator& comm) : comm_(comm) {}
+class Communicator::EncodeVisitor : public boost::static_visitor<> {
+public:
+  EncodeVisitor(Communicator& comm, const Envelope& e) : comm_(comm), e_(e) {}
+  template <typename T>
+  void operator()(const T& t) const
+  {
+    comm_.Post(t, e_.rank_, e_.group_);
+  }
+private:
+  Communicator& comm_;
+  const Envelope& e_;
+};
+
+// Moves a decoded message into an envelope for the protocol thread
+class Communicator::AssignVisitor {
+public:
+  explicit AssignVisitor(Envelope& e) : e_(e) {}
+  template <typename T>
+  void operator()(T& t)
+  {
+    e_.message_ = std::move(t);
+  }
+  uint32_t from_;
+  uint32_t group_;
+private:
+  Envelope& e_;
+};
 
-template <typename T>
 void
-Communicator::ReceiveVisitor::operator()(T& t) const
+Communicator::Run()
 {
-  if (comm_.verbose_) {
-    std::cout << comm_.rank_ << ": Received " << t << std::endl;
+  // Never blocks, so the protocol thread can always make room by sending
+  Envelope in;
+  bool holding = false;
+  while (!stop_.load(std::memory_order_relaxed)) {
+    bool idle = true;
+    Envelope out;
+    while (outbound_->Pop(&out)) {
+      boost::apply_visitor(EncodeVisitor(*this, out), out.message_);
+      idle = false;
+    }
+    Reclaim();
+    // Everything received, for as long as the protocol thread has room
+    for (;;) {
+      if (holding) {
+        if (!inbound_->Push(in)) {
+          break;
+        }
+        holding = false;
+        idle = false;
+      }
+      AssignVisitor assign(in);
+      if (!Poll(assign)) {
+        break;
+      }
+      in.rank_ = assign.from_;
+      in.group_ = assign.group_;
+      holding = true;
+    }
+    if (idle) {
+      std::this_thread::yield();
+    }
   }
-  (*comm_.sm_)->Receive(t, opt_status_->source());
 }
 
-namespace mpi = boost::mpi;
-
-Communicator::Communicator(spob::StateMachine** sm, bool verbose)
-  : sm_(sm), rv_(*this), verbose_(verbose)
+void
+Communicator::Join(uint32_t group, spob::StateMachine** sm,
+                   const spob::GroupRanks& ranks)
 {
-  mpi::communicator world;
-  req_ = world.irecv(mpi::any_source, mpi::any_tag, message_);
-  rank_ = world.rank();
+  if (groups_.size() <= group) {
+    groups_.resize(group + 1);
+  }
+  groups_[group].sm_ = sm;
+  groups_[group].ranks_ = ranks;
 }
 
-template <typename T>
 void
-Communicator::DoSend(const T& t, uint32_t to)
+Communicator::SetHosts(const std::vector<uint32_t>& hosts)
 {
-  if (verbose_) {
-    std::cout << rank_ << ": Sending " << t << " to " << to << std::endl;
-  }
-  mpi::communicator world;
-  pending_.push(std::make_pair(mpi::request(), Message(t)));
-  pending_.back().first = world.isend(to, 0, pending_.back().second);
+  hosts_ = hosts;
+}
+
+uint64_t
+Communicator::CrossHostSends() const
+{
+  return cross_host_sends_;
 }
 
 void
@@ -176,6 +324,12 @@ Communicator::Send(const spob::AckRecover& ar, uint32_t to)
   DoSend(ar, to);
 }
 
+void
+Communicator::Send(const spob::AckRecoverChunk& arc, uint32_t to)
+{
+  DoSend(arc, to);
+}
+
 void
 Communicator::Send(const spob::RecoverReconnect& rr, uint32_t to)
 {
@@ -194,6 +348,12 @@ Communicator::Send(const spob::Propose& p, uint32_t to)
   DoSend(p, to);
 }
 
+void
+Communicator::Send(const spob::ProposeBatch& pb, uint32_t to)
+{
+  DoSend(pb, to);
+}
+
 void
 Communicator::Send(const spob::Ack& a, uint32_t to)
 {
@@ -218,21 +378,64 @@ Communicator::Send(const spob::ReconnectResponse& recon_resp, uint32_t to)
   DoSend(recon_resp, to);
 }
 
+void
+Communicator::Send(const spob::Snapshot& s, uint32_t to)
+{
+  DoSend(s, to);
+}
+
+void
+Communicator::Send(const spob::Observe& o, uint32_t to)
+{
+  DoSend(o, to);
+}
+
+void
+Communicator::Send(const spob::ObserveCommit& oc, uint32_t to)
+{
+  DoSend(oc, to);
+}
+
 void
 Communicator::Process()
 {
-  while (!pending_.empty() && pending_.front().first.test()) {
-    pending_.pop();
+  if (inbound_) {
+    Envelope e;
+    while (inbound_->Pop(&e)) {
+      rv_.from_ = e.rank_;
+      rv_.group_ = e.group_;
+      boost::apply_visitor(rv_, e.message_);
+    }
+    return;
   }
-  rv_.opt_status_ = req_.test();
-  if (rv_.opt_status_) {
-    boost::apply_visitor(rv_, message_);
-    mpi::communicator world;
-    req_ = world.irecv(mpi::any_source, 0, message_);
+  Reclaim();
+  // Everything that has arrived, but no more than a round of the posted
+  // receives, so that a steady stream can't keep us here
+  for (size_t i = 0; i < receives_.size() && Poll(rv_); ++i) {
   }
 }
 
 Communicator::~Communicator()
 {
-  req_.cancel();
+  if (io_thread_.joinable()) {
+    stop_ = true;
+    io_thread_.join();
+    // Send whatever the protocol thread queued that the I/O thread never
+    // got to, now that nothing else pops the ring
+    Envelope out;
+    while (outbound_->Pop(&out)) {
+      boost::apply_visitor(EncodeVisitor(*this, out), out.message_);
+    }
+  }
+  // MPI may still be reading the bytes of a send until it is done. The
+  // receives stay posted meanwhile, so sends between us can match them
+  MPI_Waitall(sends_.size(), sends_.data(), MPI_STATUSES_IGNORE);
+  sends_.clear();
+  sending_.clear();
+  for (size_t i = 0; i < receives_.size(); ++i) {
+    if (receives_[i] != MPI_REQUEST_NULL) {
+      MPI_Cancel(&receives_[i]);
+      MPI_Wait(&receives_[i], MPI_STATUS_IGNORE);
+    }
+  }
 }
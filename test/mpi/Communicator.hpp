@@ -1,61 +1,153 @@
 #pragma once
 
-#include <queue>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include <boost/mpi.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/variant.hpp>
 
+#include "Group.hpp"
+#include "Ring.hpp"
 #include "Spob.hpp"
 
 class Communicator : public spob::CommunicatorInterface {
 public:
-  Communicator(spob::StateMachine** sm, bool verbose);
+  // Messages go over MPI as raw bytes in the wire codec's encoding. With
+  // a queue size, an I/O thread of its own posts and completes the MPI
+  // requests, so that encoding and decoding happen there, and messages
+  // cross to and from the protocol thread through rings of that size.
+  // Otherwise Process does it all on the calling thread. The I/O thread
+  // needs MPI initialized with threading::multiple
+  Communicator(spob::StateMachine** sm, bool verbose, size_t queue = 0);
 
   void Send(const spob::ConstructTree& ct, uint32_t to);
   void Send(const spob::AckTree& at, uint32_t to);
   void Send(const spob::NakTree& nt, uint32_t to);
   void Send(const spob::RecoverPropose& rp, uint32_t to);
   void Send(const spob::AckRecover& ar, uint32_t to);
+  void Send(const spob::AckRecoverChunk& arc, uint32_t to);
   void Send(const spob::RecoverCommit& rc, uint32_t to);
   void Send(const spob::RecoverReconnect& rr, uint32_t to);
   void Send(const spob::Propose& p, uint32_t to);
+  void Send(const spob::ProposeBatch& pb, uint32_t to);
   void Send(const spob::Ack& a, uint32_t to);
   void Send(const spob::Commit& c, uint32_t to);
   void Send(const spob::Reconnect& r, uint32_t to);
   void Send(const spob::ReconnectResponse& recon_resp, uint32_t to);
+  void Send(const spob::Snapshot& s, uint32_t to);
+  void Send(const spob::Observe& o, uint32_t to);
+  void Send(const spob::ObserveCommit& oc, uint32_t to);
+  // Sends on behalf of group, tagging the message with it
+  template <typename T>
+  void Send(const T& t, uint32_t group, uint32_t to)
+  {
+    DoSend(t, to, group);
+  }
+  // Hands messages tagged with group to sm, ranks mapping their senders.
+  // Untagged messages go to the StateMachine passed to the constructor
+  void Join(uint32_t group, spob::StateMachine** sm,
+            const spob::GroupRanks& ranks);
   void Process();
+  // Counts sends between ranks that hosts maps to different hosts
+  void SetHosts(const std::vector<uint32_t>& hosts);
+  uint64_t CrossHostSends() const;
+  // Sends whatever is still queued and waits for every send to finish
   ~Communicator();
 private:
   template <typename T>
-  void DoSend(const T& t, uint32_t to);
+  void DoSend(const T& t, uint32_t to, uint32_t group = 0);
+  class EncodeVisitor;
+  class AssignVisitor;
 
-  spob::StateMachine** sm_;
+  struct Group {
+    spob::StateMachine** sm_;
+    spob::GroupRanks ranks_;
+  };
+  std::vector<Group> groups_;
   class ReceiveVisitor : public boost::static_visitor<> {
   public:
     ReceiveVisitor(Communicator& comm_);
     template <typename T>
     void operator()(T& t) const;
-    boost::optional<boost::mpi::status> opt_status_;
+    uint32_t from_;
+    uint32_t group_;
   private:
     Communicator& comm_;
   };
   ReceiveVisitor rv_;
-  boost::mpi::request req_;
+  // A duplicate of the world, so group tags never match the test's own
+  // messages
+  boost::mpi::communicator world_;
   typedef boost::variant<
     spob::ConstructTree,
     spob::AckTree,
     spob::NakTree,
     spob::RecoverPropose,
     spob::AckRecover,
+    spob::AckRecoverChunk,
     spob::RecoverCommit,
     spob::RecoverReconnect,
     spob::Propose,
+    spob::ProposeBatch,
     spob::Ack,
     spob::Commit,
     spob::Reconnect,
-    spob::ReconnectResponse> Message;
-  Message message_;
+    spob::ReconnectResponse,
+    spob::Snapshot,
+    spob::Observe,
+    spob::ObserveCommit> Message;
+  // The sender of a received message or the destination of one to send
+  struct Envelope {
+    uint32_t rank_;
+    uint32_t group_;
+    Message message_;
+  };
+  template <typename T>
+  void Post(const T& t, uint32_t to, uint32_t group);
+  // Sends bytes, which it takes, and keeps them until the send is done
+  void Isend(std::vector<char>& bytes, uint32_t to, uint32_t group,
+             MPI_Comm comm);
+  // Frees the bytes of every send done, in whatever order they finished
+  void Reclaim();
+  // Marks each posted receive that has completed
+  void TestReceives();
+  void Repost(size_t slot);
+  // Hands the next message received to visitor, in the order MPI matched
+  // them, so each sender's arrive in the order sent. Returns whether it
+  // did
+  template <typename Visitor>
+  bool Poll(Visitor& visitor);
+  template <typename Visitor>
+  bool Hand(Visitor& visitor, const char* data, size_t size,
+            const MPI_Status& status);
+  void Run();
   uint32_t rank_;
   bool verbose_;
-  std::queue<std::pair<boost::mpi::request, Message> > pending_;
+  // Receives posted ahead, each into its own slot of received_, the oldest
+  // at next_. done_ marks those complete, whose statuses_ are then set
+  std::vector<MPI_Request> receives_;
+  std::vector<MPI_Status> statuses_;
+  std::vector<char> done_;
+  std::vector<char> received_;
+  size_t next_;
+  // A message too long for a slot comes as its header on world_, then the
+  // whole of it on bulk_, which is received straight into long_
+  boost::mpi::communicator bulk_;
+  std::vector<char> long_;
+  // Sends in flight, each with the bytes it is sending, and the bytes of
+  // those done, kept to send from again
+  std::vector<MPI_Request> sends_;
+  std::vector<std::vector<char> > sending_;
+  std::vector<std::vector<char> > spare_;
+  // For MPI_Testsome to fill in
+  std::vector<int> indices_;
+  std::vector<MPI_Status> completed_;
+  std::vector<uint32_t> hosts_;
+  uint64_t cross_host_sends_;
+  boost::scoped_ptr<Ring<Envelope> > inbound_;
+  boost::scoped_ptr<Ring<Envelope> > outbound_;
+  std::atomic<bool> stop_;
+  std::thread io_thread_;
 };
@@ -20,6 +20,7 @@ namespace {
   bool quit = false;
   bool verbose;
   uint32_t string_size;
+  uint32_t fanout;
 #if HAVE_PPC450_INLINES_H
   typedef uint64_t my_time_t;
   my_time_t GetTime() {
@@ -45,7 +46,7 @@ namespace {
 class Callback : public spob::StateMachine::Callback {
 public:
   Callback(spob::StateMachine** sm, long int num_messages)
-    : n_(num_messages), sm_(sm), message_(string_size, '\0')
+    : n_(num_messages), sm_(sm), message_(std::string(string_size, '\0'))
   {
     mpi::communicator world;
     rank_ = world.rank();
@@ -69,7 +70,7 @@ public:
       }
     }
   }
-  void operator()(uint64_t id, const std::string& message)
+  void operator()(uint64_t id, const spob::Payload& message)
   {
     count_++;
     if (verbose) {
@@ -110,7 +111,7 @@ private:
   double new_mean_;
   double old_square_;
   double new_square_;
-  std::string message_;
+  spob::Payload message_;
 };
 
 int main(int argc, char* argv[])
@@ -126,6 +127,8 @@ int main(int argc, char* argv[])
        "set number of messages")
       ("ss", po::value<uint32_t>(&string_size)->required(),
        "set string size of message")
+      ("fanout", po::value<uint32_t>(&fanout)->default_value(2),
+       "set max number of children per process")
       ;
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -146,7 +149,14 @@ int main(int argc, char* argv[])
   Callback cb(&sm, num_messages);
   Communicator comm(&sm, verbose);
   mpi::communicator world;
-  sm = new spob::StateMachine(world.rank(), world.size(), comm, cb);
+  spob::StateMachine::TreePolicy tree_policy;
+  tree_policy.fanout_ = fanout;
+  sm = new spob::StateMachine(world.rank(), world.size(), comm, cb,
+                              spob::StateMachine::BatchPolicy(),
+                              spob::StateMachine::AckPolicy(),
+                              spob::StateMachine::CommitPolicy(),
+                              spob::StateMachine::WindowPolicy(),
+                              tree_policy);
   sm->Start();
   while (!quit) {
     comm.Process();
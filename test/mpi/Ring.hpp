@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// A bounded ring for handing items from one thread to one other without
+// locks. The producer only writes tail_ and the consumer only head_, and
+// each sits on a cache line of its own so they don't bounce between the
+// two cores
+template <typename T>
+class Ring {
+public:
+  // capacity is rounded up to a power of two
+  explicit Ring(size_t capacity) : head_(0), tail_(0)
+  {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  // Producer only. Returns false, leaving t alone, if the ring is full
+  bool Push(T& t)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    slots_[tail & mask_] = std::move(t);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the ring is empty
+  bool Pop(T* t)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *t = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+private:
+  Ring(const Ring&);
+  Ring& operator=(const Ring&);
+
+  std::vector<T> slots_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+};
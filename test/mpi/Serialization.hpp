@@ -0,0 +1,215 @@
+#pragma once
+
+#include <boost/serialization/array_wrapper.hpp>
+#include <boost/serialization/library_version_type.hpp>
+#include <boost/serialization/split_free.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/variant.hpp>
+#include <boost/serialization/utility.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include "Spob.hpp"
+
+// Boost.Serialization for every message, as the MPI transport sent them
+// before it had a wire codec. Kept for comparing the two
+namespace boost {
+  namespace serialization {
+    template<class Archive>
+    inline void
+    save(Archive &ar, const spob::Payload &p, const unsigned int file_version)
+    {
+      ar << p.str();
+    }
+
+    template<class Archive>
+    inline void
+    load(Archive &ar, spob::Payload &p, const unsigned int file_version)
+    {
+      std::string data;
+      ar >> data;
+      p = spob::Payload(std::move(data));
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::Payload &p, const unsigned int file_version)
+    {
+      split_free(ar, p, file_version);
+    }
+
+    // The ancestors go out as one array of ranks
+    template<class Archive>
+    inline void
+    save(Archive &ar, const spob::Ancestors &a, const unsigned int file_version)
+    {
+      uint32_t size = a.size();
+      ar << size;
+      ar << make_array(a.data(), size);
+    }
+
+    template<class Archive>
+    inline void
+    load(Archive &ar, spob::Ancestors &a, const unsigned int file_version)
+    {
+      uint32_t size;
+      ar >> size;
+      a.resize(size);
+      ar >> make_array(a.data(), size);
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::Ancestors &a, const unsigned int file_version)
+    {
+      split_free(ar, a, file_version);
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::ConstructTree &ct, const unsigned int file_version)
+    {
+      ar & ct.max_rank_;
+      ar & ct.count_;
+      ar & ct.ancestors_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::AckTree &at, const unsigned int file_version)
+    {
+      ar & at.primary_;
+      ar & at.count_;
+      ar & at.last_mid_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::NakTree &nt, const unsigned int file_version)
+    {
+      ar & nt.primary_;
+      ar & nt.count_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::RecoverPropose &rp, const unsigned int file_version)
+    {
+      ar & rp.primary_;
+      ar & rp.type_;
+      ar & rp.proposals_;
+      ar & rp.last_mid_;
+      ar & rp.more_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::AckRecover &are, const unsigned int file_version)
+    {
+      ar & are.primary_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::AckRecoverChunk &arc, const unsigned int file_version)
+    {
+      ar & arc.primary_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::RecoverCommit &rc, const unsigned int file_version)
+    {
+      ar & rc.primary_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::RecoverReconnect &rr, const unsigned int file_version)
+    {
+      ar & rr.primary_;
+      ar & rr.count_;
+      ar & rr.max_rank_;
+      ar & rr.last_proposed_;
+      ar & rr.got_propose_;
+      ar & rr.acked_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::Propose &p, const unsigned int file_version)
+    {
+      ar & p.primary_;
+      ar & p.last_committed_;
+      ar & p.proposal_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::ProposeBatch &pb, const unsigned int file_version)
+    {
+      ar & pb.primary_;
+      ar & pb.last_committed_;
+      ar & pb.proposals_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::Ack &a, const unsigned int file_version)
+    {
+      ar & a.primary_;
+      ar & a.mid_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::Commit &c, const unsigned int file_version)
+    {
+      ar & c.primary_;
+      ar & c.mid_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive &ar, spob::Reconnect &r, const unsigned int file_version)
+    {
+      ar & r.primary_;
+      ar & r.max_rank_;
+      ar & r.last_proposed_;
+      ar & r.last_acked_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive& ar, spob::ReconnectResponse& rr, const unsigned int file_version)
+    {
+      ar & rr.primary_;
+      ar & rr.last_committed_;
+      ar & rr.proposals_;
+      ar & rr.more_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive& ar, spob::Snapshot& s, const unsigned int file_version)
+    {
+      ar & s.primary_;
+      ar & s.mid_;
+      ar & s.state_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive& ar, spob::Observe& o, const unsigned int file_version)
+    {
+      ar & o.last_committed_;
+    }
+
+    template<class Archive>
+    inline void
+    serialize(Archive& ar, spob::ObserveCommit& oc, const unsigned int file_version)
+    {
+      ar & oc.after_;
+      ar & oc.proposals_;
+    }
+  }
+}
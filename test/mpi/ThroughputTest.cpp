@@ -1,9 +1,15 @@
 #include "config.h"
 
 #include <algorithm>
+#include <atomic>
 #include <iterator>
+#include <map>
+#include <memory>
+#include <queue>
 #include <sstream>
+#include <thread>
 
+#include <boost/lexical_cast.hpp>
 #include <boost/mpi.hpp>
 #include <boost/program_options.hpp>
 #include <boost/random.hpp>
@@ -17,6 +23,7 @@
 
 #include "Communicator.hpp"
 #include "Spob.hpp"
+#include "Submitter.hpp"
 
 namespace po = boost::program_options;
 namespace mpi = boost::mpi;
@@ -26,6 +33,25 @@ namespace {
   bool verbose;
   bool no_comm = false;
   uint32_t outstanding;
+  uint32_t batch_size;
+  uint64_t batch_bytes;
+  uint32_t ack_size;
+  bool piggyback;
+  uint32_t window_messages;
+  uint64_t window_bytes;
+  uint32_t fanout;
+  uint32_t ranks_per_host;
+  uint64_t recover_bytes;
+  uint32_t recover_chunks;
+  std::string wal_dir;
+  std::string wal_sync;
+  uint32_t wal_group;
+  std::string segment_dir;
+  uint32_t observers;
+  uint32_t groups;
+  uint32_t producers;
+  uint32_t queue;
+  bool topology;
   uint32_t string_size;
   uint32_t samples;
   double pfail;
@@ -55,6 +81,10 @@ namespace {
 #endif
   my_time_t sample_time;
   my_time_t notify_time;
+  my_time_t batch_time;
+  my_time_t ack_time;
+  my_time_t commit_time;
+  my_time_t wal_time;
 
   std::string
   pair_to_string(const std::pair<double, uint64_t>& p)
@@ -67,24 +97,35 @@ namespace {
 
 class Callback : public spob::StateMachine::Callback {
 public:
-  Callback(spob::StateMachine** sm)
-    : sm_(sm), message_(string_size, '\0'), dist_(pfail)
+  Callback(spob::StateMachine** sm, const spob::GroupRanks& ranks)
+    : sm_(sm), ranks_(ranks), message_(std::string(string_size, '\0'))
   {
     mpi::communicator world;
     rank_ = world.rank();
     primary_ = -1;
     count_ = 0;
     last_count_ = 0;
-    start_ = last_time_ = GetTime();
     tookover_ = 0;
-    failed_ = 0;
-    samples_ = 0;
-    failed_nodes_ = new bool[world.size()];
+    stop_ = false;
   }
 
   ~Callback()
   {
-    delete failed_nodes_;
+    stop_ = true;
+    for (std::list<std::thread>::iterator it = threads_.begin();
+         it != threads_.end(); ++it) {
+      it->join();
+    }
+  }
+
+  uint64_t Count() const
+  {
+    return count_;
+  }
+
+  my_time_t TookOver() const
+  {
+    return tookover_;
   }
 
   void operator()(spob::StateMachine::Status status, uint32_t primary)
@@ -94,31 +135,161 @@ public:
       if (verbose) {
         std::cout << rank_ << ": Recovered and Leading" << std::endl;
       }
-      primary_ = primary;
+      primary_ = rank_;
       last_count_ = count_;
-      for (uint32_t i = 0; i < outstanding; i++) {
-        (*sm_)->Propose(message_);
+      if (producers > 0) {
+        // Each producer keeps its share of the proposals outstanding
+        for (uint32_t i = 0; i < producers && threads_.empty(); ++i) {
+          threads_.push_back(std::thread(&Callback::Produce, this,
+                                         std::max(outstanding / producers,
+                                                  1U)));
+        }
+      } else if (window_messages > 0 || window_bytes > 0) {
+        Fill();
+      } else {
+        for (uint32_t i = 0; i < outstanding; i++) {
+          (*sm_)->Propose(message_);
+        }
       }
+      (*sm_)->Flush();
     } else if (spob::StateMachine::kFollowing) {
-      primary_ = primary;
+      primary_ = ranks_.ToProcess(primary);
       if (verbose) {
-        std::cout << rank_ << ": Recovered and Following " << primary << std::endl;
+        std::cout << rank_ << ": Recovered and Following " << primary_ <<
+          std::endl;
       }
     } else {
       primary_ = -1;
     }
   }
-  void operator()(uint64_t id, const std::string& message)
+  void operator()(uint64_t id, const spob::Payload& message)
   {
     count_++;
     if (verbose) {
       std::cout << rank_ << ": Delivered message: 0x" << std::hex << id <<
         std::dec << ", \"" << message << "\"" << std::endl;
     }
-    if ((int)rank_ == primary_) {
+    if ((int)rank_ == primary_ && producers == 0 && window_messages == 0 &&
+        window_bytes == 0) {
       (*sm_)->Propose(message_);
     }
   }
+  void Deliver(const spob::Transaction* first, const spob::Transaction* last)
+  {
+    if (verbose) {
+      spob::StateMachine::Callback::Deliver(first, last);
+      return;
+    }
+    count_ += last - first;
+    if ((int)rank_ == primary_ && producers == 0 && window_messages == 0 &&
+        window_bytes == 0) {
+      for (; first != last; ++first) {
+        (*sm_)->Propose(message_);
+      }
+    }
+  }
+  // Our state is how many proposals we have delivered
+  bool TakeSnapshot(uint64_t mid, spob::Payload* state)
+  {
+    *state = spob::Payload(boost::lexical_cast<std::string>(count_));
+    return true;
+  }
+  void InstallSnapshot(uint64_t mid, const spob::Payload& state)
+  {
+    count_ = boost::lexical_cast<uint64_t>(state.str());
+  }
+  void WindowOpened()
+  {
+    if (producers > 0) {
+      Drain();
+      return;
+    }
+    Fill();
+    (*sm_)->Flush();
+  }
+  // Proposes what the producer threads have submitted
+  void Drain()
+  {
+    submitter_.Drain(**sm_);
+  }
+  // Adds what the group delivered since the last sample, if we lead it
+  bool Sample(uint64_t* delivered)
+  {
+    if ((int)rank_ != primary_) {
+      return false;
+    }
+    *delivered += count_ - last_count_;
+    last_count_ = count_;
+    return true;
+  }
+  void Fail()
+  {
+    primary_ = -1;
+  }
+  void Notify(uint32_t process)
+  {
+    spob::Failure f;
+    f.rank_ = ranks_.ToGroup(process);
+    (*sm_)->Receive(f);
+  }
+private:
+  void Fill()
+  {
+    // Keep the window full
+    while ((*sm_)->TryPropose(message_)) {
+    }
+  }
+  void Produce(uint32_t outstanding)
+  {
+    // Completions run on the protocol thread and hand the slot back.
+    // They may outlive this thread, so they share the count
+    std::shared_ptr<std::atomic<uint32_t> >
+      in_flight(new std::atomic<uint32_t>(0));
+    while (!stop_) {
+      if (in_flight->load(std::memory_order_acquire) < outstanding) {
+        (*in_flight)++;
+        submitter_.Submit(message_, [in_flight](uint64_t id,
+                                                spob::StateMachine::Outcome) {
+          (*in_flight)--;
+        });
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+  int primary_;
+  uint32_t rank_;
+  uint64_t count_;
+  uint64_t last_count_;
+  spob::StateMachine** sm_;
+  spob::GroupRanks ranks_;
+  my_time_t tookover_;
+  spob::Payload message_;
+  spob::Submitter submitter_;
+  std::atomic<bool> stop_;
+  std::list<std::thread> threads_;
+};
+
+// Samples throughput, injects failures and reports for every group this
+// process takes part in
+class Driver {
+public:
+  Driver(const std::vector<Callback*>& callbacks)
+    : callbacks_(callbacks), dist_(pfail)
+  {
+    mpi::communicator world;
+    rank_ = world.rank();
+    start_ = last_time_ = GetTime();
+    failed_ = 0;
+    samples_ = 0;
+    failed_nodes_ = new bool[world.size()];
+  }
+
+  ~Driver()
+  {
+    delete[] failed_nodes_;
+  }
+
   void Process()
   {
     if ((GetTime() - last_time_) > (sample_time * per_ms)) {
@@ -142,14 +313,25 @@ public:
           world.send(0, 1, ss.str());
         }
         ss.str(std::string());
-        if (tookover_ || failed_) {
+        bool tookover = false;
+        for (std::vector<Callback*>::const_iterator it = callbacks_.begin();
+             it != callbacks_.end(); ++it) {
+          tookover = tookover || (*it)->TookOver();
+        }
+        if (tookover || failed_) {
           ss << rank_ << ": ";
           if (failed_) {
             ss << "failed at " << (failed_ - start_) / per_ms << "ms ";
           }
-          if (tookover_) {
-            ss << "tookover at " << (tookover_ - start_) / per_ms
-               << "ms";
+          for (uint32_t i = 0; i < callbacks_.size(); ++i) {
+            if (callbacks_[i]->TookOver()) {
+              ss << "tookover ";
+              if (callbacks_.size() > 1) {
+                ss << "group " << i << " ";
+              }
+              ss << "at " << (callbacks_[i]->TookOver() - start_) / per_ms
+                 << "ms ";
+            }
           }
           ss << std::endl;
         }
@@ -165,17 +347,26 @@ public:
         }
         quit = true;
       } else {
-        if ((int)rank_ == primary_) {
+        // Throughput summed over the groups we lead
+        uint64_t delivered = 0;
+        bool leading = false;
+        for (std::vector<Callback*>::const_iterator it = callbacks_.begin();
+             it != callbacks_.end(); ++it) {
+          leading = (*it)->Sample(&delivered) || leading;
+        }
+        if (leading) {
           counts_.push_back(std::make_pair((GetTime() - start_) / per_ms,
-                                           count_ - last_count_));
-          last_count_ = count_;
+                                           delivered));
         }
         last_time_ = GetTime();
         bool failed = !failed_ && dist_(gen);
         if (failed) {
           failed_ = last_time_;
           no_comm = true;
-          primary_ = -1;
+          for (std::vector<Callback*>::const_iterator it = callbacks_.begin();
+               it != callbacks_.end(); ++it) {
+            (*it)->Fail();
+          }
         }
         mpi::communicator world;
         mpi::all_gather(world, failed, failed_nodes_);
@@ -189,45 +380,22 @@ public:
       }
     }
     while (!failure_notify_.empty() && failure_notify_.front().second <= GetTime()) {
-      spob::Failure f;
-      f.rank_ = failure_notify_.front().first;
-      (*sm_)->Receive(f);
+      for (std::vector<Callback*>::const_iterator it = callbacks_.begin();
+           it != callbacks_.end(); ++it) {
+        (*it)->Notify(failure_notify_.front().first);
+      }
       failure_notify_.pop();
     }
   }
 private:
-  void Dump(std::ostringstream& ss)
-  {
-    ss << rank_ << ": ";
-    if (tookover_) {
-      ss << "tookover at " << (tookover_ - start_) / per_ms
-         << "ms ";
-      if (!counts_.empty()) {
-        std::transform(counts_.begin(), --(counts_.end()),
-                       std::ostream_iterator<std::string>(ss, " "),
-                       pair_to_string);
-        ss << pair_to_string(counts_.back());
-      }
-    }
-    if (failed_) {
-      ss << "failed at " << (failed_ - start_) / per_ms << "ms";
-    }
-    std::cout << ss.str() << std::endl;
-  }
-  int primary_;
+  std::vector<Callback*> callbacks_;
   uint32_t rank_;
   uint32_t samples_;
-  uint64_t count_;
-  uint64_t last_count_;
-  spob::StateMachine** sm_;
   my_time_t start_;
   my_time_t last_time_;
-  my_time_t tookover_;
   my_time_t failed_;
   std::list<std::pair<double, uint64_t> > counts_;
-  std::string message_;
   boost::random::bernoulli_distribution<> dist_;
-  boost::mpi::request req_;
   bool* failed_nodes_;
   std::queue<std::pair<uint32_t, my_time_t> > failure_notify_;
 };
@@ -255,6 +423,54 @@ int main(int argc, char* argv[])
        "set max number of outstanding messages")
       ("ss", po::value<uint32_t>(&string_size)->required(),
        "set string size of message")
+      ("bs", po::value<uint32_t>(&batch_size)->default_value(1),
+       "set max number of messages per batch")
+      ("bb", po::value<uint64_t>(&batch_bytes)->default_value(0),
+       "set max number of bytes per batch (0 for no limit)")
+      ("bt", po::value<my_time_t>(&batch_time)->default_value(0),
+       "set max time a batch is held (ms, 0 for no limit)")
+      ("ack", po::value<uint32_t>(&ack_size)->default_value(1),
+       "set max number of messages acknowledged by one ack")
+      ("at", po::value<my_time_t>(&ack_time)->default_value(0),
+       "set max time an ack is held (ms, 0 for no limit)")
+      ("pb", po::value<bool>(&piggyback)->default_value(false),
+       "piggyback commits on proposals")
+      ("ct", po::value<my_time_t>(&commit_time)->default_value(0),
+       "set max time a piggybacked commit is held (ms, 0 for no limit)")
+      ("wm", po::value<uint32_t>(&window_messages)->default_value(0),
+       "set max number of uncommitted messages, replacing --no (0 for no limit)")
+      ("wb", po::value<uint64_t>(&window_bytes)->default_value(0),
+       "set max number of uncommitted bytes, replacing --no (0 for no limit)")
+      ("fanout", po::value<uint32_t>(&fanout)->default_value(2),
+       "set max number of children per process")
+      ("ppn", po::value<uint32_t>(&ranks_per_host)->default_value(0),
+       "pretend each run of this many ranks shares a host (0 to use processor names)")
+      ("topo", po::value<bool>(&topology)->default_value(false),
+       "build the tree from the rank to host map")
+      ("rb", po::value<uint64_t>(&recover_bytes)->default_value(0),
+       "set max number of bytes per recovery chunk (0 for no limit)")
+      ("rn", po::value<uint32_t>(&recover_chunks)->default_value(0),
+       "set max number of recovery chunks in flight (0 for no limit)")
+      ("wal", po::value<std::string>(&wal_dir)->default_value(""),
+       "log to a write-ahead log under this directory (empty for none)")
+      ("sync", po::value<std::string>(&wal_sync)->default_value("fdatasync"),
+       "set how the write-ahead log syncs (none, fdatasync or direct)")
+      ("ws", po::value<uint32_t>(&wal_group)->default_value(1),
+       "set max number of proposals per write-ahead log sync")
+      ("wt", po::value<my_time_t>(&wal_time)->default_value(0),
+       "set max time a write-ahead log sync is held (ms, 0 for no limit)")
+      ("segment", po::value<std::string>(&segment_dir)->default_value(""),
+       "append deliveries to segments under this directory (empty for none)")
+      ("obs", po::value<uint32_t>(&observers)->default_value(0),
+       "run this many of the highest ranks as non-voting observers")
+      ("groups", po::value<uint32_t>(&groups)->default_value(1),
+       "run this many independent groups, each led by a different rank")
+      ("producers", po::value<uint32_t>(&producers)->default_value(0),
+       "propose from this many threads through a Submitter (0 to propose "
+       "on delivery)")
+      ("queue", po::value<uint32_t>(&queue)->default_value(0),
+       "send and receive on an I/O thread through rings of this many "
+       "messages (0 for the protocol thread)")
       ;
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -264,26 +480,160 @@ int main(int argc, char* argv[])
     }
 
     po::notify(vm);
+    if (wal_sync != "none" && wal_sync != "fdatasync" &&
+        wal_sync != "direct") {
+      throw po::invalid_option_value(wal_sync);
+    }
   } catch (std::exception& e) {
     std::cout << desc << std::endl;
     std::cout << e.what() << std::endl;
     return 1;
   }
 
-  mpi::environment env(argc, argv);
-  spob::StateMachine* sm;
-  Callback cb(&sm);
-  Communicator comm(&sm, verbose);
+  mpi::environment env(argc, argv, queue > 0 ? mpi::threading::multiple :
+                       mpi::threading::single);
+  if (env.thread_level() < (queue > 0 ? mpi::threading::multiple :
+                            mpi::threading::single)) {
+    std::cout << "MPI lacks the thread support the I/O thread needs" <<
+      std::endl;
+    return 1;
+  }
   mpi::communicator world;
+  uint32_t size = world.size() - observers;
+  std::vector<spob::StateMachine*> sms(groups);
+  Communicator comm(&sms[0], verbose, queue);
+  std::vector<spob::GroupRanks> ranks;
+  std::vector<spob::CommunicatorInterface*> comms;
+  std::vector<Callback*> callbacks;
+  for (uint32_t g = 0; g < groups; ++g) {
+    ranks.push_back(spob::GroupRanks(g, size));
+    comm.Join(g, &sms[g], ranks[g]);
+    comms.push_back(new spob::GroupCommunicator<Communicator>(comm, g,
+                                                              ranks[g]));
+    callbacks.push_back(new Callback(&sms[g], ranks[g]));
+  }
+  Driver driver(callbacks);
   gen.seed(seed + world.rank());
-  sm = new spob::StateMachine(world.rank(), world.size(), comm, cb);
-  sm->Start();
+  std::vector<uint32_t> hosts(world.size());
+  if (ranks_per_host > 0) {
+    for (int i = 0; i < world.size(); ++i) {
+      hosts[i] = i / ranks_per_host;
+    }
+  } else {
+    std::vector<std::string> names;
+    mpi::all_gather(world, mpi::environment::processor_name(), names);
+    std::map<std::string, uint32_t> ids;
+    for (int i = 0; i < world.size(); ++i) {
+      ids.insert(std::make_pair(names[i], static_cast<uint32_t>(ids.size())));
+      hosts[i] = ids[names[i]];
+    }
+  }
+  comm.SetHosts(hosts);
+  spob::StateMachine::BatchPolicy batch_policy;
+  batch_policy.max_messages_ = batch_size;
+  batch_policy.max_bytes_ = batch_bytes;
+  batch_policy.max_delay_ = batch_time * per_ms;
+  spob::StateMachine::AckPolicy ack_policy;
+  ack_policy.max_pending_ = ack_size;
+  ack_policy.max_delay_ = ack_time * per_ms;
+  spob::StateMachine::CommitPolicy commit_policy;
+  commit_policy.piggyback_ = piggyback;
+  commit_policy.max_delay_ = commit_time * per_ms;
+  spob::StateMachine::WindowPolicy window_policy;
+  window_policy.max_messages_ = window_messages;
+  window_policy.max_bytes_ = window_bytes;
+  spob::StateMachine::RecoverPolicy recover_policy;
+  recover_policy.max_bytes_ = recover_bytes;
+  recover_policy.max_chunks_ = recover_chunks;
+  std::vector<spob::Wal*> wals;
+  std::vector<spob::SegmentWriter*> segments;
+  for (uint32_t g = 0; g < groups; ++g) {
+    // Groups after the first keep their files apart
+    std::string name = "/rank-" +
+      boost::lexical_cast<std::string>(world.rank());
+    if (g > 0) {
+      name += "-group-" + boost::lexical_cast<std::string>(g);
+    }
+    spob::StateMachine::TreePolicy tree_policy;
+    tree_policy.fanout_ = fanout;
+    if (topology) {
+      // In group order, the ranks of the host process g is on are split
+      // between both ends, and the far end takes a cross-host edge of its
+      // own
+      for (uint32_t i = 0; i < hosts.size(); ++i) {
+        tree_policy.hosts_.push_back(hosts[ranks[g].ToProcess(i)]);
+      }
+    }
+    spob::StateMachine::DurabilityPolicy durability_policy;
+    if (!wal_dir.empty()) {
+      spob::Wal::SyncMode mode = spob::Wal::kFdatasync;
+      if (wal_sync == "none") {
+        mode = spob::Wal::kNone;
+      } else if (wal_sync == "direct") {
+        mode = spob::Wal::kDirect;
+      }
+      wals.push_back(new spob::Wal(wal_dir + name, mode));
+      durability_policy.wal_ = wals.back();
+      durability_policy.max_pending_ = wal_group;
+      durability_policy.max_delay_ = wal_time * per_ms;
+    }
+    spob::StateMachine::DeliveryPolicy delivery_policy;
+    if (!segment_dir.empty()) {
+      segments.push_back(new spob::SegmentWriter(segment_dir + name));
+      delivery_policy.segment_ = segments.back();
+    }
+    sms[g] = new spob::StateMachine(ranks[g].ToGroup(world.rank()), size,
+                                    *comms[g], *callbacks[g], batch_policy,
+                                    ack_policy, commit_policy, window_policy,
+                                    tree_policy, recover_policy,
+                                    durability_policy, delivery_policy);
+  }
+  for (uint32_t g = 0; g < groups; ++g) {
+    sms[g]->Start();
+  }
   while (!quit) {
     if (!no_comm) {
       comm.Process();
     }
-    cb.Process();
+    driver.Process();
+    for (uint32_t g = 0; g < groups; ++g) {
+      callbacks[g]->Drain();
+      sms[g]->Tick(GetTime());
+    }
+  }
+  uint64_t count = 0;
+  for (uint32_t g = 0; g < groups; ++g) {
+    count += callbacks[g]->Count();
+  }
+  uint64_t cross_host = 0;
+  mpi::reduce(world, comm.CrossHostSends(), cross_host,
+              std::plus<uint64_t>(), 0);
+  uint64_t delivered = 0;
+  mpi::reduce(world, count, delivered, mpi::maximum<uint64_t>(), 0);
+  if (world.rank() == 0 && delivered > 0) {
+    std::cout << "cross-host messages: " << cross_host << " ("
+              << static_cast<double>(cross_host) / delivered
+              << " per delivered message)" << std::endl;
+  }
+  if (observers > 0) {
+    uint64_t observed = 0;
+    mpi::reduce(world,
+                static_cast<uint32_t>(world.rank()) >= size ? count : 0,
+                observed, mpi::maximum<uint64_t>(), 0);
+    if (world.rank() == 0) {
+      std::cout << "observers delivered: " << observed << std::endl;
+    }
+  }
+  for (uint32_t g = 0; g < groups; ++g) {
+    delete sms[g];
+    delete comms[g];
+    delete callbacks[g];
+  }
+  for (uint32_t i = 0; i < wals.size(); ++i) {
+    delete wals[i];
+  }
+  for (uint32_t i = 0; i < segments.size(); ++i) {
+    delete segments[i];
   }
-  delete sm;
   return 0;
 }
@@ -60,6 +60,11 @@ Communicator::Send(const spob::AckRecover& ar, uint32_t to)
   DoSend(ar, to);
 }
 void
+Communicator::Send(const spob::AckRecoverChunk& arc, uint32_t to)
+{
+  DoSend(arc, to);
+}
+void
 Communicator::Send(const spob::RecoverReconnect& rr, uint32_t to)
 {
   DoSend(rr, to);
@@ -75,6 +80,11 @@ Communicator::Send(const spob::Propose& p, uint32_t to)
   DoSend(p, to);
 }
 void
+Communicator::Send(const spob::ProposeBatch& pb, uint32_t to)
+{
+  DoSend(pb, to);
+}
+void
 Communicator::Send(const spob::Ack& a, uint32_t to)
 {
   DoSend(a, to);
@@ -94,3 +104,18 @@ Communicator::Send(const spob::ReconnectResponse& recon_resp, uint32_t to)
 {
   DoSend(recon_resp, to);
 }
+void
+Communicator::Send(const spob::Snapshot& s, uint32_t to)
+{
+  DoSend(s, to);
+}
+void
+Communicator::Send(const spob::Observe& o, uint32_t to)
+{
+  DoSend(o, to);
+}
+void
+Communicator::Send(const spob::ObserveCommit& oc, uint32_t to)
+{
+  DoSend(oc, to);
+}
@@ -14,13 +14,18 @@ public:
   void Send(const spob::NakTree& nt, uint32_t to);
   void Send(const spob::RecoverPropose& rp, uint32_t to);
   void Send(const spob::AckRecover& ar, uint32_t to);
+  void Send(const spob::AckRecoverChunk& arc, uint32_t to);
   void Send(const spob::RecoverReconnect& rr, uint32_t to);
   void Send(const spob::RecoverCommit& rc, uint32_t to);
   void Send(const spob::Propose& p, uint32_t to);
+  void Send(const spob::ProposeBatch& pb, uint32_t to);
   void Send(const spob::Ack& a, uint32_t to);
   void Send(const spob::Commit& c, uint32_t to);
   void Send(const spob::Reconnect& r, uint32_t to);
   void Send(const spob::ReconnectResponse& recon_resp, uint32_t to);
+  void Send(const spob::Snapshot& s, uint32_t to);
+  void Send(const spob::Observe& o, uint32_t to);
+  void Send(const spob::ObserveCommit& oc, uint32_t to);
 private:
   template <typename T>
   void DoSend(const T& t, uint32_t to);
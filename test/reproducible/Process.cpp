@@ -1,5 +1,98 @@
 #include "Process.hpp"
 
+#include <algorithm>
+#include <sstream>
+
+#include <boost/lexical_cast.hpp>
+
+namespace {
+  spob::StateMachine::BatchPolicy
+  MakeBatchPolicy()
+  {
+    spob::StateMachine::BatchPolicy policy;
+    policy.max_messages_ = batch_size;
+    return policy;
+  }
+
+  spob::StateMachine::AckPolicy
+  MakeAckPolicy()
+  {
+    spob::StateMachine::AckPolicy policy;
+    policy.max_pending_ = ack_size;
+    return policy;
+  }
+
+  spob::StateMachine::CommitPolicy
+  MakeCommitPolicy()
+  {
+    spob::StateMachine::CommitPolicy policy;
+    policy.piggyback_ = piggyback;
+    return policy;
+  }
+
+  spob::StateMachine::TreePolicy
+  MakeTreePolicy()
+  {
+    spob::StateMachine::TreePolicy policy;
+    policy.fanout_ = fanout;
+    if (ranks_per_host > 0) {
+      for (uint32_t i = 0; i < size; ++i) {
+        policy.hosts_.push_back(i / ranks_per_host);
+      }
+    }
+    return policy;
+  }
+
+  spob::StateMachine::RecoverPolicy
+  MakeRecoverPolicy()
+  {
+    spob::StateMachine::RecoverPolicy policy;
+    policy.max_bytes_ = chunk_bytes;
+    policy.max_chunks_ = chunk_credit;
+    return policy;
+  }
+
+  spob::Wal*
+  MakeWal(uint32_t rank)
+  {
+    if (wal_dir.empty()) {
+      return 0;
+    }
+    // Small segments, so that checkpoints reclaim some of them
+    return new spob::Wal(wal_dir + "/" + boost::lexical_cast<std::string>(rank),
+                         spob::Wal::kNone, 1 << 12);
+  }
+
+  spob::SegmentWriter*
+  MakeSegment(uint32_t rank)
+  {
+    if (segment_dir.empty()) {
+      return 0;
+    }
+    // Small segments, so that tailing crosses several of them
+    return new spob::SegmentWriter(segment_dir + "/" +
+                                   boost::lexical_cast<std::string>(rank),
+                                   1 << 12);
+  }
+
+  spob::StateMachine::DeliveryPolicy
+  MakeDeliveryPolicy(spob::SegmentWriter* segment)
+  {
+    spob::StateMachine::DeliveryPolicy policy;
+    policy.segment_ = segment;
+    return policy;
+  }
+
+  spob::StateMachine::DurabilityPolicy
+  MakeDurabilityPolicy(spob::Wal* wal)
+  {
+    spob::StateMachine::DurabilityPolicy policy;
+    policy.wal_ = wal;
+    policy.max_pending_ = wal_group;
+    return policy;
+  }
+}
+
 Process::MessageHandler::MessageHandler(Process& p) : p_(p) {}
 
 template <typename T>
@@ -13,14 +106,20 @@ void Process::MessageHandler::operator()(T& message) const
 }
 
 Process::Process(uint32_t rank)
-  : comm_(*this), sm_(rank, size, comm_, *this), queues_(size),
+  : comm_(*this), wal_(MakeWal(rank)), segment_(MakeSegment(rank)),
+    sm_(rank, size, comm_, *this, MakeBatchPolicy(), MakeAckPolicy(),
+        MakeCommitPolicy(), spob::StateMachine::WindowPolicy(),
+        MakeTreePolicy(), MakeRecoverPolicy(),
+        MakeDurabilityPolicy(wal_.get()), MakeDeliveryPolicy(segment_.get())),
+    queues_(size + observers),
     mh_(*this), rank_(rank),
-    pending_messages_(0), active_(false), failed_(false)
+    pending_messages_(0), active_(false), failed_(false), can_propose_(false),
+    completion_failed_(false)
 {
 }
 
 void
-Process::operator()(boost::coroutines::coroutine<void()>::caller_type& ca)
+Process::operator()(boost::coroutines::asymmetric_coroutine<void>::push_type& ca)
 {
   ca_ = &ca;
   sm_.Start();
@@ -36,12 +135,22 @@ Process::operator()(boost::coroutines::coroutine<void()>::caller_type& ca)
         pending_queues_.erase(index);
       }
       pending_messages_--;
+      if (pending_messages_ == 0) {
+        // Nothing else to process, so send anything held back
+        sm_.Flush();
+      }
       if (pending_messages_ == 0 && unreported_.empty()) {
         runnable_processes.erase(this);
       }
     } else if (boost::get<Propose>(&command_)) {
       num_proposals++;
-      sm_.Propose("test");
+      sm_.Propose(spob::Payload(std::string("test")),
+                  boost::bind(&Process::Complete, this,
+                              boost::placeholders::_1,
+                              boost::placeholders::_2));
+      if (num_proposals == max_proposals) {
+        sm_.Flush();
+      }
     } else if (Notify* n = boost::get<Notify>(&command_)) {
       uint32_t failed = n->failed;
       unreported_.erase(failed);
@@ -59,8 +168,45 @@ Process::operator()(boost::coroutines::coroutine<void()>::caller_type& ca)
 }
 
 void
-Process::operator()(uint64_t id, const std::string& message)
+Process::operator()(uint64_t id, const spob::Payload& message)
 {
+  delivered_.push_back(id);
+}
+
+bool
+Process::TakeSnapshot(uint64_t mid, spob::Payload* state)
+{
+  // Our state is the list of ids delivered so far
+  std::ostringstream str;
+  for (std::vector<uint64_t>::const_iterator it = delivered_.begin();
+       it != delivered_.end(); ++it) {
+    str << *it << " ";
+  }
+  *state = spob::Payload(str.str());
+  return true;
+}
+
+void
+Process::InstallSnapshot(uint64_t mid, const spob::Payload& state)
+{
+  std::istringstream str(state.str());
+  delivered_.clear();
+  uint64_t id;
+  while (str >> id) {
+    delivered_.push_back(id);
+  }
+}
+
+void
+Process::Complete(uint64_t id, spob::StateMachine::Outcome outcome)
+{
+  // A proposal completes once we have delivered it
+  if (outcome == spob::StateMachine::kCommitted &&
+      !std::binary_search(delivered_.begin(), delivered_.end(), id)) {
+    std::cout << "Process " << rank_ << " completed 0x" << std::hex << id <<
+      std::dec << " without delivering it" << std::endl;
+    completion_failed_ = true;
+  }
 }
 
 void
@@ -77,7 +223,13 @@ Process::operator()(spob::StateMachine::Status status, uint32_t p)
     }
     if (boost::get<Propose>(&command_)) {
       num_proposals++;
-      sm_.Propose("test");
+      sm_.Propose(spob::Payload(std::string("test")),
+                  boost::bind(&Process::Complete, this,
+                              boost::placeholders::_1,
+                              boost::placeholders::_2));
+      if (num_proposals == max_proposals) {
+        sm_.Flush();
+      }
     }
   }
 }
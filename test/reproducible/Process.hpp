@@ -1,8 +1,12 @@
 #pragma once
+#include <iostream>
 #include <queue>
+#include <set>
 #include <vector>
 
+#include <boost/bind/bind.hpp>
 #include <boost/coroutine/all.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/variant.hpp>
 
 #include "Communicator.hpp"
@@ -36,10 +40,15 @@ public:
     Process& p_;
   };
   Process(uint32_t rank);
-  void operator()(boost::coroutines::coroutine<void()>::caller_type& ca);
-  void operator()(uint64_t id, const std::string& message);
+  void operator()(boost::coroutines::asymmetric_coroutine<void>::push_type& ca);
+  void operator()(uint64_t id, const spob::Payload& message);
   void operator()(spob::StateMachine::Status status, uint32_t primary);
+  bool TakeSnapshot(uint64_t mid, spob::Payload* state);
+  void InstallSnapshot(uint64_t mid, const spob::Payload& state);
+  void Complete(uint64_t id, spob::StateMachine::Outcome outcome);
   Communicator comm_;
+  boost::scoped_ptr<spob::Wal> wal_;
+  boost::scoped_ptr<spob::SegmentWriter> segment_;
   spob::StateMachine sm_;
   typedef boost::variant<
     spob::ConstructTree,
@@ -47,17 +56,23 @@ public:
     spob::NakTree,
     spob::RecoverPropose,
     spob::AckRecover,
+    spob::AckRecoverChunk,
     spob::RecoverCommit,
     spob::RecoverReconnect,
     spob::Propose,
+    spob::ProposeBatch,
     spob::Ack,
     spob::Commit,
     spob::Reconnect,
-    spob::ReconnectResponse> Message;
+    spob::ReconnectResponse,
+    spob::Snapshot,
+    spob::Observe,
+    spob::ObserveCommit> Message;
   std::vector<std::queue<Message> > queues_;
   std::set<uint32_t> pending_queues_;
   std::set<uint32_t> unreported_;
-  boost::coroutines::coroutine<void()>::caller_type* ca_;
+  std::vector<uint64_t> delivered_;
+  boost::coroutines::asymmetric_coroutine<void>::push_type* ca_;
   boost::variant<Receive, Propose, Continue, Notify> command_;
   MessageHandler mh_;
   uint32_t rank_;
@@ -65,4 +80,5 @@ public:
   bool active_;
   bool failed_;
   bool can_propose_;
+  bool completion_failed_;
 };
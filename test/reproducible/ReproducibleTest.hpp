@@ -1,15 +1,28 @@
 #pragma once
 
 #include <random>
+#include <set>
+#include <string>
 #include <vector>
 
 class Process;
 
 extern std::vector<Process*> processes;
 extern uint32_t size;
+extern uint32_t observers;
 extern bool verbose;
 extern std::set<Process*> runnable_processes;
 extern int primary;
 extern int max_proposals;
 extern int num_proposals;
+extern uint32_t batch_size;
+extern uint32_t ack_size;
+extern bool piggyback;
+extern uint32_t fanout;
+extern uint32_t ranks_per_host;
+extern uint64_t chunk_bytes;
+extern uint32_t chunk_credit;
+extern std::string wal_dir;
+extern uint32_t wal_group;
+extern std::string segment_dir;
 extern std::set<Process*> notify_processes;
@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <cstdlib>
+#include <functional>
+#include <sstream>
 
 #include <boost/coroutine/all.hpp>
 #include <boost/program_options.hpp>
@@ -6,15 +9,27 @@
 #include "Process.hpp"
 #include "ReproducibleTest.hpp"
 
-typedef boost::coroutines::coroutine<void()> coroutine_t;
+typedef boost::coroutines::asymmetric_coroutine<void>::pull_type coroutine_t;
+typedef boost::coroutines::asymmetric_coroutine<void>::push_type caller_t;
 
 std::vector<Process*> processes;
 uint32_t size;
+uint32_t observers;
 bool verbose;
 std::set<Process*> runnable_processes;
 int primary = -1;
 int max_proposals;
 int num_proposals = 0;
+uint32_t batch_size;
+uint32_t ack_size;
+bool piggyback;
+uint32_t fanout;
+uint32_t ranks_per_host;
+uint64_t chunk_bytes;
+uint32_t chunk_credit;
+std::string wal_dir;
+uint32_t wal_group;
+std::string segment_dir;
 
 namespace po = boost::program_options;
 
@@ -29,12 +44,34 @@ int main (int argc, char* argv[])
       ("help", "produce help message")
       ("v", po::value<bool>(&verbose)->default_value(false), "enable verbose output")
       ("np", po::value<uint32_t>(&size)->required(), "set number of processes")
+      ("no", po::value<uint32_t>(&observers)->default_value(0),
+       "set number of observers, which join as ranks np and up")
       ("nm", po::value<int>(&max_proposals)->required(), "set number of messages")
       ("p-prop", po::value<double>(&propose_probability)->required(),
        "set proposal probability")
       ("p-fail", po::value<double>(&failure_probability)->required(),
        "set failure probability")
       ("seed", po::value<int>(&seed)->required(), "set random number seed")
+      ("bs", po::value<uint32_t>(&batch_size)->default_value(1),
+       "set max number of proposals per batch")
+      ("ack", po::value<uint32_t>(&ack_size)->default_value(1),
+       "set max number of proposals acknowledged by one ack")
+      ("piggyback", po::value<bool>(&piggyback)->default_value(false),
+       "piggyback commits on proposals")
+      ("fanout", po::value<uint32_t>(&fanout)->default_value(2),
+       "set max number of children per process")
+      ("ppn", po::value<uint32_t>(&ranks_per_host)->default_value(0),
+       "build the tree as if each run of this many ranks shared a host")
+      ("chunk", po::value<uint64_t>(&chunk_bytes)->default_value(0),
+       "set max number of bytes per recovery chunk (0 for no limit)")
+      ("credit", po::value<uint32_t>(&chunk_credit)->default_value(0),
+       "set max number of recovery chunks in flight (0 for no limit)")
+      ("wal", po::value<std::string>(&wal_dir)->default_value(""),
+       "log to a write-ahead log under this directory (empty for none)")
+      ("ws", po::value<uint32_t>(&wal_group)->default_value(1),
+       "set max number of proposals per write-ahead log sync")
+      ("segment", po::value<std::string>(&segment_dir)->default_value(""),
+       "append deliveries to segments under this directory (empty for none)")
       ;
 
     po::variables_map vm;
@@ -51,16 +88,18 @@ int main (int argc, char* argv[])
     return 1;
   }
 
-  processes.resize(size);
-  for (uint32_t i = 0; i < size; ++i) {
+  processes.resize(size + observers);
+  for (uint32_t i = 0; i < processes.size(); ++i) {
     processes[i] = new Process(i);
   }
 
   std::set<Process*> alive_processes(processes.begin(), processes.end());
 
   std::vector<coroutine_t> coroutines;
-  for (uint32_t i = 0; i < size; ++i) {
-    coroutines.push_back(coroutine_t(*processes[i]));
+  for (uint32_t i = 0; i < processes.size(); ++i) {
+    Process* p = processes[i];
+    coroutines.push_back(coroutine_t([p](caller_t& ca) { (*p)(ca); },
+                                     boost::coroutines::attributes(1 << 20)));
   }
 
   std::default_random_engine rng(seed);
@@ -78,8 +117,8 @@ int main (int argc, char* argv[])
       uint32_t next = dist(rng);
       std::set<Process*>::iterator it = alive_processes.begin();
       std::advance(it, next);
-      alive_processes.erase(it);
       Process* p = *it;
+      alive_processes.erase(it);
       if (verbose) {
         std::cout << "Process " << p->rank_ << " failed" << std::endl;
       }
@@ -134,5 +173,70 @@ int main (int argc, char* argv[])
       }
     }
   }
+
+  // Every process must have delivered a prefix of the same, strictly
+  // increasing sequence
+  Process* longest = processes[0];
+  for (uint32_t i = 1; i < processes.size(); ++i) {
+    if (processes[i]->delivered_.size() > longest->delivered_.size()) {
+      longest = processes[i];
+    }
+  }
+  std::vector<uint64_t>::const_iterator repeat =
+    std::adjacent_find(longest->delivered_.begin(), longest->delivered_.end(),
+                       std::greater_equal<uint64_t>());
+  if (repeat != longest->delivered_.end()) {
+    std::cout << "Process " << longest->rank_ << " delivered 0x" << std::hex <<
+      *(repeat + 1) << " after 0x" << *repeat << std::dec << std::endl;
+    return EXIT_FAILURE;
+  }
+  for (uint32_t i = 0; i < processes.size(); ++i) {
+    const std::vector<uint64_t>& d = processes[i]->delivered_;
+    std::pair<std::vector<uint64_t>::const_iterator,
+              std::vector<uint64_t>::const_iterator> mismatch =
+      std::mismatch(d.begin(), d.end(), longest->delivered_.begin());
+    if (mismatch.first != d.end()) {
+      std::cout << "Process " << i << " delivered 0x" << std::hex <<
+        *mismatch.first << std::dec << " where " << longest->rank_ <<
+        " delivered 0x" << std::hex << *mismatch.second << std::dec <<
+        std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  for (uint32_t i = 0; i < processes.size(); ++i) {
+    if (processes[i]->completion_failed_) {
+      return EXIT_FAILURE;
+    }
+  }
+  // Tailing a process's segments must give back what it delivered
+  if (!segment_dir.empty()) {
+    for (uint32_t i = 0; i < processes.size(); ++i) {
+      spob::SegmentReader reader(segment_dir + "/" + std::to_string(i));
+      spob::SegmentReader::Record record;
+      std::vector<uint64_t> tailed;
+      while (reader.Next(&record)) {
+        if (record.type_ == spob::SegmentReader::Record::kSnapshot) {
+          std::istringstream str(std::string(record.data_, record.size_));
+          tailed.clear();
+          uint64_t id;
+          while (str >> id) {
+            tailed.push_back(id);
+          }
+        } else {
+          tailed.push_back(record.mid_);
+        }
+      }
+      if (tailed != processes[i]->delivered_) {
+        std::cout << "Process " << i << " segments hold " << tailed.size() <<
+          " of its " << processes[i]->delivered_.size() << " deliveries" <<
+          std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if (verbose) {
+    std::cout << "Delivered " << longest->delivered_.size() << " of " <<
+      num_proposals << " proposals" << std::endl;
+  }
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,328 @@
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Submitter.hpp"
+
+using namespace spob;
+
+namespace {
+  int failures = 0;
+
+  void
+  Fail(const std::string& what, const std::string& message)
+  {
+    std::cerr << "FAIL " << what << ": " << message << std::endl;
+    failures++;
+  }
+
+  class Recorder : public StateMachine::Callback {
+  public:
+    Recorder() : status_(StateMachine::kRecovering) {}
+    void operator()(uint64_t id, const Payload& message)
+    {
+      delivered_.push_back(message.str());
+    }
+    void operator()(StateMachine::Status status, uint32_t primary)
+    {
+      status_ = status;
+    }
+    StateMachine::Status status_;
+    std::vector<std::string> delivered_;
+  };
+
+  // Delivers between the StateMachines of one process, in the order
+  // sent, whenever the test pumps it
+  class Loopback : public CommunicatorInterface {
+  public:
+    typedef std::deque<std::function<void ()> > Queue;
+    Loopback(uint32_t rank, Queue& queue, std::vector<StateMachine*>& sms)
+      : rank_(rank), queue_(queue), sms_(sms) {}
+    void Send(const ConstructTree& ct, uint32_t to) { DoSend(ct, to); }
+    void Send(const AckTree& at, uint32_t to) { DoSend(at, to); }
+    void Send(const NakTree& nt, uint32_t to) { DoSend(nt, to); }
+    void Send(const RecoverPropose& rp, uint32_t to) { DoSend(rp, to); }
+    void Send(const AckRecover& ar, uint32_t to) { DoSend(ar, to); }
+    void Send(const AckRecoverChunk& arc, uint32_t to) { DoSend(arc, to); }
+    void Send(const RecoverCommit& rc, uint32_t to) { DoSend(rc, to); }
+    void Send(const RecoverReconnect& rr, uint32_t to) { DoSend(rr, to); }
+    void Send(const Propose& p, uint32_t to) { DoSend(p, to); }
+    void Send(const ProposeBatch& pb, uint32_t to) { DoSend(pb, to); }
+    void Send(const Ack& a, uint32_t to) { DoSend(a, to); }
+    void Send(const Commit& c, uint32_t to) { DoSend(c, to); }
+    void Send(const Reconnect& r, uint32_t to) { DoSend(r, to); }
+    void Send(const ReconnectResponse& recon_resp, uint32_t to)
+    {
+      DoSend(recon_resp, to);
+    }
+    void Send(const Snapshot& s, uint32_t to) { DoSend(s, to); }
+    void Send(const Observe& o, uint32_t to) { DoSend(o, to); }
+    void Send(const ObserveCommit& oc, uint32_t to) { DoSend(oc, to); }
+  private:
+    template <typename T>
+    void DoSend(const T& t, uint32_t to)
+    {
+      std::vector<StateMachine*>& sms = sms_;
+      uint32_t from = rank_;
+      queue_.push_back([&sms, t, to, from]() { sms[to]->Receive(t, from); });
+    }
+    uint32_t rank_;
+    Queue& queue_;
+    std::vector<StateMachine*>& sms_;
+  };
+
+  // A primary and one follower, talking through Loopback
+  class Group {
+  public:
+    Group()
+    {
+      for (uint32_t i = 0; i < 2; ++i) {
+        comms_.push_back(new Loopback(i, queue_, sms_));
+        recorders_.push_back(new Recorder);
+      }
+      for (uint32_t i = 0; i < 2; ++i) {
+        sms_.push_back(new StateMachine(i, 2, *comms_[i], *recorders_[i]));
+      }
+      for (uint32_t i = 0; i < 2; ++i) {
+        sms_[i]->Start();
+      }
+    }
+    ~Group()
+    {
+      for (uint32_t i = 0; i < 2; ++i) {
+        delete sms_[i];
+        delete comms_[i];
+        delete recorders_[i];
+      }
+    }
+    // Delivers everything sent, including what that sends in turn
+    void Pump()
+    {
+      while (!queue_.empty()) {
+        std::function<void ()> deliver;
+        deliver.swap(queue_.front());
+        queue_.pop_front();
+        deliver();
+      }
+    }
+    StateMachine& sm(uint32_t rank) { return *sms_[rank]; }
+    Recorder& recorder(uint32_t rank) { return *recorders_[rank]; }
+  private:
+    Loopback::Queue queue_;
+    std::vector<Loopback*> comms_;
+    std::vector<Recorder*> recorders_;
+    std::vector<StateMachine*> sms_;
+  };
+
+  // Counts the outcomes of the handlers it makes
+  class Outcomes {
+  public:
+    Outcomes() : committed_(0), lost_(0), bad_ids_(0) {}
+    StateMachine::CompletionHandler Handler()
+    {
+      return [this](uint64_t id, StateMachine::Outcome outcome) {
+        if (outcome == StateMachine::kCommitted) {
+          committed_++;
+          bad_ids_ += id == 0;
+        } else {
+          lost_++;
+          bad_ids_ += id != 0;
+        }
+      };
+    }
+    uint32_t committed_;
+    uint32_t lost_;
+    uint32_t bad_ids_;
+  };
+
+  // Drained while we recover to lead, proposals wait for us to lead
+  void
+  Recovering()
+  {
+    const std::string what = "recovering primary";
+    Group group;
+    Submitter submitter;
+    Outcomes outcomes;
+    for (uint32_t i = 0; i < 3; ++i) {
+      submitter.Submit(Payload(std::string("r")), outcomes.Handler());
+    }
+    if (group.sm(0).leading() || !group.sm(0).primary()) {
+      Fail(what, "not recovering to lead");
+      return;
+    }
+    if (submitter.Drain(group.sm(0)) != 0 ||
+        outcomes.committed_ + outcomes.lost_ > 0) {
+      Fail(what, "did not keep proposals queued");
+    }
+    group.Pump();
+    if (group.recorder(0).status_ != StateMachine::kLeading) {
+      Fail(what, "did not lead");
+      return;
+    }
+    if (submitter.Drain(group.sm(0)) != 3) {
+      Fail(what, "did not propose what was queued once leading");
+    }
+    group.Pump();
+    if (outcomes.committed_ != 3 || outcomes.bad_ids_ > 0 ||
+        group.recorder(1).delivered_.size() != 3) {
+      Fail(what, "did not commit what was queued");
+    }
+  }
+
+  // Drained while another rank is primary, proposals fail at once
+  void
+  Following()
+  {
+    const std::string what = "follower";
+    Group group;
+    group.Pump();
+    Submitter submitter;
+    Outcomes outcomes;
+    submitter.Submit(Payload(std::string("f")), outcomes.Handler());
+    std::future<StateMachine::Outcome> future =
+      submitter.Submit(Payload(std::string("f")));
+    if (submitter.Drain(group.sm(1)) != 0 || outcomes.lost_ != 1 ||
+        outcomes.bad_ids_ > 0) {
+      Fail(what, "did not fail the handler");
+    }
+    if (future.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready ||
+        future.get() != StateMachine::kLeadershipLost) {
+      Fail(what, "did not fail the future");
+    }
+    if (submitter.Drain(group.sm(1)) != 0) {
+      Fail(what, "proposed after failing everything");
+    }
+  }
+
+  // Destroyed with proposals held and queued, all of them fail
+  void
+  Destroyed()
+  {
+    const std::string what = "destroyed";
+    Group group;
+    Outcomes outcomes;
+    std::vector<std::future<StateMachine::Outcome> > futures;
+    {
+      Submitter submitter;
+      for (uint32_t i = 0; i < 2; ++i) {
+        submitter.Submit(Payload(std::string("d")), outcomes.Handler());
+        futures.push_back(submitter.Submit(Payload(std::string("d"))));
+      }
+      // Recovering to lead, so the first is held and the rest queued
+      if (submitter.Drain(group.sm(0)) != 0) {
+        Fail(what, "proposed while recovering");
+      }
+    }
+    if (outcomes.lost_ != 2 || outcomes.committed_ > 0 ||
+        outcomes.bad_ids_ > 0) {
+      Fail(what, "did not fail the handlers");
+    }
+    for (size_t i = 0; i < futures.size(); ++i) {
+      try {
+        if (futures[i].get() != StateMachine::kLeadershipLost) {
+          Fail(what, "did not fail the futures");
+        }
+      } catch (const std::future_error& e) {
+        Fail(what, e.what());
+      }
+    }
+  }
+
+  // Producer threads submit while this thread drains. Everything must be
+  // delivered exactly once, each producer's in the order it submitted,
+  // and complete as committed
+  void
+  Threads(uint32_t producers, uint32_t each)
+  {
+    std::ostringstream strm;
+    strm << producers << " producers";
+    const std::string what = strm.str();
+    Group group;
+    group.Pump();
+    Submitter submitter;
+    Outcomes outcomes;
+    std::vector<std::thread> threads;
+    std::atomic<uint32_t> futures_committed(0);
+    for (uint32_t p = 0; p < producers; ++p) {
+      // Half take handlers, which run on this thread, and half futures
+      StateMachine::CompletionHandler handler =
+        p % 2 == 0 ? outcomes.Handler() : StateMachine::CompletionHandler();
+      threads.push_back(std::thread([&submitter, &futures_committed, handler,
+                                     p, each]() {
+        std::vector<std::future<StateMachine::Outcome> > futures;
+        for (uint32_t i = 0; i < each; ++i) {
+          std::ostringstream message;
+          message << p << " " << i;
+          if (handler) {
+            submitter.Submit(Payload(message.str()), handler);
+          } else {
+            futures.push_back(submitter.Submit(Payload(message.str())));
+          }
+        }
+        for (size_t i = 0; i < futures.size(); ++i) {
+          futures_committed += futures[i].get() == StateMachine::kCommitted;
+        }
+      }));
+    }
+    uint64_t total = static_cast<uint64_t>(producers) * each;
+    const std::vector<std::string>& delivered = group.recorder(1).delivered_;
+    while (delivered.size() < total) {
+      submitter.Drain(group.sm(0));
+      group.Pump();
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+      threads[i].join();
+    }
+    group.Pump();
+    if (submitter.Drain(group.sm(0)) != 0 || delivered.size() != total) {
+      Fail(what, "delivered more than was submitted");
+    }
+    std::vector<uint32_t> next(producers, 0);
+    for (size_t i = 0; i < delivered.size(); ++i) {
+      std::istringstream message(delivered[i]);
+      uint32_t p = producers;
+      uint32_t seq = 0;
+      message >> p >> seq;
+      if (p >= producers || seq != next[p]) {
+        Fail(what, "delivered " + delivered[i] + " out of order");
+        return;
+      }
+      next[p]++;
+    }
+    uint32_t handlers = (producers + 1) / 2;
+    if (outcomes.committed_ != handlers * each || outcomes.lost_ > 0 ||
+        outcomes.bad_ids_ > 0) {
+      Fail(what, "handlers did not all commit");
+    }
+    if (futures_committed != (producers - handlers) * each) {
+      Fail(what, "futures did not all commit");
+    }
+  }
+}
+
+int main()
+{
+  Recovering();
+  Following();
+  Destroyed();
+  Threads(1, 100000);
+  Threads(4, 50000);
+  Threads(16, 10000);
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "All passed" << std::endl;
+  return 0;
+}
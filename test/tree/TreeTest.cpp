@@ -0,0 +1,157 @@
+#include <stdint.h>
+
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Spob.hpp"
+
+using namespace spob;
+
+namespace {
+  int failures = 0;
+
+  void
+  Fail(const std::string& what, const std::string& message)
+  {
+    std::cerr << "FAIL " << what << ": " << message << std::endl;
+    failures++;
+  }
+
+  // Keeps the ConstructTree sent to each child, and drops the rest
+  class Recorder : public CommunicatorInterface {
+  public:
+    void Send(const ConstructTree& ct, uint32_t to)
+    {
+      children_[to] = ct.max_rank_;
+    }
+    void Send(const AckTree& at, uint32_t to) {}
+    void Send(const NakTree& nt, uint32_t to) {}
+    void Send(const RecoverPropose& rp, uint32_t to) {}
+    void Send(const AckRecover& ar, uint32_t to) {}
+    void Send(const AckRecoverChunk& arc, uint32_t to) {}
+    void Send(const RecoverCommit& rc, uint32_t to) {}
+    void Send(const RecoverReconnect& rr, uint32_t to) {}
+    void Send(const Propose& p, uint32_t to) {}
+    void Send(const ProposeBatch& pb, uint32_t to) {}
+    void Send(const Ack& a, uint32_t to) {}
+    void Send(const Commit& c, uint32_t to) {}
+    void Send(const Reconnect& r, uint32_t to) {}
+    void Send(const ReconnectResponse& recon_resp, uint32_t to) {}
+    void Send(const Snapshot& s, uint32_t to) {}
+    void Send(const Observe& o, uint32_t to) {}
+    void Send(const ObserveCommit& oc, uint32_t to) {}
+    // Each child and the highest rank of its subtree
+    std::map<uint32_t, uint32_t> children_;
+  };
+
+  class Ignore : public StateMachine::Callback {
+  public:
+    void operator()(uint64_t id, const Payload& message) {}
+    void operator()(StateMachine::Status status, uint32_t primary) {}
+  };
+
+  std::string
+  Print(const std::map<uint32_t, uint32_t>& children)
+  {
+    std::ostringstream strm;
+    for (std::map<uint32_t, uint32_t>::const_iterator it = children.begin();
+         it != children.end(); ++it) {
+      strm << " " << it->first << "-" << it->second;
+    }
+    return strm.str();
+  }
+
+  // Starts rank 0 of size ranks, which leads at once, and checks the
+  // children it picks, each given as its rank and the highest rank of
+  // its subtree
+  void
+  Check(const std::string& what, uint32_t size,
+        const std::vector<uint32_t>& hosts, uint32_t fanout,
+        const std::map<uint32_t, uint32_t>& expected)
+  {
+    StateMachine::TreePolicy tree_policy;
+    tree_policy.fanout_ = fanout;
+    tree_policy.hosts_ = hosts;
+    Recorder comm;
+    Ignore cb;
+    StateMachine sm(0, size, comm, cb, StateMachine::BatchPolicy(),
+                    StateMachine::AckPolicy(), StateMachine::CommitPolicy(),
+                    StateMachine::WindowPolicy(), tree_policy);
+    sm.Start();
+    if (comm.children_ != expected) {
+      Fail(what, "picked" + Print(comm.children_) + ", not" +
+           Print(expected));
+    }
+  }
+
+  // Two ranks per host, in rank order. Each child's subtree is whole
+  // hosts
+  void
+  Contiguous()
+  {
+    uint32_t hosts[] = {0, 0, 1, 1, 2, 2, 3, 3};
+    std::map<uint32_t, uint32_t> expected;
+    expected[1] = 3;
+    expected[4] = 7;
+    Check("contiguous", 8, std::vector<uint32_t>(hosts, hosts + 8), 2,
+          expected);
+  }
+
+  // Rotated by one, as group 1 numbers the ranks. Host 0 is split between
+  // both ends, so ranges still only break where the host changes, but
+  // rank 7 is reached from host 3 rather than from rank 0
+  void
+  Rotated()
+  {
+    uint32_t hosts[] = {0, 1, 1, 2, 2, 3, 3, 0};
+    std::map<uint32_t, uint32_t> expected;
+    expected[1] = 4;
+    expected[5] = 7;
+    Check("rotated", 8, std::vector<uint32_t>(hosts, hosts + 8), 2,
+          expected);
+  }
+
+  // Round robin over two hosts. Every rank is a run of its own, so the
+  // split is the same as with no map
+  void
+  RoundRobin()
+  {
+    uint32_t hosts[] = {0, 1, 0, 1, 0, 1, 0, 1};
+    std::map<uint32_t, uint32_t> expected;
+    expected[1] = 3;
+    expected[4] = 7;
+    Check("round robin", 8, std::vector<uint32_t>(hosts, hosts + 8), 2,
+          expected);
+  }
+
+  // Ranks 6 and 7 are past the map. Neither shares host 6 with ranks 4
+  // and 5, nor a host with each other
+  void
+  Unmapped()
+  {
+    uint32_t hosts[] = {0, 0, 0, 0, 6, 6};
+    std::map<uint32_t, uint32_t> expected;
+    expected[1] = 5;
+    expected[6] = 7;
+    Check("unmapped", 8, std::vector<uint32_t>(hosts, hosts + 6), 2,
+          expected);
+  }
+}
+
+int main()
+{
+  Contiguous();
+  Rotated();
+  RoundRobin();
+  Unmapped();
+
+  if (failures > 0) {
+    std::cerr << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "All passed" << std::endl;
+  return 0;
+}